@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <raylib.h>
+
+#include "explode.h"
+#include "gif_load.h"
+#include "gif_save.h"
+#include "overlay_cache.h"
+#include "overlay_pack.h"
+#include "resize.h"
+#include "util/arena_pool.h"
+#include "util/magick.h"
+
+#define ARENA_IMPLEMENTATION
+#include "external/arena.h"
+
+// Every benchmark runs at least this many timed iterations...
+#define BENCH_MIN_ITERATIONS 3
+// ...and then keeps going until it has run for this long, or this many times
+#define BENCH_MIN_SECONDS 1.0
+#define BENCH_MAX_ITERATIONS 100
+
+#define BENCH_MAX_SIZES 16
+
+// Frames of a converted image: the source image, every explode level, then
+// the overlay
+#define BENCH_FRAMES_COUNT (1 + EXPLODE_LEVELS_COUNT + OVERLAY_FRAMES_COUNT)
+
+// Bytes asked to malloc, calloc and realloc by the generator itself. Shared
+// libraries such as zlib and ImageMagick aren't counted.
+static atomic_size_t bench_allocated = 0;
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocated, size, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocated, count * size, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&bench_allocated, size, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+#endif
+
+typedef struct {
+    const char* filter;
+    FILE* output;
+    const char* temp_dir;
+    bool first_result;
+} Bench;
+
+typedef bool (*BenchRun)(void* arg);
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Runs `run` once to warm up caches and pools, then times it. `pixels` is the
+// amount of pixels one run processes. Returns false if a run failed, as the
+// timings would be meaningless.
+static bool bench_measure(Bench* bench, const char* name, int size, size_t pixels, BenchRun run, void* arg)
+{
+    if (bench->filter != NULL && strstr(name, bench->filter) == NULL)
+        return true;
+
+    if (!run(arg)) {
+        fprintf(stderr, "ERROR: benchmark `%s` failed at %dpx\n", name, size);
+        return false;
+    }
+
+    double times[BENCH_MAX_ITERATIONS];
+    size_t iterations = 0;
+    double total = 0;
+    size_t allocated_before = atomic_load(&bench_allocated);
+    while (iterations < BENCH_MIN_ITERATIONS
+           || (total < BENCH_MIN_SECONDS && iterations < BENCH_MAX_ITERATIONS)) {
+        double start = bench_now();
+        bool ok = run(arg);
+        times[iterations] = bench_now() - start;
+        if (!ok) {
+            fprintf(stderr, "ERROR: benchmark `%s` failed at %dpx after %zu runs\n", name, size, iterations);
+            return false;
+        }
+        total += times[iterations];
+        iterations++;
+    }
+    size_t allocated = atomic_load(&bench_allocated) - allocated_before;
+
+    qsort(times, iterations, sizeof(*times), bench_compare_doubles);
+    double median = iterations % 2
+        ? times[iterations / 2]
+        : (times[iterations / 2 - 1] + times[iterations / 2]) / 2;
+    // Nearest rank
+    size_t p95_rank = (95 * iterations + 99) / 100;
+    double p95 = times[p95_rank - 1];
+
+    fprintf(bench->output,
+            "%s\n    {\"name\": \"%s\", \"size\": %d, \"iterations\": %zu, "
+            "\"median_ms\": %.4f, \"p95_ms\": %.4f, \"mpix_per_s\": %.2f, \"bytes_allocated\": %zu}",
+            bench->first_result ? "" : ",",
+            name, size, iterations,
+            median * 1e3, p95 * 1e3, median > 0 ? pixels / median / 1e6 : 0.0,
+            allocated / iterations);
+    fflush(bench->output);
+    bench->first_result = false;
+    return true;
+}
+
+// Opaque pixels with some detail, surrounded by transparency, like an emoji
+static Image bench_image(int size)
+{
+    uint32_t* pixels = malloc((size_t)size * size * sizeof(uint32_t));
+    uint32_t state = 0x9e3779b9;
+    float radius = size / 2.0f;
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+
+            float dx = x - radius;
+            float dy = y - radius;
+            bool inside = dx * dx + dy * dy < radius * radius * 0.8f;
+
+            uint8_t r = x * 255 / size;
+            uint8_t g = y * 255 / size;
+            uint8_t b = (state & 0x3f) + 96;
+            uint8_t a = inside ? 255 : 0;
+            pixels[(size_t)y * size + x] = (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16 | (uint32_t)a << 24;
+        }
+    }
+
+    return (Image) {
+        .data = pixels,
+        .width = size,
+        .height = size,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+}
+
+typedef struct {
+    const Image* src;
+    Image* dst;
+    const ExplodeMap* map;
+    float level;
+    Arena* scratch;
+} BenchExplode;
+
+static bool bench_explode(void* arg)
+{
+    BenchExplode* bench = arg;
+    arena_reset(bench->scratch);
+    image_explode_to(bench->src, bench->dst, bench->map, bench->level, bench->scratch);
+    return true;
+}
+
+typedef struct {
+    OverlaySource source;
+    void* output;
+    int size;
+} BenchResize;
+
+static bool bench_resize(void* arg)
+{
+    BenchResize* bench = arg;
+    return image_resize(bench->source.data, bench->source.width, bench->source.height,
+                        bench->output, bench->size, bench->size, RESIZE_FILTER_CUBIC);
+}
+
+typedef struct {
+    GifFrames frames;
+    const char* path;
+} BenchSave;
+
+static bool bench_save(void* arg)
+{
+    BenchSave* bench = arg;
+    return gif_save(bench->frames, bench->path, false, NULL);
+}
+
+typedef struct {
+    const char* path;
+    void* pixels;
+} BenchLoad;
+
+static bool bench_load(void* arg)
+{
+    BenchLoad* bench = arg;
+    GifReader* reader = gif_reader_open(bench->path);
+    if (reader == NULL)
+        return false;
+
+    while (gif_reader_next(reader, bench->pixels, NULL))
+        ;
+    gif_reader_close(reader);
+    return true;
+}
+
+typedef struct {
+    Image image;
+    const char* path;
+} BenchConvert;
+
+static bool bench_convert(void* arg)
+{
+    BenchConvert* bench = arg;
+    return image_to_explode_gif(bench->image, bench->path, false);
+}
+
+// Every frame kept in memory, as for the window's preview
+static bool bench_convert_in_memory(void* arg)
+{
+    BenchConvert* bench = arg;
+    ExplodeAnimation* animation = explode_animation_create(bench->image, false, NULL);
+    bool saved = animation != NULL && explode_animation_save(animation, bench->path, NULL);
+    explode_animation_destroy(animation);
+    return saved;
+}
+
+static bool bench_size(Bench* bench, int size)
+{
+    Image image = bench_image(size);
+    size_t pixels = (size_t)size * size;
+    size_t animation_pixels = pixels * BENCH_FRAMES_COUNT;
+    // Sizes the application tiles rather than keeping every frame in memory
+    bool tiled = explode_tiled(size, size);
+    char name[64];
+    bool ok = true;
+
+    // Explode, one level at a time
+    {
+        Arena arena = { 0 };
+        ExplodeMap map = explode_map_create(&arena, size, size);
+        Image exploded = image;
+        exploded.data = malloc(pixels * sizeof(uint32_t));
+        Arena scratch = { 0 };
+
+        for (int level = 1; ok && level <= 8; ++level) {
+            BenchExplode explode = { &image, &exploded, &map, level / 8.0f, &scratch };
+            snprintf(name, sizeof(name), "image_explode/level=%d", level);
+            ok = bench_measure(bench, name, size, pixels, bench_explode, &explode);
+        }
+
+        arena_free(&scratch);
+        free(exploded.data);
+        arena_free(&arena);
+    }
+
+    // Resize every overlay frame
+    {
+        OverlaySource sources[OVERLAY_FRAMES_COUNT];
+        overlay_sources(sources);
+        void* output = malloc(pixels * sizeof(uint32_t));
+
+        for (size_t i = 0; ok && i < OVERLAY_FRAMES_COUNT; ++i) {
+            BenchResize resize = { sources[i], output, size };
+            snprintf(name, sizeof(name), "image_resize/overlay=%02zu", i);
+            ok = bench_measure(bench, name, size, pixels, bench_resize, &resize);
+        }
+
+        free(output);
+    }
+
+    // Save and load the animation
+    if (ok) {
+        char gif_path[256];
+        char apng_path[256];
+        snprintf(gif_path, sizeof(gif_path), "%s/bench.gif", bench->temp_dir);
+        snprintf(apng_path, sizeof(apng_path), "%s/bench.png", bench->temp_dir);
+
+        if (!tiled) {
+            ExplodeAnimation* animation = explode_animation_create(image, false, NULL);
+            ok = animation != NULL;
+            if (ok) {
+                GifFrames frames = explode_animation_frames(animation);
+
+                BenchSave save_gif = { frames, gif_path };
+                ok = bench_measure(bench, "gif_save/gif", size, animation_pixels, bench_save, &save_gif);
+                BenchSave save_apng = { frames, apng_path };
+                ok = ok && bench_measure(bench, "gif_save/apng", size, animation_pixels, bench_save, &save_apng);
+
+                explode_animation_destroy(animation);
+            }
+        } else {
+            // Every frame at once would not fit in the tiled budget, so the
+            // files to load are streamed instead
+            ok = image_to_explode_gif(image, gif_path, false) && image_to_explode_gif(image, apng_path, false);
+            if (!ok)
+                fprintf(stderr, "ERROR: could not write the animations to load at %dpx\n", size);
+        }
+
+        void* frame = malloc(pixels * sizeof(uint32_t));
+        BenchLoad load_gif = { gif_path, frame };
+        ok = ok && bench_measure(bench, "gif_load/gif", size, animation_pixels, bench_load, &load_gif);
+        BenchLoad load_apng = { apng_path, frame };
+        ok = ok && bench_measure(bench, "gif_load/apng", size, animation_pixels, bench_load, &load_apng);
+        free(frame);
+
+        unlink(gif_path);
+        unlink(apng_path);
+    }
+
+    // Everything at once
+    if (ok) {
+        char convert_path[256];
+        snprintf(convert_path, sizeof(convert_path), "%s/convert.gif", bench->temp_dir);
+        BenchConvert convert = { image, convert_path };
+        ok = bench_measure(bench, "image_to_explode_gif", size, animation_pixels, bench_convert, &convert);
+        if (!tiled)
+            ok = ok && bench_measure(bench, "image_to_explode_gif/in_memory", size, animation_pixels, bench_convert_in_memory, &convert);
+        unlink(convert_path);
+    }
+
+    free(image.data);
+    return ok;
+}
+
+static void bench_usage(FILE* stream, const char* program)
+{
+    fprintf(stream, "Usage: %s [OPTIONS]\n", program);
+    fprintf(stream, "Time each step of a conversion on synthetic images, and print the results as JSON.\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Options:\n");
+    fprintf(stream, "  -s, --sizes <N,...>    Sizes of the images, in pixels (default: 32,64,128,256,512,1024,2048,4096)\n");
+    fprintf(stream, "  -f, --filter <TEXT>    Only run the benchmarks whose name contains TEXT\n");
+    fprintf(stream, "  -o, --output <FILE>    Write the results to FILE instead of the standard output\n");
+    fprintf(stream, "  -h, --help             Show this help\n");
+}
+
+static size_t bench_parse_sizes(const char* text, int sizes[BENCH_MAX_SIZES])
+{
+    size_t count = 0;
+    while (*text != '\0' && count < BENCH_MAX_SIZES) {
+        char* end;
+        long value = strtol(text, &end, 10);
+        if (end == text || value <= 0 || (*end != ',' && *end != '\0'))
+            return 0;
+        sizes[count++] = value;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    int sizes[BENCH_MAX_SIZES] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+    size_t sizes_count = 8;
+    const char* output_path = NULL;
+    Bench bench = { .first_result = true };
+
+    const struct option options[] = {
+        { "sizes", required_argument, NULL, 's' },
+        { "filter", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { 0 },
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "s:f:o:h", options, NULL)) != -1) {
+        switch (option) {
+        case 's':
+            sizes_count = bench_parse_sizes(optarg, sizes);
+            if (sizes_count == 0) {
+                fprintf(stderr, "ERROR: invalid sizes `%s`\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            bench.filter = optarg;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'h':
+            bench_usage(stdout, argv[0]);
+            return 0;
+        default:
+            bench_usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    // Warns about a missing pack before the results rather than among them
+    overlay_pack_load();
+
+    // The encoders report each file they write on the standard output, which
+    // would end up in the middle of the results.
+    if (output_path != NULL) {
+        bench.output = fopen(output_path, "w");
+    } else {
+        int results_fd = dup(STDOUT_FILENO);
+        bench.output = results_fd >= 0 ? fdopen(results_fd, "w") : NULL;
+    }
+    if (bench.output == NULL) {
+        fprintf(stderr, "ERROR: could not open the output: %s\n", strerror(errno));
+        return 1;
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        fflush(stdout);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    char temp_dir[] = "/tmp/explode-bench-XXXXXX";
+    if (mkdtemp(temp_dir) == NULL) {
+        fprintf(stderr, "ERROR: could not create a temporary directory: %s\n", strerror(errno));
+        return 1;
+    }
+    bench.temp_dir = temp_dir;
+
+    fprintf(bench.output, "{\n  \"benchmarks\": [");
+    bool ok = true;
+    for (size_t i = 0; ok && i < sizes_count; ++i)
+        ok = bench_size(&bench, sizes[i]);
+    fprintf(bench.output, "\n  ]\n}\n");
+    fclose(bench.output);
+
+    rmdir(temp_dir);
+
+    arena_pool_trim();
+    magick_runtime_shutdown();
+
+    return ok ? 0 : 1;
+}
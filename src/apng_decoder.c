@@ -0,0 +1,512 @@
+#include "apng_decoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "decode_limits.h"
+
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_DISPOSE_OP_PREVIOUS 2
+#define APNG_BLEND_OP_SOURCE 0
+
+#define APNG_COLOR_GRAY 0
+#define APNG_COLOR_RGB 2
+#define APNG_COLOR_PALETTE 3
+#define APNG_COLOR_GRAY_ALPHA 4
+#define APNG_COLOR_RGBA 6
+
+// Delay of plain PNG files, read as a single frame
+#define APNG_DEFAULT_DELAY 10
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} ApngRect;
+
+typedef struct {
+    ApngRect rect;
+    int delay;
+    int dispose;
+    int blend;
+} ApngFrameControl;
+
+struct ApngDecoder {
+    const uint8_t* data;
+    size_t size;
+    // Next chunk to read
+    size_t position;
+
+    int width;
+    int height;
+    int bit_depth;
+    int color_type;
+    int channels;
+    uint8_t palette[256][4];
+    // Gray or RGB samples that are fully transparent
+    bool has_transparent_color;
+    uint16_t transparent_color[3];
+
+    bool animated;
+    size_t frames_count;
+    size_t frames_read;
+
+    // Composited RGBA frames: the current one, and the one saved for frames
+    // disposed to previous
+    uint8_t* canvas;
+    uint8_t* saved;
+    // Filtered rows of the frame being decoded, each preceded by its filter
+    uint8_t* raw;
+    // One row converted to RGBA
+    uint8_t* row;
+
+    // Disposal of the frame drawn last, applied before drawing the next one
+    int dispose;
+    ApngRect dispose_rect;
+};
+
+static inline uint32_t apng_read_u32(const uint8_t* data)
+{
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+static inline uint16_t apng_read_u16(const uint8_t* data)
+{
+    return data[0] << 8 | data[1];
+}
+
+// Reads the chunk at `position`. Returns false if it's truncated.
+static bool apng_chunk(const ApngDecoder* decoder, size_t position, const char** type,
+                       const uint8_t** data, size_t* size)
+{
+    if (position + 12 > decoder->size)
+        return false;
+    size_t length = apng_read_u32(&decoder->data[position]);
+    if (length > decoder->size - position - 12)
+        return false;
+
+    *type = (const char*)&decoder->data[position + 4];
+    *data = &decoder->data[position + 8];
+    *size = length;
+    return true;
+}
+
+static size_t apng_row_bytes(const ApngDecoder* decoder, int width)
+{
+    return ((size_t)width * decoder->channels * decoder->bit_depth + 7) / 8;
+}
+
+static bool apng_valid_format(int bit_depth, int color_type)
+{
+    switch (color_type) {
+    case APNG_COLOR_GRAY:
+        return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+    case APNG_COLOR_PALETTE:
+        return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+    case APNG_COLOR_RGB:
+    case APNG_COLOR_GRAY_ALPHA:
+    case APNG_COLOR_RGBA:
+        return bit_depth == 8 || bit_depth == 16;
+    default:
+        return false;
+    }
+}
+
+ApngDecoder* apng_decoder_open(const uint8_t* data, size_t size, bool* failed)
+{
+    *failed = false;
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (size < 8 + 25 || memcmp(data, signature, 8) != 0 || memcmp(&data[12], "IHDR", 4) != 0)
+        return NULL;
+
+    const uint8_t* header = &data[16];
+    uint32_t width = apng_read_u32(&header[0]);
+    uint32_t height = apng_read_u32(&header[4]);
+    int bit_depth = header[8];
+    int color_type = header[9];
+    bool interlaced = header[12] != 0;
+    if (width == 0 || height == 0 || interlaced || !apng_valid_format(bit_depth, color_type))
+        return NULL;
+    if ((uint64_t)width * height > DECODE_MAX_PIXELS) {
+        *failed = true;
+        return NULL;
+    }
+
+    ApngDecoder* decoder = calloc(1, sizeof(*decoder));
+    if (decoder == NULL) {
+        *failed = true;
+        return NULL;
+    }
+    decoder->data = data;
+    decoder->size = size;
+    decoder->position = 8 + 25;
+    decoder->width = width;
+    decoder->height = height;
+    decoder->bit_depth = bit_depth;
+    decoder->color_type = color_type;
+    decoder->channels = color_type == APNG_COLOR_RGBA ? 4
+        : color_type == APNG_COLOR_RGB                ? 3
+        : color_type == APNG_COLOR_GRAY_ALPHA         ? 2
+                                                      : 1;
+    decoder->frames_count = 1;
+    for (int i = 0; i < 256; ++i)
+        decoder->palette[i][3] = 255;
+
+    // Everything that applies to every frame comes before the image data
+    const char* type;
+    const uint8_t* chunk;
+    size_t chunk_size;
+    for (size_t position = decoder->position; apng_chunk(decoder, position, &type, &chunk, &chunk_size);
+         position += chunk_size + 12) {
+        if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0)
+            break;
+
+        if (memcmp(type, "PLTE", 4) == 0) {
+            for (size_t i = 0; i < chunk_size / 3 && i < 256; ++i)
+                memcpy(decoder->palette[i], &chunk[i * 3], 3);
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            if (color_type == APNG_COLOR_PALETTE) {
+                for (size_t i = 0; i < chunk_size && i < 256; ++i)
+                    decoder->palette[i][3] = chunk[i];
+            } else if (color_type == APNG_COLOR_GRAY && chunk_size >= 2) {
+                decoder->has_transparent_color = true;
+                decoder->transparent_color[0] = apng_read_u16(chunk);
+            } else if (color_type == APNG_COLOR_RGB && chunk_size >= 6) {
+                decoder->has_transparent_color = true;
+                for (int c = 0; c < 3; ++c)
+                    decoder->transparent_color[c] = apng_read_u16(&chunk[c * 2]);
+            }
+        } else if (memcmp(type, "acTL", 4) == 0 && chunk_size >= 8 && apng_read_u32(chunk) > 0) {
+            decoder->animated = true;
+            decoder->frames_count = apng_read_u32(chunk);
+        }
+    }
+
+    decoder->canvas = calloc((size_t)width * height, 4);
+    decoder->raw = malloc((apng_row_bytes(decoder, width) + 1) * height);
+    decoder->row = malloc((size_t)width * 4);
+    if (decoder->canvas == NULL || decoder->raw == NULL || decoder->row == NULL) {
+        apng_decoder_close(decoder);
+        *failed = true;
+        return NULL;
+    }
+
+    return decoder;
+}
+
+int apng_decoder_width(const ApngDecoder* decoder)
+{
+    return decoder->width;
+}
+
+int apng_decoder_height(const ApngDecoder* decoder)
+{
+    return decoder->height;
+}
+
+size_t apng_decoder_frames_count(const ApngDecoder* decoder)
+{
+    return decoder->frames_count;
+}
+
+static inline uint8_t apng_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+static bool apng_unfilter_row(uint8_t* row, const uint8_t* previous, size_t size, size_t bpp, int filter)
+{
+    switch (filter) {
+    case 0:
+        break;
+    case 1:
+        for (size_t i = bpp; i < size; ++i)
+            row[i] += row[i - bpp];
+        break;
+    case 2:
+        if (previous) {
+            for (size_t i = 0; i < size; ++i)
+                row[i] += previous[i];
+        }
+        break;
+    case 3:
+        for (size_t i = 0; i < size; ++i) {
+            int left = i >= bpp ? row[i - bpp] : 0;
+            int up = previous ? previous[i] : 0;
+            row[i] += (left + up) / 2;
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < size; ++i) {
+            uint8_t left = i >= bpp ? row[i - bpp] : 0;
+            uint8_t up = previous ? previous[i] : 0;
+            uint8_t up_left = previous && i >= bpp ? previous[i - bpp] : 0;
+            row[i] += apng_paeth(left, up, up_left);
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Sample `index` of a row of `bit_depth` bits per sample
+static inline uint16_t apng_sample(const uint8_t* row, size_t index, int bit_depth)
+{
+    switch (bit_depth) {
+    case 16:
+        return apng_read_u16(&row[index * 2]);
+    case 8:
+        return row[index];
+    default: {
+        size_t bit = index * bit_depth;
+        int shift = 8 - bit_depth - (int)(bit % 8);
+        return (row[bit / 8] >> shift) & ((1 << bit_depth) - 1);
+    }
+    }
+}
+
+static void apng_convert_row(const ApngDecoder* decoder, const uint8_t* row, int width, uint8_t* out)
+{
+    int bit_depth = decoder->bit_depth;
+    int channels = decoder->channels;
+    int max = (1 << bit_depth) - 1;
+
+    for (int x = 0; x < width; ++x) {
+        uint8_t* pixel = &out[x * 4];
+
+        if (decoder->color_type == APNG_COLOR_PALETTE) {
+            memcpy(pixel, decoder->palette[apng_sample(row, x, bit_depth)], 4);
+            continue;
+        }
+
+        uint16_t samples[4];
+        for (int c = 0; c < channels; ++c)
+            samples[c] = apng_sample(row, (size_t)x * channels + c, bit_depth);
+
+        uint8_t values[4];
+        for (int c = 0; c < channels; ++c)
+            values[c] = bit_depth == 16 ? samples[c] >> 8 : samples[c] * 255 / max;
+
+        switch (decoder->color_type) {
+        case APNG_COLOR_GRAY:
+            pixel[0] = pixel[1] = pixel[2] = values[0];
+            pixel[3] = decoder->has_transparent_color && samples[0] == decoder->transparent_color[0] ? 0 : 255;
+            break;
+        case APNG_COLOR_GRAY_ALPHA:
+            pixel[0] = pixel[1] = pixel[2] = values[0];
+            pixel[3] = values[1];
+            break;
+        case APNG_COLOR_RGB:
+            memcpy(pixel, values, 3);
+            pixel[3] = decoder->has_transparent_color
+                    && samples[0] == decoder->transparent_color[0]
+                    && samples[1] == decoder->transparent_color[1]
+                    && samples[2] == decoder->transparent_color[2]
+                ? 0
+                : 255;
+            break;
+        default:
+            memcpy(pixel, values, 4);
+            break;
+        }
+    }
+}
+
+// Draws `source` over `target`, both non-premultiplied RGBA
+static void apng_blend_over(uint8_t* target, const uint8_t* source, int count)
+{
+    for (int x = 0; x < count; ++x) {
+        const uint8_t* src = &source[x * 4];
+        uint8_t* dst = &target[x * 4];
+        if (src[3] == 255 || dst[3] == 0) {
+            memcpy(dst, src, 4);
+            continue;
+        }
+        if (src[3] == 0)
+            continue;
+
+        int dst_alpha = dst[3] * (255 - src[3]) / 255;
+        int alpha = src[3] + dst_alpha;
+        for (int c = 0; c < 3; ++c)
+            dst[c] = (src[c] * src[3] + dst[c] * dst_alpha) / alpha;
+        dst[3] = alpha;
+    }
+}
+
+static void apng_clear_rect(ApngDecoder* decoder, ApngRect rect)
+{
+    for (int y = rect.y; y < rect.y + rect.height; ++y)
+        memset(&decoder->canvas[((size_t)y * decoder->width + rect.x) * 4], 0, (size_t)rect.width * 4);
+}
+
+// Reads chunks up to the data of the next frame, and its control chunk
+static bool apng_next_frame_data(ApngDecoder* decoder, ApngFrameControl* control, const char** data_type)
+{
+    // Plain PNG files are a single frame covering the canvas
+    bool has_control = !decoder->animated;
+    *control = (ApngFrameControl) {
+        .rect = { 0, 0, decoder->width, decoder->height },
+        .delay = APNG_DEFAULT_DELAY,
+        .blend = APNG_BLEND_OP_SOURCE,
+    };
+
+    const char* type;
+    const uint8_t* chunk;
+    size_t chunk_size;
+    while (apng_chunk(decoder, decoder->position, &type, &chunk, &chunk_size)) {
+        if (memcmp(type, "IEND", 4) == 0)
+            return false;
+
+        if (memcmp(type, "fcTL", 4) == 0 && chunk_size >= 26) {
+            // Checked in 64 bits, as the offsets may be anything up to 2^32
+            uint32_t width = apng_read_u32(&chunk[4]);
+            uint32_t height = apng_read_u32(&chunk[8]);
+            uint32_t x = apng_read_u32(&chunk[12]);
+            uint32_t y = apng_read_u32(&chunk[16]);
+            if (width == 0 || height == 0
+                || (uint64_t)x + width > (uint64_t)decoder->width
+                || (uint64_t)y + height > (uint64_t)decoder->height)
+                return false;
+
+            int delay_num = apng_read_u16(&chunk[20]);
+            int delay_den = apng_read_u16(&chunk[22]);
+            *control = (ApngFrameControl) {
+                .rect = { .x = x, .y = y, .width = width, .height = height },
+                // A denominator of 0 means hundredths of a second
+                .delay = delay_den == 0 ? delay_num : delay_num * 100 / delay_den,
+                .dispose = chunk[24],
+                .blend = chunk[25],
+            };
+            has_control = true;
+        } else if (has_control && (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "fdAT", 4) == 0)) {
+            *data_type = type;
+            return true;
+        }
+
+        // Image data before the first frame control is a default image that
+        // is not part of the animation
+        decoder->position += chunk_size + 12;
+    }
+
+    return false;
+}
+
+// Inflates the consecutive data chunks of the frame to `decoder->raw`
+static bool apng_inflate_frame(ApngDecoder* decoder, const char* data_type, size_t raw_size)
+{
+    z_stream stream = { 0 };
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+    stream.next_out = decoder->raw;
+    stream.avail_out = raw_size;
+
+    bool frame_data = memcmp(data_type, "fdAT", 4) == 0;
+    int status = Z_OK;
+
+    const char* type;
+    const uint8_t* chunk;
+    size_t chunk_size;
+    while (apng_chunk(decoder, decoder->position, &type, &chunk, &chunk_size)
+           && memcmp(type, data_type, 4) == 0) {
+        decoder->position += chunk_size + 12;
+
+        // Frame data chunks start with their sequence number
+        size_t skip = frame_data ? 4 : 0;
+        if (chunk_size < skip || status == Z_STREAM_END)
+            continue;
+        stream.next_in = (Bytef*)&chunk[skip];
+        stream.avail_in = chunk_size - skip;
+        status = inflate(&stream, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+            break;
+    }
+
+    bool ok = stream.avail_out == 0;
+    inflateEnd(&stream);
+    return ok;
+}
+
+bool apng_decoder_next(ApngDecoder* decoder, void* pixels, int* delay)
+{
+    if (decoder->frames_read == decoder->frames_count)
+        return false;
+
+    ApngFrameControl control;
+    const char* data_type;
+    if (!apng_next_frame_data(decoder, &control, &data_type))
+        return false;
+
+    // Within the canvas, see `apng_next_frame_data`
+    ApngRect rect = control.rect;
+
+    size_t row_bytes = apng_row_bytes(decoder, rect.width);
+    if (!apng_inflate_frame(decoder, data_type, (row_bytes + 1) * rect.height))
+        return false;
+
+    // Dispose the previous frame before drawing this one
+    if (decoder->dispose == APNG_DISPOSE_OP_BACKGROUND)
+        apng_clear_rect(decoder, decoder->dispose_rect);
+    else if (decoder->dispose == APNG_DISPOSE_OP_PREVIOUS && decoder->saved)
+        memcpy(decoder->canvas, decoder->saved, (size_t)decoder->width * decoder->height * 4);
+
+    // There is nothing to restore for the first frame, it's cleared instead
+    int dispose = control.dispose;
+    if (dispose == APNG_DISPOSE_OP_PREVIOUS && decoder->frames_read == 0)
+        dispose = APNG_DISPOSE_OP_BACKGROUND;
+    if (dispose == APNG_DISPOSE_OP_PREVIOUS) {
+        if (decoder->saved == NULL)
+            decoder->saved = malloc((size_t)decoder->width * decoder->height * 4);
+        if (decoder->saved == NULL)
+            return false;
+        memcpy(decoder->saved, decoder->canvas, (size_t)decoder->width * decoder->height * 4);
+    }
+
+    size_t bpp = (decoder->channels * decoder->bit_depth + 7) / 8;
+    const uint8_t* previous = NULL;
+    for (int y = 0; y < rect.height; ++y) {
+        uint8_t* row = &decoder->raw[y * (row_bytes + 1)];
+        if (!apng_unfilter_row(row + 1, previous, row_bytes, bpp, row[0]))
+            return false;
+        previous = row + 1;
+
+        uint8_t* target = &decoder->canvas[((size_t)(rect.y + y) * decoder->width + rect.x) * 4];
+        if (control.blend == APNG_BLEND_OP_SOURCE) {
+            apng_convert_row(decoder, row + 1, rect.width, target);
+        } else {
+            apng_convert_row(decoder, row + 1, rect.width, decoder->row);
+            apng_blend_over(target, decoder->row, rect.width);
+        }
+    }
+
+    decoder->dispose = dispose;
+    decoder->dispose_rect = rect;
+    decoder->frames_read++;
+
+    memcpy(pixels, decoder->canvas, (size_t)decoder->width * decoder->height * 4);
+    if (delay)
+        *delay = control.delay;
+
+    return true;
+}
+
+void apng_decoder_close(ApngDecoder* decoder)
+{
+    if (decoder == NULL)
+        return;
+    free(decoder->row);
+    free(decoder->saved);
+    free(decoder->raw);
+    free(decoder->canvas);
+    free(decoder);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming APNG decoder, which also reads plain PNG files as a single frame.
+// Frames are inflated and drawn onto the canvas one at a time, so only the
+// canvas and the compressed file are kept in memory.
+typedef struct ApngDecoder ApngDecoder;
+
+// `data` must stay valid until the decoder is closed. Returns NULL if it is
+// not a PNG, or if it's interlaced. `failed` is set as well when it is one
+// that must not be decoded by other means either: bigger than
+// DECODE_MAX_PIXELS, or too big to allocate.
+ApngDecoder* apng_decoder_open(const uint8_t* data, size_t size, bool* failed);
+int apng_decoder_width(const ApngDecoder* decoder);
+int apng_decoder_height(const ApngDecoder* decoder);
+// From the animation control chunk, 1 for plain PNG files
+size_t apng_decoder_frames_count(const ApngDecoder* decoder);
+// Writes the next frame as `width * height` RGBA pixels, and its delay in
+// hundredths of a second. Returns false after the last frame, or if the file
+// is truncated.
+bool apng_decoder_next(ApngDecoder* decoder, void* pixels, int* delay);
+void apng_decoder_close(ApngDecoder* decoder);
@@ -0,0 +1,490 @@
+#include "apng_encoder.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "util/buffer.h"
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+// Uncompressed bytes per deflate stripe. Frames smaller than this are
+// compressed in one go.
+#define APNG_STRIPE_BYTES (256 * 1024)
+
+#define APNG_DISPOSE_OP_NONE 0
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_BLEND_OP_OVER 1
+
+typedef struct ApngFrame ApngFrame;
+
+typedef struct {
+    ApngFrame* frame;
+    int row_begin;
+    int row_end;
+    Buffer output;
+    uLong adler;
+    size_t raw_size;
+    bool failed;
+} ApngStripe;
+
+struct ApngFrame {
+    ApngEncoder* encoder;
+    OptimizedFrame frame;
+
+    ApngStripe* stripes;
+    size_t stripes_count;
+    atomic_size_t stripes_left;
+
+    // zlib stream of the region
+    Buffer output;
+    bool failed;
+    bool done;
+};
+
+struct ApngEncoder {
+    FILE* file;
+    int width;
+    int height;
+    // 0 when not known up front
+    size_t frames_expected;
+    bool failed;
+
+    ThreadPool* pool;
+    ThreadPoolGroup group;
+
+    pthread_mutex_t mutex;
+    // Signaled whenever frames are written
+    pthread_cond_t written;
+    ApngFrame** frames;
+    size_t frames_count;
+    size_t frames_capacity;
+    size_t frames_written;
+    uint32_t sequence;
+};
+
+static void apng_write_chunk(ApngEncoder* encoder, const char* type, const void* data, size_t size)
+{
+    uint8_t header[8] = {
+        size >> 24, (size >> 16) & 0xFF, (size >> 8) & 0xFF, size & 0xFF,
+        type[0], type[1], type[2], type[3],
+    };
+
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    if (size > 0)
+        crc = crc32(crc, data, size);
+    uint8_t footer[4] = { crc >> 24, (crc >> 16) & 0xFF, (crc >> 8) & 0xFF, crc & 0xFF };
+
+    if (fwrite(header, 1, sizeof(header), encoder->file) != sizeof(header)
+        || (size > 0 && fwrite(data, 1, size, encoder->file) != size)
+        || fwrite(footer, 1, sizeof(footer), encoder->file) != sizeof(footer))
+        encoder->failed = true;
+}
+
+static inline uint8_t apng_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// Filters a scanline with each of the five PNG filters and keeps the one with
+// the smallest sum of absolute values, the usual libpng heuristic.
+static void apng_filter_row(const uint8_t* row, const uint8_t* previous, size_t size,
+                            uint8_t* candidates, uint8_t* out)
+{
+    const size_t bpp = 4;
+    uint64_t best_score = UINT64_MAX;
+    int best = 0;
+
+    for (int filter = 0; filter < 5; ++filter) {
+        uint8_t* candidate = &candidates[filter * size];
+        uint64_t score = 0;
+        for (size_t i = 0; i < size; ++i) {
+            uint8_t a = i >= bpp ? row[i - bpp] : 0;
+            uint8_t b = previous ? previous[i] : 0;
+            uint8_t c = (previous && i >= bpp) ? previous[i - bpp] : 0;
+            uint8_t value;
+            switch (filter) {
+            case 0:
+                value = row[i];
+                break;
+            case 1:
+                value = row[i] - a;
+                break;
+            case 2:
+                value = row[i] - b;
+                break;
+            case 3:
+                value = row[i] - ((a + b) >> 1);
+                break;
+            default:
+                value = row[i] - apng_paeth(a, b, c);
+                break;
+            }
+            candidate[i] = value;
+            score += value < 128 ? value : 256 - value;
+        }
+        if (score < best_score) {
+            best_score = score;
+            best = filter;
+        }
+    }
+
+    out[0] = best;
+    memcpy(&out[1], &candidates[best * size], size);
+}
+
+static void apng_frame_finish(ApngFrame* frame);
+
+static void apng_stripe_task(void* arg)
+{
+    ApngStripe* stripe = arg;
+    ApngFrame* frame = stripe->frame;
+    TRACE_SCOPE("apng_deflate");
+
+    int width = frame->frame.rect.width;
+    int height = frame->frame.rect.height;
+    size_t row_size = (size_t)width * 4;
+    size_t rows_count = stripe->row_end - stripe->row_begin;
+    stripe->raw_size = rows_count * (row_size + 1);
+
+    uint8_t* raw = malloc(stripe->raw_size);
+    uint8_t* rows = malloc(row_size * 2);
+    uint8_t* candidates = malloc(row_size * 5);
+    if (raw == NULL || rows == NULL || candidates == NULL) {
+        // The frame still has to finish for the encoder to report the failure
+        free(candidates);
+        free(rows);
+        free(raw);
+        stripe->failed = true;
+        if (atomic_fetch_sub(&frame->stripes_left, 1) == 1)
+            apng_frame_finish(frame);
+        return;
+    }
+
+    uint8_t* current = rows;
+    uint8_t* previous = rows + row_size;
+    bool has_previous = stripe->row_begin > 0;
+    if (has_previous)
+        frame_optimized_row(&frame->frame, frame->encoder->width, stripe->row_begin - 1, previous);
+
+    for (size_t i = 0; i < rows_count; ++i) {
+        frame_optimized_row(&frame->frame, frame->encoder->width, stripe->row_begin + i, current);
+        apng_filter_row(current, has_previous ? previous : NULL, row_size,
+                        candidates, &raw[i * (row_size + 1)]);
+
+        uint8_t* swap = previous;
+        previous = current;
+        current = swap;
+        has_previous = true;
+    }
+
+    free(candidates);
+    free(rows);
+
+    // Raw deflate per stripe: every stripe but the last ends with a sync flush
+    // so the streams can be concatenated into a single zlib stream.
+    bool last = stripe->row_end == height;
+    z_stream stream = { 0 };
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        stripe->failed = true;
+    } else {
+        size_t bound = deflateBound(&stream, stripe->raw_size) + 16;
+        if (buffer_reserve(&stripe->output, bound)) {
+            stream.next_in = raw;
+            stream.avail_in = stripe->raw_size;
+            stream.next_out = stripe->output.data;
+            stream.avail_out = bound;
+            int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+            if ((last && status != Z_STREAM_END) || (!last && status != Z_OK) || stream.avail_in != 0)
+                stripe->failed = true;
+            stripe->output.size = bound - stream.avail_out;
+        } else {
+            stripe->failed = true;
+        }
+        deflateEnd(&stream);
+    }
+
+    stripe->adler = adler32(adler32(0, NULL, 0), raw, stripe->raw_size);
+    free(raw);
+
+    if (atomic_fetch_sub(&frame->stripes_left, 1) == 1)
+        apng_frame_finish(frame);
+}
+
+// Splits a delay in hundredths of a second into the fcTL fraction. Merged
+// frames can add up to more than the 16 bits of the numerator, in which case
+// the delay is kept with a coarser denominator instead of wrapping around.
+static void apng_delay(int delay, uint16_t* num, uint16_t* den)
+{
+    if (delay < 0)
+        delay = 0;
+
+    int scale = 1;
+    while (delay / scale > UINT16_MAX && scale < 100)
+        scale *= 10;
+
+    *num = delay / scale > UINT16_MAX ? UINT16_MAX : delay / scale;
+    *den = 100 / scale;
+}
+
+// Writes every finished frame that follows the ones already written. Must be
+// called with the encoder locked.
+static void apng_encoder_flush(ApngEncoder* encoder)
+{
+    while (encoder->frames_written < encoder->frames_count) {
+        ApngFrame* frame = encoder->frames[encoder->frames_written];
+        if (!frame->done)
+            break;
+
+        if (frame->failed)
+            encoder->failed = true;
+
+        Buffer control = { 0 };
+        // The canvas starts transparent, so every frame can be drawn over
+        const OptimizedFrame* optimized = &frame->frame;
+        uint16_t delay_num, delay_den;
+        apng_delay(optimized->delay, &delay_num, &delay_den);
+        bool ok = buffer_append_u32_be(&control, encoder->sequence++)
+            && buffer_append_u32_be(&control, optimized->rect.width)
+            && buffer_append_u32_be(&control, optimized->rect.height)
+            && buffer_append_u32_be(&control, optimized->rect.x)
+            && buffer_append_u32_be(&control, optimized->rect.y)
+            && buffer_append_byte(&control, delay_num >> 8)
+            && buffer_append_byte(&control, delay_num & 0xFF)
+            && buffer_append_byte(&control, delay_den >> 8)
+            && buffer_append_byte(&control, delay_den & 0xFF)
+            && buffer_append_byte(&control, optimized->dispose == FRAME_DISPOSE_BACKGROUND
+                                                ? APNG_DISPOSE_OP_BACKGROUND
+                                                : APNG_DISPOSE_OP_NONE)
+            && buffer_append_byte(&control, APNG_BLEND_OP_OVER);
+        if (ok)
+            apng_write_chunk(encoder, "fcTL", control.data, control.size);
+        else
+            encoder->failed = true;
+        buffer_free(&control);
+
+        if (encoder->frames_written == 0) {
+            // The first frame doubles as the default image
+            apng_write_chunk(encoder, "IDAT", frame->output.data, frame->output.size);
+        } else {
+            Buffer data = { 0 };
+            if (buffer_reserve(&data, frame->output.size + 4)
+                && buffer_append_u32_be(&data, encoder->sequence++)
+                && buffer_append(&data, frame->output.data, frame->output.size))
+                apng_write_chunk(encoder, "fdAT", data.data, data.size);
+            else
+                encoder->failed = true;
+            buffer_free(&data);
+        }
+
+        buffer_free(&frame->output);
+        free(frame);
+        encoder->frames[encoder->frames_written++] = NULL;
+    }
+    pthread_cond_broadcast(&encoder->written);
+}
+
+static void apng_write_animation_control(ApngEncoder* encoder, size_t frames_count)
+{
+    Buffer animation = { 0 };
+    if (buffer_append_u32_be(&animation, frames_count)
+        && buffer_append_u32_be(&animation, 0)) // Loop forever
+        apng_write_chunk(encoder, "acTL", animation.data, animation.size);
+    else
+        encoder->failed = true;
+    buffer_free(&animation);
+}
+
+static void apng_frame_finish(ApngFrame* frame)
+{
+    Buffer* output = &frame->output;
+    if (!buffer_append(output, (uint8_t[]) { 0x78, 0x9C }, 2))
+        frame->failed = true;
+
+    uLong adler = adler32(0, NULL, 0);
+    for (size_t i = 0; i < frame->stripes_count; ++i) {
+        ApngStripe* stripe = &frame->stripes[i];
+        if (stripe->failed)
+            frame->failed = true;
+        if (!buffer_append(output, stripe->output.data, stripe->output.size))
+            frame->failed = true;
+        adler = adler32_combine(adler, stripe->adler, stripe->raw_size);
+        buffer_free(&stripe->output);
+    }
+    if (!buffer_append_u32_be(output, adler))
+        frame->failed = true;
+
+    free(frame->stripes);
+    frame->stripes = NULL;
+
+    ApngEncoder* encoder = frame->encoder;
+    pthread_mutex_lock(&encoder->mutex);
+    frame->done = true;
+    apng_encoder_flush(encoder);
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+ApngEncoder* apng_encoder_open(const char* output_file, int width, int height, size_t frames_count)
+{
+    FILE* file = fopen(output_file, "wb");
+    if (file == NULL)
+        return NULL;
+
+    size_t frames_capacity = frames_count ? frames_count : 32;
+    ApngEncoder* encoder = calloc(1, sizeof(*encoder));
+    ApngFrame** frames = calloc(frames_capacity, sizeof(*frames));
+    if (encoder == NULL || frames == NULL) {
+        free(frames);
+        free(encoder);
+        fclose(file);
+        remove(output_file);
+        return NULL;
+    }
+    encoder->file = file;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->frames_expected = frames_count;
+    encoder->frames_capacity = frames_capacity;
+    encoder->frames = frames;
+    encoder->pool = thread_pool_global();
+    thread_pool_group_init(&encoder->group);
+    pthread_mutex_init(&encoder->mutex, NULL);
+    pthread_cond_init(&encoder->written, NULL);
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (fwrite(signature, 1, sizeof(signature), file) != sizeof(signature))
+        encoder->failed = true;
+
+    Buffer header = { 0 };
+    if (buffer_append_u32_be(&header, width)
+        && buffer_append_u32_be(&header, height)
+        && buffer_append(&header, (uint8_t[]) { 8, 6, 0, 0, 0 }, 5)) // 8-bit RGBA
+        apng_write_chunk(encoder, "IHDR", header.data, header.size);
+    else
+        encoder->failed = true;
+    buffer_free(&header);
+
+    // Rewritten when closing if the amount of frames is not known yet
+    apng_write_animation_control(encoder, frames_count);
+
+    return encoder;
+}
+
+// Drops the output, from any thread
+static void apng_encoder_fail(ApngEncoder* encoder)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    encoder->failed = true;
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+void apng_encoder_add_frame(ApngEncoder* encoder, const OptimizedFrame* optimized)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    bool full = encoder->frames_expected && encoder->frames_count == encoder->frames_expected;
+    pthread_mutex_unlock(&encoder->mutex);
+    if (full) {
+        apng_encoder_fail(encoder);
+        return;
+    }
+
+    ApngFrame* frame = calloc(1, sizeof(*frame));
+    if (frame == NULL) {
+        apng_encoder_fail(encoder);
+        return;
+    }
+    frame->encoder = encoder;
+    frame->frame = *optimized;
+
+    int height = optimized->rect.height;
+    size_t row_size = (size_t)optimized->rect.width * 4 + 1;
+    int stripe_rows = APNG_STRIPE_BYTES / row_size;
+    if (stripe_rows < 1)
+        stripe_rows = 1;
+
+    frame->stripes_count = (height + stripe_rows - 1) / stripe_rows;
+    frame->stripes = calloc(frame->stripes_count, sizeof(*frame->stripes));
+    if (frame->stripes == NULL) {
+        free(frame);
+        apng_encoder_fail(encoder);
+        return;
+    }
+    // One extra reference keeps the frame alive until every stripe is queued
+    atomic_init(&frame->stripes_left, frame->stripes_count + 1);
+
+    pthread_mutex_lock(&encoder->mutex);
+    if (encoder->frames_count == encoder->frames_capacity) {
+        ApngFrame** frames = realloc(encoder->frames, encoder->frames_capacity * 2 * sizeof(*encoder->frames));
+        if (frames == NULL) {
+            encoder->failed = true;
+            pthread_mutex_unlock(&encoder->mutex);
+            free(frame->stripes);
+            free(frame);
+            return;
+        }
+        encoder->frames = frames;
+        encoder->frames_capacity *= 2;
+    }
+    encoder->frames[encoder->frames_count++] = frame;
+    pthread_mutex_unlock(&encoder->mutex);
+
+    for (size_t i = 0; i < frame->stripes_count; ++i) {
+        ApngStripe* stripe = &frame->stripes[i];
+        stripe->frame = frame;
+        stripe->row_begin = i * stripe_rows;
+        stripe->row_end = stripe->row_begin + stripe_rows < height
+            ? stripe->row_begin + stripe_rows
+            : height;
+        thread_pool_group_submit(encoder->pool, &encoder->group, apng_stripe_task, stripe);
+    }
+
+    if (atomic_fetch_sub(&frame->stripes_left, 1) == 1)
+        apng_frame_finish(frame);
+}
+
+void apng_encoder_wait(ApngEncoder* encoder, size_t frames_count)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    while (encoder->frames_written < frames_count && encoder->frames_written < encoder->frames_count)
+        pthread_cond_wait(&encoder->written, &encoder->mutex);
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+bool apng_encoder_close(ApngEncoder* encoder)
+{
+    thread_pool_group_wait(&encoder->group);
+    thread_pool_group_destroy(&encoder->group);
+
+    apng_write_chunk(encoder, "IEND", NULL, 0);
+
+    if (encoder->frames_expected == 0) {
+        // Right after the signature and the header
+        if (fseek(encoder->file, 8 + 25, SEEK_SET) == 0)
+            apng_write_animation_control(encoder, encoder->frames_written);
+        else
+            encoder->failed = true;
+    }
+
+    bool ok = !encoder->failed && encoder->frames_written > 0
+        && (encoder->frames_expected == 0 || encoder->frames_written == encoder->frames_expected);
+    if (fclose(encoder->file) != 0)
+        ok = false;
+
+    pthread_cond_destroy(&encoder->written);
+    pthread_mutex_destroy(&encoder->mutex);
+    free(encoder->frames);
+    free(encoder);
+
+    return ok;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "frame_optimize.h"
+
+// Streaming APNG writer. Frames are filtered and deflated on the global
+// thread pool in stripes of rows, and written out in order as soon as they
+// are ready.
+typedef struct ApngEncoder ApngEncoder;
+
+// APNG stores the amount of frames before the first one. When it is not known
+// up front, `frames_count` is 0 and it's written when closing, which needs a
+// seekable file. Returns NULL if the file can't be created.
+ApngEncoder* apng_encoder_open(const char* output_file, int width, int height, size_t frames_count);
+// Queues a frame planned by `frame_optimize`. Its pixels must stay valid until
+// `apng_encoder_close` returns.
+void apng_encoder_add_frame(ApngEncoder* encoder, const OptimizedFrame* frame);
+// Blocks until the first `frames_count` frames added are written, after which
+// their pixels can be reused.
+void apng_encoder_wait(ApngEncoder* encoder, size_t frames_count);
+// Waits for every frame to be written and closes the file. Returns false if
+// anything could not be written, or if fewer frames than announced were added.
+bool apng_encoder_close(ApngEncoder* encoder);
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <raylib.h>
+
+// Implementation already defined in main file.
+// #define ARENA_IMPLEMENTATION
+#include "external/arena.h"
+
+#include "daemon.h"
+#include "emoji.h"
+#include "explode.h"
+#include "explode_stream.h"
+#include "gif_load.h"
+#include "image.h"
+#include "util/arena_pool.h"
+#include "util/magick.h"
+#include "util/string.h"
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} BatchPaths;
+
+typedef struct {
+    // Animated inputs are not loaded up front, they are decoded as they are
+    // converted
+    Image image;
+    const char* input_path;
+    const char* output_path;
+    bool reverse;
+    atomic_size_t* failures;
+} BatchJob;
+
+static void batch_usage(FILE* stream, const char* program)
+{
+    fprintf(stream, "Usage: %s [OPTIONS] <INPUT>...\n", program);
+    fprintf(stream, "Generate exploding animations without opening a window.\n");
+    fprintf(stream, "Inputs may be image files or directories containing image files.\n");
+    fprintf(stream, "With --daemon, inputs are received on a Unix socket instead, see daemon.h.\n");
+    fprintf(stream, "\n");
+    fprintf(stream, "Options:\n");
+    fprintf(stream, "  -k, --kind <explode|implode>  Kind of the animation (default: explode)\n");
+    fprintf(stream, "  -f, --format <gif|png>        Format of the animation (default: png)\n");
+    fprintf(stream, "  -o, --output-dir <DIR>        Directory for the outputs (default: next to the inputs)\n");
+    fprintf(stream, "  -s, --size <PX>               Shrink still images to fit PX before converting them\n");
+    fprintf(stream, "  -j, --jobs <N>                Amount of worker threads (default: core count)\n");
+    fprintf(stream, "  -d, --daemon <SOCKET>         Serve conversions on the Unix socket SOCKET until stopped\n");
+    fprintf(stream, "  -t, --trace <FILE>            Save a Chrome trace of the conversions to FILE\n");
+    fprintf(stream, "  -h, --help                    Show this help\n");
+}
+
+static int batch_compare_paths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Whether the file is named like the output of a previous run
+static bool batch_is_output(const char* name)
+{
+    for (EmojiFormat format = 0; format < COUNT_EMOJI_FORMATS; ++format) {
+        if (string_ends_with(name, emoji_format_suffix(format)))
+            return true;
+    }
+    return false;
+}
+
+static bool batch_collect_inputs(Arena* arena, BatchPaths* paths, const char* input)
+{
+    struct stat st;
+    if (stat(input, &st) != 0) {
+        fprintf(stderr, "ERROR: could not access `%s`: %s\n", input, strerror(errno));
+        return false;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        arena_da_append(arena, paths, arena_strdup(arena, input));
+        return true;
+    }
+
+    DIR* dir = opendir(input);
+    if (dir == NULL) {
+        fprintf(stderr, "ERROR: could not open directory `%s`: %s\n", input, strerror(errno));
+        return false;
+    }
+
+    size_t first = paths->count;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || batch_is_output(entry->d_name))
+            continue;
+
+        char* path = arena_sprintf(arena, "%s/%s", input, entry->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        arena_da_append(arena, paths, path);
+    }
+    closedir(dir);
+
+    qsort(paths->items + first, paths->count - first, sizeof(*paths->items), batch_compare_paths);
+
+    return true;
+}
+
+static const char* batch_output_path(Arena* arena, const char* input_path,
+                                     const char* output_dir, EmojiFormat format)
+{
+    const char* suffix = emoji_format_suffix(format);
+
+    if (output_dir == NULL)
+        return arena_sprintf(arena, "%s%s", input_path, suffix);
+
+    char* name = basename(arena_strdup(arena, input_path));
+    return arena_sprintf(arena, "%s/%s%s", output_dir, name, suffix);
+}
+
+static void batch_job_run(void* arg)
+{
+    BatchJob* job = arg;
+    TRACE_SCOPE("convert");
+
+    bool converted;
+    if (job->image.data == NULL)
+        converted = animation_to_explode_gif(job->input_path, job->output_path, job->reverse, NULL);
+    else
+        converted = image_to_explode_gif(job->image, job->output_path, job->reverse);
+    if (!converted)
+        atomic_fetch_add(job->failures, 1);
+
+    UnloadImage(job->image);
+}
+
+int batch_main(int argc, char** argv)
+{
+    EmojiKind kind = EMOJI_KIND_EXPLODE;
+    EmojiFormat format = EMOJI_FORMAT_PNG;
+    const char* output_dir = NULL;
+    int max_size = 0;
+    const char* daemon_socket = NULL;
+    size_t jobs = thread_pool_cpu_count();
+
+    const struct option options[] = {
+        { "kind", required_argument, NULL, 'k' },
+        { "format", required_argument, NULL, 'f' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { "size", required_argument, NULL, 's' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "daemon", required_argument, NULL, 'd' },
+        { "trace", required_argument, NULL, 't' },
+        { "help", no_argument, NULL, 'h' },
+        { 0 },
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "k:f:o:s:j:d:t:h", options, NULL)) != -1) {
+        switch (option) {
+        case 'k':
+            if (strcmp(optarg, "explode") == 0) {
+                kind = EMOJI_KIND_EXPLODE;
+            } else if (strcmp(optarg, "implode") == 0) {
+                kind = EMOJI_KIND_IMPLODE;
+            } else {
+                fprintf(stderr, "ERROR: unknown kind `%s`\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "gif") == 0) {
+                format = EMOJI_FORMAT_GIF;
+            } else if (strcmp(optarg, "png") == 0 || strcmp(optarg, "apng") == 0) {
+                format = EMOJI_FORMAT_PNG;
+            } else {
+                fprintf(stderr, "ERROR: unknown format `%s`\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 's': {
+            char* end;
+            long value = strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > INT_MAX) {
+                fprintf(stderr, "ERROR: invalid size `%s`\n", optarg);
+                return 1;
+            }
+            max_size = value;
+        } break;
+        case 'j': {
+            char* end;
+            long value = strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0) {
+                fprintf(stderr, "ERROR: invalid amount of jobs `%s`\n", optarg);
+                return 1;
+            }
+            jobs = value;
+        } break;
+        case 'd':
+            daemon_socket = optarg;
+            break;
+        case 't':
+            trace_start(optarg);
+            break;
+        case 'h':
+            batch_usage(stdout, argv[0]);
+            return 0;
+        default:
+            batch_usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    if (daemon_socket != NULL)
+        return daemon_main(daemon_socket, jobs, kind, format, max_size);
+
+    if (optind >= argc) {
+        batch_usage(stderr, argv[0]);
+        return 1;
+    }
+
+    if (output_dir != NULL && mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: could not create directory `%s`: %s\n", output_dir, strerror(errno));
+        return 1;
+    }
+
+    Arena arena = { 0 };
+    atomic_size_t failures = 0;
+
+    bool inputs_ok = true;
+    BatchPaths inputs = { 0 };
+    for (int i = optind; i < argc; ++i) {
+        if (!batch_collect_inputs(&arena, &inputs, argv[i]))
+            inputs_ok = false;
+    }
+
+    // The queue only holds as many decoded images as there are workers, so
+    // decoding runs ahead of the encoders without loading every input at once.
+    ThreadPool* pool = thread_pool_create(jobs, jobs);
+    if (pool == NULL) {
+        fprintf(stderr, "ERROR: could not create worker threads\n");
+        arena_free(&arena);
+        return 1;
+    }
+
+    for (size_t i = 0; i < inputs.count; ++i) {
+        const char* input_path = inputs.items[i];
+
+        bool animated = gif_file_is_animated(input_path);
+        Image image = { 0 };
+        if (!animated)
+            image = load_image_fitted(input_path, max_size);
+        if (!animated && image.data == NULL) {
+            fprintf(stderr, "ERROR: failed to load file `%s`: %s\n", input_path, strerror(errno));
+            failures++;
+            continue;
+        }
+
+        BatchJob* job = arena_alloc(&arena, sizeof(*job));
+        *job = (BatchJob) {
+            .image = image,
+            .input_path = input_path,
+            .output_path = batch_output_path(&arena, input_path, output_dir, format),
+            .reverse = emoji_kind_reverse(kind),
+            .failures = &failures,
+        };
+        thread_pool_submit(pool, batch_job_run, job);
+    }
+
+    thread_pool_wait(pool);
+    thread_pool_destroy(pool);
+
+    arena_pool_trim();
+    magick_runtime_shutdown();
+
+    size_t failed = failures;
+    printf("Converted %zu of %zu files\n", inputs.count - failed, inputs.count);
+
+    arena_free(&arena);
+
+    return inputs_ok && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Headless entry point: converts every input given on the command line
+// without opening a window. Returns the process exit code.
+int batch_main(int argc, char** argv);
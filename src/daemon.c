@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <raylib.h>
+
+#include "explode.h"
+#include "explode_stream.h"
+#include "gif_load.h"
+#include "image.h"
+#include "util/arena_pool.h"
+#include "util/magick.h"
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+#define DAEMON_LINE_MAX 256
+#define DAEMON_INPUT_MAX_BYTES ((size_t)256 << 20)
+// Connections left idle that long are closed
+#define DAEMON_IDLE_TIMEOUT_SECONDS 30
+// Each open connection has its own thread, which only takes a worker while
+// converting. Connections past this are answered `ERROR busy`.
+#define DAEMON_MAX_CONNECTIONS 64
+
+typedef struct {
+    EmojiKind kind;
+    EmojiFormat format;
+    int max_size;
+} DaemonOptions;
+
+typedef struct {
+    DaemonOptions defaults;
+    // Inputs and outputs of the requests in flight
+    char* temp_dir;
+    atomic_size_t next_request;
+    // Runs the conversions, `jobs` at a time
+    ThreadPool* pool;
+
+    // Open connections, cut when the daemon stops
+    pthread_mutex_t mutex;
+    // Signaled whenever a connection is closed
+    pthread_cond_t closed;
+    int connections[DAEMON_MAX_CONNECTIONS];
+    size_t connections_count;
+} DaemonServer;
+
+typedef struct {
+    DaemonServer* server;
+    int fd;
+} DaemonConnection;
+
+static double daemon_elapsed_ms(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static bool daemon_write_all(int fd, const void* data, size_t size)
+{
+    const char* bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+static void daemon_send_error(int fd, const char* message)
+{
+    char line[DAEMON_LINE_MAX];
+    int length = snprintf(line, sizeof(line), "ERROR %s\n", message);
+    daemon_write_all(fd, line, length);
+}
+
+// Parses `CONVERT <LENGTH> [KEY=VALUE]...`, the line being modified
+static const char* daemon_parse_request(char* line, DaemonOptions* options, size_t* length)
+{
+    char* saveptr;
+    const char* command = strtok_r(line, " \r\n", &saveptr);
+    if (command == NULL || strcmp(command, "CONVERT") != 0)
+        return "unknown command";
+
+    const char* length_arg = strtok_r(NULL, " \r\n", &saveptr);
+    char* end;
+    unsigned long long value = length_arg ? strtoull(length_arg, &end, 10) : 0;
+    if (length_arg == NULL || *end != '\0' || value == 0)
+        return "invalid length";
+    if (value > DAEMON_INPUT_MAX_BYTES)
+        return "input too big";
+    *length = value;
+
+    char* option;
+    while ((option = strtok_r(NULL, " \r\n", &saveptr)) != NULL) {
+        char* equal = strchr(option, '=');
+        if (equal == NULL)
+            return "invalid option";
+        *equal = '\0';
+        const char* option_value = equal + 1;
+
+        if (strcmp(option, "kind") == 0) {
+            if (strcmp(option_value, "explode") == 0)
+                options->kind = EMOJI_KIND_EXPLODE;
+            else if (strcmp(option_value, "implode") == 0)
+                options->kind = EMOJI_KIND_IMPLODE;
+            else
+                return "unknown kind";
+        } else if (strcmp(option, "format") == 0) {
+            if (strcmp(option_value, "gif") == 0)
+                options->format = EMOJI_FORMAT_GIF;
+            else if (strcmp(option_value, "png") == 0 || strcmp(option_value, "apng") == 0)
+                options->format = EMOJI_FORMAT_PNG;
+            else
+                return "unknown format";
+        } else if (strcmp(option, "size") == 0) {
+            long size = strtol(option_value, &end, 10);
+            if (*end != '\0' || size < 0 || size > INT_MAX)
+                return "invalid size";
+            options->max_size = size;
+        } else {
+            return "unknown option";
+        }
+    }
+
+    return NULL;
+}
+
+static bool daemon_receive_file(FILE* input, const char* path, size_t length)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: could not create `%s`: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char chunk[1 << 16];
+    while (length > 0) {
+        size_t size = length < sizeof(chunk) ? length : sizeof(chunk);
+        if (fread(chunk, 1, size, input) != size || fwrite(chunk, 1, size, file) != size)
+            break;
+        length -= size;
+    }
+
+    return fclose(file) == 0 && length == 0;
+}
+
+static bool daemon_send_file(int fd, const char* path, double elapsed_ms, size_t* size)
+{
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (file < 0 || fstat(file, &st) != 0) {
+        if (file >= 0)
+            close(file);
+        daemon_send_error(fd, "could not read the animation");
+        return false;
+    }
+    *size = st.st_size;
+
+    char line[DAEMON_LINE_MAX];
+    int length = snprintf(line, sizeof(line), "OK %zu %.1f\n", *size, elapsed_ms);
+    bool ok = daemon_write_all(fd, line, length);
+
+    off_t offset = 0;
+    while (ok && offset < st.st_size) {
+        ssize_t sent = sendfile(fd, file, &offset, st.st_size - offset);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        ok = sent > 0;
+    }
+
+    close(file);
+    return ok;
+}
+
+typedef struct {
+    const char* input_path;
+    const char* output_path;
+    const DaemonOptions* options;
+    bool converted;
+} DaemonConversion;
+
+// Same conversions as the headless mode
+static void daemon_convert_task(void* arg)
+{
+    DaemonConversion* conversion = arg;
+    bool reverse = emoji_kind_reverse(conversion->options->kind);
+
+    if (gif_file_is_animated(conversion->input_path)) {
+        conversion->converted = animation_to_explode_gif(conversion->input_path, conversion->output_path, reverse, NULL);
+        return;
+    }
+
+    Image image = load_image_fitted(conversion->input_path, conversion->options->max_size);
+    if (image.data == NULL) {
+        fprintf(stderr, "ERROR: failed to load image `%s`\n", conversion->input_path);
+        return;
+    }
+
+    conversion->converted = image_to_explode_gif(image, conversion->output_path, reverse);
+
+    UnloadImage(image);
+}
+
+// Converts on one of the workers, waiting for one to be free
+static bool daemon_convert(DaemonServer* server, const char* input_path, const char* output_path,
+                           const DaemonOptions* options)
+{
+    DaemonConversion conversion = {
+        .input_path = input_path,
+        .output_path = output_path,
+        .options = options,
+    };
+
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    thread_pool_group_submit(server->pool, &group, daemon_convert_task, &conversion);
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+
+    return conversion.converted;
+}
+
+// Handles one request. Returns false if the connection can't be used for
+// another one.
+static bool daemon_handle_request(DaemonServer* server, int fd, FILE* input, char* line)
+{
+    TRACE_SCOPE("daemon_request");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (strchr(line, '\n') == NULL) {
+        daemon_send_error(fd, "request line too long");
+        return false;
+    }
+
+    DaemonOptions options = server->defaults;
+    size_t input_size;
+    const char* error = daemon_parse_request(line, &options, &input_size);
+    if (error != NULL) {
+        daemon_send_error(fd, error);
+        return false;
+    }
+
+    size_t id = atomic_fetch_add(&server->next_request, 1);
+    char input_path[PATH_MAX];
+    char output_path[PATH_MAX];
+    snprintf(input_path, sizeof(input_path), "%s/%zu", server->temp_dir, id);
+    snprintf(output_path, sizeof(output_path), "%s%s", input_path, emoji_format_suffix(options.format));
+
+    // The client is gone if its input is cut short
+    bool ok = daemon_receive_file(input, input_path, input_size);
+    bool converted = ok && daemon_convert(server, input_path, output_path, &options);
+    unlink(input_path);
+
+    size_t output_size = 0;
+    if (converted)
+        ok = daemon_send_file(fd, output_path, daemon_elapsed_ms(&start), &output_size);
+    else if (ok)
+        daemon_send_error(fd, "conversion failed");
+    unlink(output_path);
+
+    if (converted) {
+        printf("Request %zu: %zu bytes converted to %zu bytes in %.1f ms\n",
+               id, input_size, output_size, daemon_elapsed_ms(&start));
+        fflush(stdout);
+    } else
+        fprintf(stderr, "ERROR: request %zu failed after %.1f ms\n", id, daemon_elapsed_ms(&start));
+
+    return ok && converted;
+}
+
+static void daemon_connection_remove(DaemonServer* server, int fd)
+{
+    pthread_mutex_lock(&server->mutex);
+    for (size_t i = 0; i < server->connections_count; ++i) {
+        if (server->connections[i] == fd) {
+            server->connections[i] = server->connections[--server->connections_count];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&server->closed);
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void* daemon_connection_run(void* arg)
+{
+    DaemonConnection* connection = arg;
+    DaemonServer* server = connection->server;
+    int fd = connection->fd;
+
+    int input_fd = dup(fd);
+    FILE* input = input_fd >= 0 ? fdopen(input_fd, "rb") : NULL;
+    if (input != NULL) {
+        char line[DAEMON_LINE_MAX];
+        while (fgets(line, sizeof(line), input) != NULL) {
+            if (!daemon_handle_request(server, fd, input, line))
+                break;
+        }
+        fclose(input);
+    } else if (input_fd >= 0) {
+        close(input_fd);
+    }
+
+    free(connection);
+
+    // Closed once out of the list, as the descriptor may then be reused
+    daemon_connection_remove(server, fd);
+    close(fd);
+    return NULL;
+}
+
+// Starts a thread for the connection, or turns it away when there are
+// already too many. Never waits for the workers.
+static void daemon_connection_open(DaemonServer* server, int fd)
+{
+    pthread_mutex_lock(&server->mutex);
+    bool full = server->connections_count == DAEMON_MAX_CONNECTIONS;
+    if (!full)
+        server->connections[server->connections_count++] = fd;
+    pthread_mutex_unlock(&server->mutex);
+
+    if (!full) {
+        DaemonConnection* connection = malloc(sizeof(*connection));
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        bool started = false;
+        if (connection != NULL) {
+            *connection = (DaemonConnection) { .server = server, .fd = fd };
+            started = pthread_create(&thread, &attributes, daemon_connection_run, connection) == 0;
+        }
+        pthread_attr_destroy(&attributes);
+        if (started)
+            return;
+
+        free(connection);
+        daemon_connection_remove(server, fd);
+    }
+
+    daemon_send_error(fd, "busy");
+    close(fd);
+}
+
+static int daemon_listen(const char* socket_path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR: socket path `%s` is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // A socket left behind by a daemon that didn't stop cleanly is replaced
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "ERROR: could not listen on `%s`: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int daemon_main(const char* socket_path, size_t jobs,
+                EmojiKind kind, EmojiFormat format, int max_size)
+{
+    // Signals are only received through `signal_fd`: every thread started
+    // from here inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        fprintf(stderr, "ERROR: could not watch signals: %s\n", strerror(errno));
+        return 1;
+    }
+
+    DaemonServer server = {
+        .defaults = {
+            .kind = kind,
+            .format = format,
+            .max_size = max_size,
+        },
+    };
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.closed, NULL);
+
+    const char* tmp = getenv("TMPDIR");
+    char temp_template[PATH_MAX];
+    snprintf(temp_template, sizeof(temp_template), "%s/explode-daemon-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    server.temp_dir = mkdtemp(temp_template);
+    if (server.temp_dir == NULL) {
+        fprintf(stderr, "ERROR: could not create a temporary directory: %s\n", strerror(errno));
+        close(signal_fd);
+        return 1;
+    }
+
+    int listen_fd = daemon_listen(socket_path);
+    // Room for a conversion from every connection, so submitting never waits
+    ThreadPool* pool = listen_fd >= 0 ? thread_pool_create(jobs, DAEMON_MAX_CONNECTIONS) : NULL;
+    if (listen_fd >= 0 && pool == NULL)
+        fprintf(stderr, "ERROR: could not create worker threads\n");
+    server.pool = pool;
+
+    if (pool != NULL) {
+        printf("Listening on `%s` with %zu workers\n", socket_path, jobs);
+        fflush(stdout);
+    }
+
+    while (pool != NULL) {
+        struct pollfd fds[] = {
+            { .fd = listen_fd, .events = POLLIN },
+            { .fd = signal_fd, .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: could not wait for connections: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (!fds[0].revents)
+            continue;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        struct timeval timeout = { .tv_sec = DAEMON_IDLE_TIMEOUT_SECONDS };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        daemon_connection_open(&server, fd);
+    }
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+
+    if (pool != NULL) {
+        printf("Stopping\n");
+
+        // Requests being converted are answered, idle connections are closed
+        pthread_mutex_lock(&server.mutex);
+        for (size_t i = 0; i < server.connections_count; ++i)
+            shutdown(server.connections[i], SHUT_RD);
+        while (server.connections_count > 0)
+            pthread_cond_wait(&server.closed, &server.mutex);
+        pthread_mutex_unlock(&server.mutex);
+
+        thread_pool_destroy(pool);
+    }
+
+    rmdir(server.temp_dir);
+    pthread_cond_destroy(&server.closed);
+    pthread_mutex_destroy(&server.mutex);
+    close(signal_fd);
+
+    arena_pool_trim();
+    magick_runtime_shutdown();
+
+    return pool != NULL ? 0 : 1;
+}
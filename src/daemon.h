@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "emoji.h"
+
+// Serves conversions on a Unix domain socket, so the ImageMagick runtime,
+// the overlay cache, the arena pool and the worker threads stay warm between
+// them. Each connection sends any amount of requests, one after the other:
+//
+//     CONVERT <LENGTH> [kind=explode|implode] [format=gif|png] [size=<PX>]\n
+//     <LENGTH bytes of the input image>
+//
+// and gets for each of them either
+//
+//     OK <LENGTH> <MILLISECONDS>\n
+//     <LENGTH bytes of the animation>
+//
+// or `ERROR <MESSAGE>\n`, after which the connection is closed. The
+// milliseconds are the time taken to receive and convert the input. Omitted
+// options take the values given here. Connections over the limit get
+// `ERROR busy\n` right away, and `jobs` conversions run at a time.
+//
+// Runs until SIGINT or SIGTERM, and returns the process exit code.
+int daemon_main(const char* socket_path, size_t jobs,
+                EmojiKind kind, EmojiFormat format, int max_size);
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+
+// Largest images decoded: 16k x 16k, the size of the biggest posters the
+// conversions are tiled for. Headers announcing more are rejected before
+// anything is allocated, so a file of a few bytes can't take gigabytes.
+#define DECODE_MAX_PIXELS ((size_t)16384 * 16384)
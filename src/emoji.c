@@ -0,0 +1,25 @@
+#include "emoji.h"
+
+const char* emoji_format_suffix(EmojiFormat format)
+{
+    switch (format) {
+    case EMOJI_FORMAT_GIF:
+        return "_out.gif";
+    case EMOJI_FORMAT_PNG:
+        return "_out.png";
+    default:
+        return "_out.png";
+    }
+}
+
+bool emoji_kind_reverse(EmojiKind kind)
+{
+    switch (kind) {
+    case EMOJI_KIND_EXPLODE:
+        return false;
+    case EMOJI_KIND_IMPLODE:
+        return true;
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+typedef enum {
+    EMOJI_KIND_EXPLODE = 0,
+    EMOJI_KIND_IMPLODE,
+    COUNT_EMOJI_KINDS,
+} EmojiKind;
+
+typedef enum {
+    EMOJI_FORMAT_GIF = 0,
+    EMOJI_FORMAT_PNG,
+    COUNT_EMOJI_FORMATS,
+} EmojiFormat;
+
+// Suffix appended to the input path to build the output path
+const char* emoji_format_suffix(EmojiFormat format);
+// Whether the animation has to be played backwards for the given kind
+bool emoji_kind_reverse(EmojiKind kind);
@@ -1,9 +1,11 @@
 #include "explode.h"
 
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
-#include <stdlib.h>
 
 #include <raylib.h>
 
@@ -11,30 +13,179 @@
 // #define ARENA_IMPLEMENTATION
 #include "external/arena.h"
 
-#include "resources/explode_frames.h"
-
-#include "resize.h"
+#include "explode_remap.h"
+#include "explode_stream.h"
 #include "gif_save.h"
+#include "overlay_cache.h"
+#include "util/arena_pool.h"
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+// Source image, then every explode level, then the overlay
+#define EXPLODE_FRAMES_COUNT (1 + EXPLODE_LEVELS_COUNT + OVERLAY_FRAMES_COUNT)
+// Frames bigger than this are split in bands of rows processed in parallel
+#define EXPLODE_BAND_PIXELS (1 << 16)
+// Offsets resolved by each band of a tiled frame
+#define EXPLODE_TILE_BYTES (1 << 20)
+#define EXPLODE_TILED_DEFAULT_BUDGET_MB 1024
+
+typedef struct {
+    const ExplodeMap* map;
+    float level;
+    int32_t* offsets_x;
+    int32_t* offsets_y;
+    int dy_begin;
+    int dy_end;
+} ExplodeOffsetsTask;
+
+typedef struct {
+    const ExplodeRemap* remap;
+    // Set for tiled frames, whose bands resolve their own offsets
+    const ExplodeMap* map;
+    // From 1 to EXPLODE_LEVELS_COUNT
+    int level;
+    int y_begin;
+    int y_end;
+} ExplodeRemapTask;
+
+static size_t explode_budget = (size_t)EXPLODE_TILED_DEFAULT_BUDGET_MB * 1024 * 1024;
+static pthread_once_t explode_once = PTHREAD_ONCE_INIT;
+
+static void explode_init(void)
+{
+    const char* budget_mb = getenv("EXPLODE_TILED_MB");
+    if (budget_mb != NULL)
+        explode_budget = strtoull(budget_mb, NULL, 10) * 1024 * 1024;
+}
+
+// Geometry of the map, without the distances
+static ExplodeMap explode_map_geometry(int width, int height)
+{
+    ExplodeMap map = {
+        .width = width,
+        .height = height,
+        .cx = width / 2,
+        .cy = height / 2,
+        .radius = fmin(width, height) / 2.0f,
+    };
+    // The center is rounded down, so the quadrant going towards (0, 0) is
+    // always the largest one.
+    map.quadrant_width = map.cx + 1;
+    map.quadrant_height = map.cy + 1;
+    return map;
+}
+
+static inline float explode_map_distance(const ExplodeMap* map, int dx, int dy)
+{
+    float fdx = (float)dx;
+    float fdy = (float)dy;
+    float distance = sqrtf(fdx * fdx + fdy * fdy);
+
+    float normalized_distance = 1.0f;
+    if (distance < map->radius)
+        normalized_distance = distance / map->radius;
+    return normalized_distance;
+}
+
+ExplodeMap explode_map_create(Arena* arena, int width, int height)
+{
+    ExplodeMap map = explode_map_geometry(width, height);
 
-static void* resize_pixels(Arena* arena,
-                           void* pixels, int old_width, int old_height,
-                           int new_width, int new_height)
+    map.distances = arena_alloc(arena, (size_t)map.quadrant_width * map.quadrant_height * sizeof(float));
+    for (int dy = 0; dy < map.quadrant_height; ++dy) {
+        for (int dx = 0; dx < map.quadrant_width; ++dx)
+            map.distances[(size_t)dy * map.quadrant_width + dx] = explode_map_distance(&map, dx, dy);
+    }
+
+    return map;
+}
+
+// Resolves the displacement of quadrant rows [dy_begin, dy_end) for a level,
+// written to the offsets from their first row on. It is mirrored around
+// (cx, cy) for the other three quadrants, as truncating towards zero is
+// symmetric.
+static void explode_map_offsets(const ExplodeMap* map, float level,
+                                int32_t* offsets_x, int32_t* offsets_y,
+                                int dy_begin, int dy_end)
 {
-    void* new_pixels = arena_alloc(arena, new_width * new_height * sizeof(uint32_t));
+    int quadrant_width = map->quadrant_width;
+
+    for (int dy = dy_begin; dy < dy_end; ++dy) {
+        const float* distances = map->distances ? &map->distances[(size_t)dy * quadrant_width] : NULL;
+        int32_t* row_x = &offsets_x[(size_t)(dy - dy_begin) * quadrant_width];
+        int32_t* row_y = &offsets_y[(size_t)(dy - dy_begin) * quadrant_width];
+
+        for (int dx = 0; dx < quadrant_width; ++dx) {
+            float normalized_distance = distances ? distances[dx] : explode_map_distance(map, dx, dy);
+            float factor = normalized_distance < 1.0f ? powf(normalized_distance, level) : 1.0f;
+
+            row_x[dx] = (int)((float)dx * factor);
+            row_y[dx] = (int)((float)dy * factor);
+        }
+    }
+}
 
-    image_resize(pixels, old_width, old_height,
-                 new_pixels, new_width, new_height);
+// Bytes taken by an arena allocation of `size` bytes
+static size_t explode_arena_size(size_t size)
+{
+    return (size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t) * sizeof(uintptr_t);
+}
 
-    return new_pixels;
+static size_t explode_map_arena_size(int width, int height)
+{
+    size_t quadrant_size = (size_t)(width / 2 + 1) * (height / 2 + 1);
+    return explode_arena_size(quadrant_size * sizeof(float));
 }
 
-static void* explode_image_and_copy(Arena* arena, Image image, float level)
+static size_t explode_offsets_arena_size(int width, int height)
 {
-    Image copy = image;
-    copy.data = arena_alloc(arena, image.width * image.height * sizeof(uint32_t));
-    memcpy(copy.data, image.data, image.width * image.height * sizeof(uint32_t));
-    image_explode(&copy, level);
-    return copy.data;
+    size_t quadrant_size = (size_t)(width / 2 + 1) * (height / 2 + 1);
+    return 2 * explode_arena_size(quadrant_size * sizeof(int32_t));
+}
+
+void image_explode_to(const Image* src, Image* dst, const ExplodeMap* map, float level, Arena* scratch)
+{
+    TRACE_SCOPE("image_explode");
+
+    size_t frame_size = (size_t)map->width * map->height * sizeof(uint32_t);
+    if (level <= 0) {
+        memcpy(dst->data, src->data, frame_size);
+        return;
+    }
+
+    size_t quadrant_size = (size_t)map->quadrant_width * map->quadrant_height;
+    int32_t* offsets_x = arena_alloc(scratch, quadrant_size * sizeof(int32_t));
+    int32_t* offsets_y = arena_alloc(scratch, quadrant_size * sizeof(int32_t));
+    explode_map_offsets(map, level, offsets_x, offsets_y, 0, map->quadrant_height);
+
+    ExplodeRemap remap = {
+        .src = src->data,
+        .dst = dst->data,
+        .offsets_x = offsets_x,
+        .offsets_y = offsets_y,
+        .quadrant_width = map->quadrant_width,
+        .width = map->width,
+        .height = map->height,
+        .cx = map->cx,
+        .cy = map->cy,
+    };
+    explode_remap_rows(&remap, 0, map->height);
+}
+
+void image_explode_with_map(Image* image, const ExplodeMap* map, float level)
+{
+    if (level <= 0)
+        return;
+
+    size_t frame_size = (size_t)map->width * map->height * sizeof(uint32_t);
+    Arena* scratch = arena_pool_acquire(explode_arena_size(frame_size)
+                                        + explode_offsets_arena_size(map->width, map->height));
+
+    Image original = *image;
+    original.data = arena_memdup(scratch, image->data, frame_size);
+    image_explode_to(&original, image, map, level, scratch);
+
+    arena_pool_release(scratch);
 }
 
 void image_explode(Image* image, float level)
@@ -42,130 +193,392 @@ void image_explode(Image* image, float level)
     if (level <= 0)
         return;
 
-    int width = image->width;
-    int height = image->height;
-    int cx = width / 2;
-    int cy = height / 2;
-    float max_radius = fmin(width, height) / 2.0f;
-
-    uint32_t* original_data = (uint32_t*)malloc(width * height * sizeof(uint32_t));
-    memcpy(original_data, image->data, width * height * sizeof(uint32_t));
-
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            float dx = (float)(x - cx);
-            float dy = (float)(y - cy);
-            float distance = sqrtf(dx * dx + dy * dy);
-
-            float factor = 1.0f;
-            if (distance < max_radius) {
-                float normalized_distance = distance / max_radius;
-                factor = powf(normalized_distance, level);
-            }
-
-            int distorted_x = cx + (int)(dx * factor);
-            int distorted_y = cy + (int)(dy * factor);
-            distorted_x = fmax(0, fmin(distorted_x, width - 1));
-            distorted_y = fmax(0, fmin(distorted_y, height - 1));
-
-            uint32_t color = original_data[distorted_y * width + distorted_x];
-            ((uint32_t*)image->data)[y * image->width + x] = color;
-        }
+    size_t frame_size = (size_t)image->width * image->height * sizeof(uint32_t);
+    Arena* scratch = arena_pool_acquire(explode_map_arena_size(image->width, image->height)
+                                        + explode_arena_size(frame_size)
+                                        + explode_offsets_arena_size(image->width, image->height));
+
+    ExplodeMap map = explode_map_create(scratch, image->width, image->height);
+    Image original = *image;
+    original.data = arena_memdup(scratch, image->data, frame_size);
+    image_explode_to(&original, image, &map, level, scratch);
+
+    arena_pool_release(scratch);
+}
+
+static void explode_offsets_task(void* arg)
+{
+    ExplodeOffsetsTask* task = arg;
+    TRACE_SCOPE_ARG("explode_offsets", "level", lroundf(task->level * EXPLODE_LEVELS_COUNT));
+    size_t first = (size_t)task->dy_begin * task->map->quadrant_width;
+    explode_map_offsets(task->map, task->level,
+                        task->offsets_x + first, task->offsets_y + first,
+                        task->dy_begin, task->dy_end);
+}
+
+static void explode_remap_task(void* arg)
+{
+    ExplodeRemapTask* task = arg;
+    TRACE_SCOPE_ARG("image_explode", "level", task->level);
+    explode_remap_rows(task->remap, task->y_begin, task->y_end);
+}
+
+// Resolves the offsets of the quadrant rows a band reads, then remaps it
+static void explode_tile_task(void* arg)
+{
+    ExplodeRemapTask* task = arg;
+    TRACE_SCOPE_ARG("image_explode", "level", task->level);
+
+    // The band may straddle the center, whose row is read by both halves
+    const ExplodeMap* map = task->map;
+    int dy_first = abs(task->y_begin - map->cy);
+    int dy_last = abs(task->y_end - 1 - map->cy);
+    bool straddles = task->y_begin <= map->cy && map->cy < task->y_end;
+    int dy_begin = straddles ? 0 : (dy_first < dy_last ? dy_first : dy_last);
+    int dy_end = (dy_first > dy_last ? dy_first : dy_last) + 1;
+
+    size_t offsets_size = (size_t)(dy_end - dy_begin) * map->quadrant_width * sizeof(int32_t);
+    Arena* scratch = arena_pool_acquire(2 * explode_arena_size(offsets_size));
+    int32_t* offsets_x = arena_alloc(scratch, offsets_size);
+    int32_t* offsets_y = arena_alloc(scratch, offsets_size);
+    explode_map_offsets(map, (float)task->level / EXPLODE_LEVELS_COUNT, offsets_x, offsets_y, dy_begin, dy_end);
+
+    ExplodeRemap remap = *task->remap;
+    remap.offsets_x = offsets_x;
+    remap.offsets_y = offsets_y;
+    remap.offsets_row = dy_begin;
+    explode_remap_rows(&remap, task->y_begin, task->y_end);
+
+    arena_pool_release(scratch);
+}
+
+static int explode_band_rows(int width)
+{
+    int rows = EXPLODE_BAND_PIXELS / (width > 0 ? width : 1);
+    return rows > 0 ? rows : 1;
+}
+
+// Rows of a tiled band, whose offsets take up to EXPLODE_TILE_BYTES
+static int explode_tile_rows(int width)
+{
+    size_t row_size = 2 * (size_t)(width / 2 + 1) * sizeof(int32_t);
+    size_t rows = EXPLODE_TILE_BYTES / row_size;
+    return rows > 0 ? rows : 1;
+}
+
+static size_t explode_bands_count(int height, int band_rows)
+{
+    return ((size_t)height + band_rows - 1) / band_rows;
+}
+
+// Queues the tasks resolving the offsets of one level, allocated from `arena`
+static void explode_submit_offsets(ThreadPool* pool, ThreadPoolGroup* group, Arena* arena, const ExplodeMap* map,
+                                   float level, int32_t* offsets_x, int32_t* offsets_y)
+{
+    int band_rows = explode_band_rows(map->quadrant_width);
+    for (int dy = 0; dy < map->quadrant_height; dy += band_rows) {
+        ExplodeOffsetsTask* task = arena_alloc(arena, sizeof(*task));
+        *task = (ExplodeOffsetsTask) {
+            .map = map,
+            .level = level,
+            .offsets_x = offsets_x,
+            .offsets_y = offsets_y,
+            .dy_begin = dy,
+            .dy_end = dy + band_rows < map->quadrant_height ? dy + band_rows : map->quadrant_height,
+        };
+        thread_pool_group_submit(pool, group, explode_offsets_task, task);
     }
+}
 
-    free(original_data);
-}
-
-void image_to_explode_gif(Image image, const char* output, bool reverse)
-{
-    Arena arena = { 0 };
-
-    void* gif_frame_data[] = {
-        image.data,
-        explode_image_and_copy(&arena, image, 0.125f),
-        explode_image_and_copy(&arena, image, 0.250f),
-        explode_image_and_copy(&arena, image, 0.375f),
-        explode_image_and_copy(&arena, image, 0.500f),
-        explode_image_and_copy(&arena, image, 0.625f),
-        explode_image_and_copy(&arena, image, 0.750f),
-        explode_image_and_copy(&arena, image, 0.875f),
-        explode_image_and_copy(&arena, image, 1.000f),
-        resize_pixels(&arena,
-                      explode_frame_00_data, explode_frame_00_width, explode_frame_00_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_01_data, explode_frame_01_width, explode_frame_01_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_02_data, explode_frame_02_width, explode_frame_02_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_03_data, explode_frame_03_width, explode_frame_03_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_04_data, explode_frame_04_width, explode_frame_04_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_05_data, explode_frame_05_width, explode_frame_05_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_06_data, explode_frame_06_width, explode_frame_06_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_07_data, explode_frame_07_width, explode_frame_07_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_08_data, explode_frame_08_width, explode_frame_08_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_09_data, explode_frame_09_width, explode_frame_09_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_10_data, explode_frame_10_width, explode_frame_10_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_11_data, explode_frame_11_width, explode_frame_11_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_12_data, explode_frame_12_width, explode_frame_12_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_13_data, explode_frame_13_width, explode_frame_13_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_14_data, explode_frame_14_width, explode_frame_14_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_15_data, explode_frame_15_width, explode_frame_15_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_16_data, explode_frame_16_width, explode_frame_16_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_17_data, explode_frame_17_width, explode_frame_17_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_18_data, explode_frame_18_width, explode_frame_18_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_19_data, explode_frame_19_width, explode_frame_19_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_20_data, explode_frame_20_width, explode_frame_20_height,
-                      image.width, image.height),
-        resize_pixels(&arena,
-                      explode_frame_21_data, explode_frame_21_width, explode_frame_21_height,
-                      image.width, image.height),
-    };
+struct ExplodeAnimation {
+    // From the arena pool, the animation itself lives in it
+    Arena* arena;
+    GifFrames frames;
+    OverlayFrames* overlay;
+};
+
+// Upper bound of what `explode_animation_create` takes from its arena, so it
+// fits in a single region
+static size_t explode_animation_arena_size(int width, int height)
+{
+    size_t frame_size = (size_t)width * height * sizeof(uint32_t);
+    int quadrant_width = width / 2 + 1;
+    int quadrant_height = height / 2 + 1;
+    size_t offsets_tasks = explode_bands_count(quadrant_height, explode_band_rows(quadrant_width));
+    size_t remap_tasks = explode_bands_count(height, explode_band_rows(width));
+
+    return explode_arena_size(sizeof(ExplodeAnimation))
+        + EXPLODE_LEVELS_COUNT * explode_arena_size(frame_size)
+        + explode_map_arena_size(width, height)
+        + explode_arena_size(EXPLODE_LEVELS_COUNT * sizeof(ExplodeRemap))
+        + EXPLODE_LEVELS_COUNT * explode_offsets_arena_size(width, height)
+        + EXPLODE_LEVELS_COUNT * offsets_tasks * explode_arena_size(sizeof(ExplodeOffsetsTask))
+        + EXPLODE_LEVELS_COUNT * remap_tasks * explode_arena_size(sizeof(ExplodeRemapTask))
+        + explode_arena_size(EXPLODE_FRAMES_COUNT * sizeof(void*));
+}
+
+static void explode_report_stage(const ExplodeCallbacks* callbacks, ExplodeStage stage)
+{
+    if (callbacks && callbacks->stage)
+        callbacks->stage(callbacks->user_data, stage);
+}
+
+static bool explode_cancelled(const ExplodeCallbacks* callbacks)
+{
+    return callbacks && callbacks->cancelled && callbacks->cancelled(callbacks->user_data);
+}
+
+ExplodeAnimation* explode_animation_create(Image image, bool reverse, const ExplodeCallbacks* callbacks)
+{
+    if (explode_cancelled(callbacks))
+        return NULL;
+
+    // Reused from previous conversions, so converting images of the same size
+    // again doesn't allocate
+    Arena* arena = arena_pool_acquire(explode_animation_arena_size(image.width, image.height));
+    ExplodeAnimation* animation = arena_alloc(arena, sizeof(*animation));
+    *animation = (ExplodeAnimation) { .arena = arena };
+
+    size_t frame_size = (size_t)image.width * image.height * sizeof(uint32_t);
+
+    // Every buffer is allocated up front by this thread, the tasks only fill
+    // them in. That way the arena never has to be shared between threads.
+    void* gif_frame_data[EXPLODE_FRAMES_COUNT];
+    gif_frame_data[0] = image.data;
+    for (size_t i = 0; i < EXPLODE_LEVELS_COUNT; ++i)
+        gif_frame_data[1 + i] = arena_alloc(arena, frame_size);
+
+    ThreadPool* pool = thread_pool_global();
+
+    ExplodeMap map = explode_map_create(arena, image.width, image.height);
+    size_t quadrant_size = (size_t)map.quadrant_width * map.quadrant_height * sizeof(int32_t);
+
+    ThreadPoolGroup explode_group;
+    thread_pool_group_init(&explode_group);
+
+    // First resolve the offsets of every level...
+    ExplodeRemap* remaps = arena_alloc(arena, EXPLODE_LEVELS_COUNT * sizeof(*remaps));
+    for (size_t i = 0; i < EXPLODE_LEVELS_COUNT; ++i) {
+        float level = (float)(i + 1) / EXPLODE_LEVELS_COUNT;
 
-    GifFrames gif_frames = {
-        .frames = gif_frame_data,
-        .frames_count = sizeof(gif_frame_data) / sizeof(gif_frame_data[0]),
+        remaps[i] = (ExplodeRemap) {
+            .src = image.data,
+            .dst = gif_frame_data[1 + i],
+            .offsets_x = arena_alloc(arena, quadrant_size),
+            .offsets_y = arena_alloc(arena, quadrant_size),
+            .quadrant_width = map.quadrant_width,
+            .width = map.width,
+            .height = map.height,
+            .cx = map.cx,
+            .cy = map.cy,
+        };
+        explode_submit_offsets(pool, &explode_group, arena, &map, level,
+                               (int32_t*)remaps[i].offsets_x, (int32_t*)remaps[i].offsets_y);
+    }
+
+    // The overlays don't depend on the image. On a cache miss they are resized
+    // on the pool, after the offsets that were already queued.
+    explode_report_stage(callbacks, EXPLODE_STAGE_OVERLAY);
+    {
+        TRACE_SCOPE("overlay_cache_acquire");
+        animation->overlay = overlay_cache_acquire(image.width, image.height, RESIZE_FILTER_CUBIC);
+    }
+    if (animation->overlay == NULL) {
+        fprintf(stderr, "ERROR: could not resize the explosion overlay to %dx%d\n", image.width, image.height);
+        thread_pool_group_wait(&explode_group);
+        thread_pool_group_destroy(&explode_group);
+        explode_animation_destroy(animation);
+        return NULL;
+    }
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i)
+        gif_frame_data[1 + EXPLODE_LEVELS_COUNT + i] = animation->overlay->frames[i];
+
+    thread_pool_group_wait(&explode_group);
+
+    if (explode_cancelled(callbacks)) {
+        thread_pool_group_destroy(&explode_group);
+        explode_animation_destroy(animation);
+        return NULL;
+    }
+    explode_report_stage(callbacks, EXPLODE_STAGE_FRAMES);
+
+    // ...then gather the pixels, reading straight from the source image
+    int band_rows = explode_band_rows(image.width);
+    for (size_t i = 0; i < EXPLODE_LEVELS_COUNT; ++i) {
+        for (int y = 0; y < image.height; y += band_rows) {
+            ExplodeRemapTask* task = arena_alloc(arena, sizeof(*task));
+            *task = (ExplodeRemapTask) {
+                .remap = &remaps[i],
+                .level = i + 1,
+                .y_begin = y,
+                .y_end = y + band_rows < image.height ? y + band_rows : image.height,
+            };
+            thread_pool_group_submit(pool, &explode_group, explode_remap_task, task);
+        }
+    }
+    thread_pool_group_wait(&explode_group);
+    thread_pool_group_destroy(&explode_group);
+
+    // Kept in display order
+    animation->frames = (GifFrames) {
+        .frames = arena_alloc(arena, sizeof(gif_frame_data)),
+        .frames_count = EXPLODE_FRAMES_COUNT,
         .width = image.width,
         .height = image.height,
     };
+    for (size_t i = 0; i < EXPLODE_FRAMES_COUNT; ++i)
+        animation->frames.frames[i] = gif_frame_data[gif_frame_index(i, EXPLODE_FRAMES_COUNT, reverse)];
+
+    return animation;
+}
+
+GifFrames explode_animation_frames(const ExplodeAnimation* animation)
+{
+    return animation->frames;
+}
+
+bool explode_animation_save(ExplodeAnimation* animation, const char* output, const ExplodeCallbacks* callbacks)
+{
+    GifSaveCancel cancel = { 0 };
+    if (callbacks != NULL)
+        cancel = (GifSaveCancel) { callbacks->cancelled, callbacks->user_data };
+    return gif_save(animation->frames, output, false, &cancel);
+}
+
+void explode_animation_destroy(ExplodeAnimation* animation)
+{
+    if (animation == NULL)
+        return;
+
+    if (animation->overlay)
+        overlay_cache_release(animation->overlay);
+    arena_pool_release(animation->arena);
+}
+
+bool image_to_explode_gif(Image image, const char* output, bool reverse)
+{
+    return image_to_explode_gif_streamed(image, output, reverse, NULL);
+}
+
+size_t explode_tiled_budget(void)
+{
+    pthread_once(&explode_once, explode_init);
+    return explode_budget;
+}
+
+bool explode_tiled(int width, int height)
+{
+    // Every frame but the source is allocated, with the overlay in its cache
+    size_t frame_size = (size_t)width * height * sizeof(uint32_t);
+    return explode_animation_arena_size(width, height) + OVERLAY_FRAMES_COUNT * frame_size > explode_tiled_budget();
+}
+
+struct ExplodeLevels {
+    // From the arena pool, the levels themselves live in it
+    Arena* arena;
+    ExplodeMap map;
+    // Offsets of every level, unless tiled
+    ExplodeRemap remaps[EXPLODE_LEVELS_COUNT];
+    bool tiled;
+    // Bands of the frame being exploded
+    ExplodeRemap remap;
+    ExplodeRemapTask* tasks;
+    size_t tasks_count;
+};
+
+static size_t explode_levels_arena_size(int width, int height, bool tiled)
+{
+    if (tiled) {
+        return explode_arena_size(sizeof(ExplodeLevels))
+            + explode_arena_size(explode_bands_count(height, explode_tile_rows(width)) * sizeof(ExplodeRemapTask));
+    }
+
+    int quadrant_width = width / 2 + 1;
+    int quadrant_height = height / 2 + 1;
+    size_t offsets_tasks = explode_bands_count(quadrant_height, explode_band_rows(quadrant_width));
+    size_t remap_tasks = explode_bands_count(height, explode_band_rows(width));
+
+    return explode_arena_size(sizeof(ExplodeLevels))
+        + explode_map_arena_size(width, height)
+        + EXPLODE_LEVELS_COUNT * explode_offsets_arena_size(width, height)
+        + EXPLODE_LEVELS_COUNT * offsets_tasks * explode_arena_size(sizeof(ExplodeOffsetsTask))
+        + explode_arena_size(remap_tasks * sizeof(ExplodeRemapTask));
+}
+
+ExplodeLevels* explode_levels_create(int width, int height)
+{
+    bool tiled = explode_levels_arena_size(width, height, false) > explode_tiled_budget();
+    Arena* arena = arena_pool_acquire(explode_levels_arena_size(width, height, tiled));
+    ExplodeLevels* levels = arena_alloc(arena, sizeof(*levels));
+    *levels = (ExplodeLevels) {
+        .arena = arena,
+        .map = tiled ? explode_map_geometry(width, height) : explode_map_create(arena, width, height),
+        .tiled = tiled,
+    };
+    const ExplodeMap* map = &levels->map;
+    levels->remap = (ExplodeRemap) {
+        .quadrant_width = map->quadrant_width,
+        .width = map->width,
+        .height = map->height,
+        .cx = map->cx,
+        .cy = map->cy,
+    };
 
-    gif_save(gif_frames, output, reverse);
+    if (!tiled) {
+        size_t quadrant_size = (size_t)map->quadrant_width * map->quadrant_height * sizeof(int32_t);
+
+        ThreadPool* pool = thread_pool_global();
+        ThreadPoolGroup group;
+        thread_pool_group_init(&group);
+        for (size_t i = 0; i < EXPLODE_LEVELS_COUNT; ++i) {
+            int32_t* offsets_x = arena_alloc(arena, quadrant_size);
+            int32_t* offsets_y = arena_alloc(arena, quadrant_size);
+            levels->remaps[i] = levels->remap;
+            levels->remaps[i].offsets_x = offsets_x;
+            levels->remaps[i].offsets_y = offsets_y;
+            explode_submit_offsets(pool, &group, arena, map, (float)(i + 1) / EXPLODE_LEVELS_COUNT, offsets_x, offsets_y);
+        }
+        thread_pool_group_wait(&group);
+        thread_pool_group_destroy(&group);
+    }
+
+    int band_rows = tiled ? explode_tile_rows(width) : explode_band_rows(width);
+    levels->tasks_count = explode_bands_count(height, band_rows);
+    levels->tasks = arena_alloc(arena, levels->tasks_count * sizeof(*levels->tasks));
+    for (size_t i = 0; i < levels->tasks_count; ++i) {
+        int y = i * band_rows;
+        levels->tasks[i] = (ExplodeRemapTask) {
+            .remap = &levels->remap,
+            .map = tiled ? map : NULL,
+            .y_begin = y,
+            .y_end = y + band_rows < height ? y + band_rows : height,
+        };
+    }
 
-    arena_free(&arena);
+    return levels;
+}
+
+void explode_levels_apply(ExplodeLevels* levels, int level, const void* src, void* dst)
+{
+    if (!levels->tiled)
+        levels->remap = levels->remaps[level - 1];
+    levels->remap.src = src;
+    levels->remap.dst = dst;
+
+    ThreadPoolTask task = levels->tiled ? explode_tile_task : explode_remap_task;
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    for (size_t i = 0; i < levels->tasks_count; ++i) {
+        levels->tasks[i].level = level;
+        thread_pool_group_submit(thread_pool_global(), &group, task, &levels->tasks[i]);
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+}
+
+void explode_levels_destroy(ExplodeLevels* levels)
+{
+    if (levels == NULL)
+        return;
+    arena_pool_release(levels->arena);
 }
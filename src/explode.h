@@ -2,5 +2,94 @@
 
 #include <raylib.h>
 
-void image_to_explode_gif(Image image, const char* output, bool reverse);
+#include "external/arena.h"
+
+#include "gif_save.h"
+
+// Exploded frames between the source image and the overlay
+#define EXPLODE_LEVELS_COUNT 8
+
+// Geometry of the explode effect for a given image size. It does not depend
+// on the level, so it can be built once and shared by every frame.
+typedef struct {
+    int width;
+    int height;
+    int cx;
+    int cy;
+    // Distance to the center at which pixels stop moving
+    float radius;
+    // Only the quadrant from the center towards (0, 0) is stored, the other
+    // three are mirrored from it.
+    int quadrant_width;
+    int quadrant_height;
+    // Distance to the center normalized by the explode radius, clamped to 1.
+    // NULL for tiled frames, it's computed as needed instead.
+    float* distances;
+} ExplodeMap;
+
+ExplodeMap explode_map_create(Arena* arena, int width, int height);
+
+// Frames of a generated animation, kept in memory so they can be shown
+// without reading the saved file back.
+typedef struct ExplodeAnimation ExplodeAnimation;
+
+typedef enum {
+    // Resizing the overlay, while the explode offsets are computed
+    EXPLODE_STAGE_OVERLAY,
+    // Gathering the pixels of the exploded frames
+    EXPLODE_STAGE_FRAMES,
+} ExplodeStage;
+
+// Optional hooks into `explode_animation_create`, called on the generating
+// thread.
+typedef struct {
+    // Called when a stage starts
+    void (*stage)(void* user_data, ExplodeStage stage);
+    // Polled between stages. Generation stops as soon as it returns true.
+    bool (*cancelled)(void* user_data);
+    void* user_data;
+} ExplodeCallbacks;
+
+// Generates every frame. `image` is used as the first frame, so it must stay
+// valid until the animation is destroyed. `callbacks` may be NULL. Returns
+// NULL if generation was cancelled.
+ExplodeAnimation* explode_animation_create(Image image, bool reverse, const ExplodeCallbacks* callbacks);
+// Frames in display order, owned by the animation
+GifFrames explode_animation_frames(const ExplodeAnimation* animation);
+// `callbacks` may be NULL, only its `cancelled` hook is polled, between frames
+bool explode_animation_save(ExplodeAnimation* animation, const char* output, const ExplodeCallbacks* callbacks);
+// NULL is ignored
+void explode_animation_destroy(ExplodeAnimation* animation);
+
+// Generates and saves in one go, without keeping every frame in memory (see
+// `image_to_explode_gif_streamed`)
+bool image_to_explode_gif(Image image, const char* output, bool reverse);
+
+// Whether converting an image of this size in memory would take more than
+// EXPLODE_TILED_MB megabytes (1024 by default). Such images are tiled
+// instead: their frames are produced one at a time, in bands of rows that
+// each use a bounded amount of memory, and saved as they come (see
+// `image_to_explode_gif_streamed`).
+bool explode_tiled(int width, int height);
+// Memory budget of `explode_tiled`, in bytes
+size_t explode_tiled_budget(void);
 void image_explode(Image* image, float level);
+void image_explode_with_map(Image* image, const ExplodeMap* map, float level);
+// Writes `src` exploded by `level` to `dst`, which must be another image of the
+// same size. The offsets are allocated from `scratch`.
+void image_explode_to(const Image* src, Image* dst, const ExplodeMap* map, float level, Arena* scratch);
+
+// Every explode level of one frame size, resolved once to explode frames
+// produced one at a time, e.g. those of an animation as it's decoded. When
+// the offsets of every level would not fit in the tiled budget, each band
+// resolves the offsets of its own rows as it's exploded instead.
+typedef struct ExplodeLevels ExplodeLevels;
+
+ExplodeLevels* explode_levels_create(int width, int height);
+// Writes `src` exploded to `level`, from 1 to EXPLODE_LEVELS_COUNT, to `dst`.
+// Both are RGBA frames of the levels' size. The rows are split in bands on
+// the global thread pool, so it can't be called from one of its tasks, nor
+// from two threads at once.
+void explode_levels_apply(ExplodeLevels* levels, int level, const void* src, void* dst);
+// NULL is ignored
+void explode_levels_destroy(ExplodeLevels* levels);
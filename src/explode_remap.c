@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include "explode_remap.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EXPLODE_REMAP_X86
+#include <immintrin.h>
+#endif
+
+static inline int clamp_int(int value, int min, int max)
+{
+    return value < min ? min : (value > max ? max : value);
+}
+
+static void remap_pixels_scalar(const ExplodeRemap* remap, int y, int x_begin, int x_end)
+{
+    int cx = remap->cx;
+    int cy = remap->cy;
+    int dy = y < cy ? cy - y : y - cy;
+    const int32_t* offsets_x = &remap->offsets_x[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+    const int32_t* offsets_y = &remap->offsets_y[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+    uint32_t* out = &remap->dst[(size_t)y * remap->width];
+
+    for (int x = x_begin; x < x_end; ++x) {
+        int dx = x < cx ? cx - x : x - cx;
+        int distorted_x = x < cx ? cx - offsets_x[dx] : cx + offsets_x[dx];
+        int distorted_y = y < cy ? cy - offsets_y[dx] : cy + offsets_y[dx];
+        distorted_x = clamp_int(distorted_x, 0, remap->width - 1);
+        distorted_y = clamp_int(distorted_y, 0, remap->height - 1);
+        out[x] = remap->src[(size_t)distorted_y * remap->width + distorted_x];
+    }
+}
+
+static void remap_rows_scalar(const ExplodeRemap* remap, int y_begin, int y_end)
+{
+    for (int y = y_begin; y < y_end; ++y)
+        remap_pixels_scalar(remap, y, 0, remap->width);
+}
+
+#ifdef EXPLODE_REMAP_X86
+
+// SSE2 has no 32-bit min/max/mullo, so those are emulated. The gather itself
+// stays scalar.
+static inline __m128i sse2_clamp_epi32(__m128i v, __m128i min, __m128i max)
+{
+    __m128i below = _mm_cmplt_epi32(v, min);
+    v = _mm_or_si128(_mm_and_si128(below, min), _mm_andnot_si128(below, v));
+    __m128i above = _mm_cmpgt_epi32(v, max);
+    return _mm_or_si128(_mm_and_si128(above, max), _mm_andnot_si128(above, v));
+}
+
+static inline __m128i sse2_mullo_epi32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2"))) static void remap_rows_sse2(const ExplodeRemap* remap, int y_begin, int y_end)
+{
+    int cx = remap->cx;
+    int cy = remap->cy;
+    int width = remap->width;
+    __m128i zero = _mm_setzero_si128();
+    __m128i max_x = _mm_set1_epi32(width - 1);
+    __m128i max_y = _mm_set1_epi32(remap->height - 1);
+    __m128i center_x = _mm_set1_epi32(cx);
+    __m128i center_y = _mm_set1_epi32(cy);
+    __m128i stride = _mm_set1_epi32(width);
+
+    for (int y = y_begin; y < y_end; ++y) {
+        int dy = y < cy ? cy - y : y - cy;
+        const int32_t* offsets_x = &remap->offsets_x[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+        const int32_t* offsets_y = &remap->offsets_y[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+        uint32_t* out = &remap->dst[(size_t)y * width];
+        int32_t indices[4];
+
+        // Left half: offsets are read backwards, from dx = cx - x
+        int x = 0;
+        for (; x + 4 <= cx; x += 4) {
+            __m128i ox = _mm_loadu_si128((const __m128i*)&offsets_x[cx - x - 3]);
+            __m128i oy = _mm_loadu_si128((const __m128i*)&offsets_y[cx - x - 3]);
+            ox = _mm_shuffle_epi32(ox, _MM_SHUFFLE(0, 1, 2, 3));
+            oy = _mm_shuffle_epi32(oy, _MM_SHUFFLE(0, 1, 2, 3));
+
+            __m128i sx = sse2_clamp_epi32(_mm_sub_epi32(center_x, ox), zero, max_x);
+            __m128i sy = y < cy ? _mm_sub_epi32(center_y, oy) : _mm_add_epi32(center_y, oy);
+            sy = sse2_clamp_epi32(sy, zero, max_y);
+
+            _mm_storeu_si128((__m128i*)indices, _mm_add_epi32(sse2_mullo_epi32(sy, stride), sx));
+            for (int i = 0; i < 4; ++i)
+                out[x + i] = remap->src[indices[i]];
+        }
+        remap_pixels_scalar(remap, y, x, cx);
+
+        // Right half: offsets are read forwards, from dx = x - cx
+        x = cx;
+        for (; x + 4 <= width; x += 4) {
+            __m128i ox = _mm_loadu_si128((const __m128i*)&offsets_x[x - cx]);
+            __m128i oy = _mm_loadu_si128((const __m128i*)&offsets_y[x - cx]);
+
+            __m128i sx = sse2_clamp_epi32(_mm_add_epi32(center_x, ox), zero, max_x);
+            __m128i sy = y < cy ? _mm_sub_epi32(center_y, oy) : _mm_add_epi32(center_y, oy);
+            sy = sse2_clamp_epi32(sy, zero, max_y);
+
+            _mm_storeu_si128((__m128i*)indices, _mm_add_epi32(sse2_mullo_epi32(sy, stride), sx));
+            for (int i = 0; i < 4; ++i)
+                out[x + i] = remap->src[indices[i]];
+        }
+        remap_pixels_scalar(remap, y, x, width);
+    }
+}
+
+__attribute__((target("avx2"))) static void remap_rows_avx2(const ExplodeRemap* remap, int y_begin, int y_end)
+{
+    int cx = remap->cx;
+    int cy = remap->cy;
+    int width = remap->width;
+    const int* src = (const int*)remap->src;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i max_x = _mm256_set1_epi32(width - 1);
+    __m256i max_y = _mm256_set1_epi32(remap->height - 1);
+    __m256i center_x = _mm256_set1_epi32(cx);
+    __m256i center_y = _mm256_set1_epi32(cy);
+    __m256i stride = _mm256_set1_epi32(width);
+    __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    for (int y = y_begin; y < y_end; ++y) {
+        int dy = y < cy ? cy - y : y - cy;
+        const int32_t* offsets_x = &remap->offsets_x[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+        const int32_t* offsets_y = &remap->offsets_y[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+        uint32_t* out = &remap->dst[(size_t)y * width];
+
+        int x = 0;
+        for (; x + 8 <= cx; x += 8) {
+            __m256i ox = _mm256_loadu_si256((const __m256i*)&offsets_x[cx - x - 7]);
+            __m256i oy = _mm256_loadu_si256((const __m256i*)&offsets_y[cx - x - 7]);
+            ox = _mm256_permutevar8x32_epi32(ox, reverse);
+            oy = _mm256_permutevar8x32_epi32(oy, reverse);
+
+            __m256i sx = _mm256_max_epi32(_mm256_sub_epi32(center_x, ox), zero);
+            sx = _mm256_min_epi32(sx, max_x);
+            __m256i sy = y < cy ? _mm256_sub_epi32(center_y, oy) : _mm256_add_epi32(center_y, oy);
+            sy = _mm256_min_epi32(_mm256_max_epi32(sy, zero), max_y);
+
+            __m256i indices = _mm256_add_epi32(_mm256_mullo_epi32(sy, stride), sx);
+            _mm256_storeu_si256((__m256i*)&out[x], _mm256_i32gather_epi32(src, indices, 4));
+        }
+        remap_pixels_scalar(remap, y, x, cx);
+
+        x = cx;
+        for (; x + 8 <= width; x += 8) {
+            __m256i ox = _mm256_loadu_si256((const __m256i*)&offsets_x[x - cx]);
+            __m256i oy = _mm256_loadu_si256((const __m256i*)&offsets_y[x - cx]);
+
+            __m256i sx = _mm256_max_epi32(_mm256_add_epi32(center_x, ox), zero);
+            sx = _mm256_min_epi32(sx, max_x);
+            __m256i sy = y < cy ? _mm256_sub_epi32(center_y, oy) : _mm256_add_epi32(center_y, oy);
+            sy = _mm256_min_epi32(_mm256_max_epi32(sy, zero), max_y);
+
+            __m256i indices = _mm256_add_epi32(_mm256_mullo_epi32(sy, stride), sx);
+            _mm256_storeu_si256((__m256i*)&out[x], _mm256_i32gather_epi32(src, indices, 4));
+        }
+        remap_pixels_scalar(remap, y, x, width);
+    }
+}
+
+__attribute__((target("avx512f"))) static void remap_rows_avx512(const ExplodeRemap* remap, int y_begin, int y_end)
+{
+    int cx = remap->cx;
+    int cy = remap->cy;
+    int width = remap->width;
+    const int* src = (const int*)remap->src;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i max_x = _mm512_set1_epi32(width - 1);
+    __m512i max_y = _mm512_set1_epi32(remap->height - 1);
+    __m512i center_x = _mm512_set1_epi32(cx);
+    __m512i center_y = _mm512_set1_epi32(cy);
+    __m512i stride = _mm512_set1_epi32(width);
+    __m512i reverse = _mm512_setr_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+
+    for (int y = y_begin; y < y_end; ++y) {
+        int dy = y < cy ? cy - y : y - cy;
+        const int32_t* offsets_x = &remap->offsets_x[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+        const int32_t* offsets_y = &remap->offsets_y[(size_t)(dy - remap->offsets_row) * remap->quadrant_width];
+        uint32_t* out = &remap->dst[(size_t)y * width];
+
+        int x = 0;
+        for (; x + 16 <= cx; x += 16) {
+            __m512i ox = _mm512_loadu_si512(&offsets_x[cx - x - 15]);
+            __m512i oy = _mm512_loadu_si512(&offsets_y[cx - x - 15]);
+            ox = _mm512_permutexvar_epi32(reverse, ox);
+            oy = _mm512_permutexvar_epi32(reverse, oy);
+
+            __m512i sx = _mm512_max_epi32(_mm512_sub_epi32(center_x, ox), zero);
+            sx = _mm512_min_epi32(sx, max_x);
+            __m512i sy = y < cy ? _mm512_sub_epi32(center_y, oy) : _mm512_add_epi32(center_y, oy);
+            sy = _mm512_min_epi32(_mm512_max_epi32(sy, zero), max_y);
+
+            __m512i indices = _mm512_add_epi32(_mm512_mullo_epi32(sy, stride), sx);
+            _mm512_storeu_si512(&out[x], _mm512_i32gather_epi32(indices, src, 4));
+        }
+        remap_pixels_scalar(remap, y, x, cx);
+
+        x = cx;
+        for (; x + 16 <= width; x += 16) {
+            __m512i ox = _mm512_loadu_si512(&offsets_x[x - cx]);
+            __m512i oy = _mm512_loadu_si512(&offsets_y[x - cx]);
+
+            __m512i sx = _mm512_max_epi32(_mm512_add_epi32(center_x, ox), zero);
+            sx = _mm512_min_epi32(sx, max_x);
+            __m512i sy = y < cy ? _mm512_sub_epi32(center_y, oy) : _mm512_add_epi32(center_y, oy);
+            sy = _mm512_min_epi32(_mm512_max_epi32(sy, zero), max_y);
+
+            __m512i indices = _mm512_add_epi32(_mm512_mullo_epi32(sy, stride), sx);
+            _mm512_storeu_si512(&out[x], _mm512_i32gather_epi32(indices, src, 4));
+        }
+        remap_pixels_scalar(remap, y, x, width);
+    }
+}
+
+#endif // EXPLODE_REMAP_X86
+
+static ExplodeRemapKernel kernels[4];
+static size_t kernels_count = 0;
+static ExplodeRemapRows selected_remap_rows = remap_rows_scalar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void kernels_init(void)
+{
+    kernels[kernels_count++] = (ExplodeRemapKernel) { "scalar", remap_rows_scalar };
+
+#ifdef EXPLODE_REMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[kernels_count++] = (ExplodeRemapKernel) { "sse2", remap_rows_sse2 };
+    if (__builtin_cpu_supports("avx2"))
+        kernels[kernels_count++] = (ExplodeRemapKernel) { "avx2", remap_rows_avx2 };
+    if (__builtin_cpu_supports("avx512f"))
+        kernels[kernels_count++] = (ExplodeRemapKernel) { "avx512", remap_rows_avx512 };
+#endif
+
+    selected_remap_rows = kernels[kernels_count - 1].remap_rows;
+
+    const char* forced = getenv("EXPLODE_REMAP_KERNEL");
+    if (forced == NULL)
+        return;
+
+    for (size_t i = 0; i < kernels_count; ++i) {
+        if (strcmp(kernels[i].name, forced) == 0) {
+            selected_remap_rows = kernels[i].remap_rows;
+            return;
+        }
+    }
+    fprintf(stderr, "WARNING: explode kernel `%s` is not available, using `%s`\n",
+            forced, kernels[kernels_count - 1].name);
+}
+
+size_t explode_remap_kernels(const ExplodeRemapKernel** out_kernels)
+{
+    pthread_once(&kernels_once, kernels_init);
+    *out_kernels = kernels;
+    return kernels_count;
+}
+
+void explode_remap_rows(const ExplodeRemap* remap, int y_begin, int y_end)
+{
+    pthread_once(&kernels_once, kernels_init);
+
+    // The vector kernels index the source with 32-bit integers
+    if ((int64_t)remap->width * remap->height > INT32_MAX) {
+        remap_rows_scalar(remap, y_begin, y_end);
+        return;
+    }
+    selected_remap_rows(remap, y_begin, y_end);
+}
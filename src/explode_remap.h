@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One level of the explode effect resolved to integer offsets. The offsets
+// only cover the quadrant from the center towards (0, 0) and are mirrored
+// for the other three.
+typedef struct {
+    const uint32_t* src;
+    uint32_t* dst;
+    const int32_t* offsets_x;
+    const int32_t* offsets_y;
+    // First quadrant row held by the offsets, when they only cover the rows
+    // a band of the frame reads
+    int offsets_row;
+    int quadrant_width;
+    int width;
+    int height;
+    int cx;
+    int cy;
+} ExplodeRemap;
+
+typedef void (*ExplodeRemapRows)(const ExplodeRemap* remap, int y_begin, int y_end);
+
+typedef struct {
+    const char* name;
+    ExplodeRemapRows remap_rows;
+} ExplodeRemapKernel;
+
+// Kernels usable on the current CPU, starting with the scalar reference one.
+// The last one is the fastest.
+size_t explode_remap_kernels(const ExplodeRemapKernel** kernels);
+
+// Remaps rows [y_begin, y_end) of `remap->dst` with the best kernel for the
+// current CPU. The choice can be forced with the EXPLODE_REMAP_KERNEL
+// environment variable (scalar, sse2, avx2 or avx512).
+void explode_remap_rows(const ExplodeRemap* remap, int y_begin, int y_end);
@@ -0,0 +1,445 @@
+#include "explode_stream.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gif_load.h"
+#include "gif_save.h"
+#include "overlay_cache.h"
+#include "result_cache.h"
+#include "util/trace.h"
+
+// Frames decoded ahead of the one being exploded
+#define EXPLODE_STREAM_SLOTS 3
+// First source frames the GIF palette is built from, along with the overlay.
+// The explosion only moves their pixels around.
+#define EXPLODE_STREAM_PALETTE_FRAMES 8
+// Largest side of the frames the GIF palette is built from when the overlay
+// isn't cached, so it doesn't have to be resized to full-size samples
+#define EXPLODE_STREAM_SAMPLE_SIZE 512
+// Enough for the palette frames of an animation, or for an image weighted by
+// its explode levels, plus the overlay
+#define EXPLODE_STREAM_SAMPLES (1 + EXPLODE_LEVELS_COUNT + OVERLAY_FRAMES_COUNT)
+
+typedef struct {
+    uint8_t* pixels;
+    int delay;
+    // 0 for the source animation
+    int level;
+    bool failed;
+} ExplodeStreamSlot;
+
+typedef struct {
+    GifReader* reader;
+    size_t frames_count;
+    bool reverse;
+
+    ExplodeStreamSlot slots[EXPLODE_STREAM_SLOTS];
+    sem_t free_slots;
+    sem_t decoded_slots;
+    atomic_bool stopped;
+} ExplodeStream;
+
+// Frames the GIF palette is built from
+typedef struct {
+    void* frames[EXPLODE_STREAM_SAMPLES];
+    size_t frames_count;
+    // Allocated for the samples, the other frames belong to the overlay cache
+    void* owned[EXPLODE_STREAM_SAMPLES];
+    size_t owned_count;
+    int width;
+    int height;
+} ExplodeStreamSamples;
+
+// The source animation plays once, and the explode levels are drawn over the
+// frames that follow, looping as needed
+static size_t explode_stream_items_count(const ExplodeStream* stream)
+{
+    return stream->frames_count + EXPLODE_LEVELS_COUNT;
+}
+
+static int explode_stream_level(const ExplodeStream* stream, size_t item)
+{
+    if (stream->reverse)
+        return item < EXPLODE_LEVELS_COUNT ? EXPLODE_LEVELS_COUNT - (int)item : 0;
+    return item < stream->frames_count ? 0 : (int)(item - stream->frames_count) + 1;
+}
+
+static size_t explode_stream_source_frame(const ExplodeStream* stream, size_t item)
+{
+    size_t source_begin = stream->reverse ? EXPLODE_LEVELS_COUNT : 0;
+    size_t levels_begin = stream->reverse ? 0 : stream->frames_count;
+    if (item >= source_begin && item < source_begin + stream->frames_count)
+        return item - source_begin;
+    return (item - levels_begin) % stream->frames_count;
+}
+
+static void* explode_stream_decode(void* arg)
+{
+    ExplodeStream* stream = arg;
+    size_t next_frame = 0;
+
+    for (size_t i = 0; i < explode_stream_items_count(stream); ++i) {
+        sem_wait(&stream->free_slots);
+        if (atomic_load_explicit(&stream->stopped, memory_order_relaxed))
+            break;
+
+        ExplodeStreamSlot* slot = &stream->slots[i % EXPLODE_STREAM_SLOTS];
+        bool ok = true;
+        // Only ever goes back to the first frame
+        if (explode_stream_source_frame(stream, i) != next_frame) {
+            ok = gif_reader_rewind(stream->reader);
+            next_frame = 0;
+        }
+        ok = ok && gif_reader_next(stream->reader, slot->pixels, &slot->delay);
+        next_frame++;
+
+        slot->level = explode_stream_level(stream, i);
+        slot->failed = !ok;
+        sem_post(&stream->decoded_slots);
+        if (!ok)
+            break;
+    }
+
+    return NULL;
+}
+
+static void explode_report_stage(const ExplodeCallbacks* callbacks, ExplodeStage stage)
+{
+    if (callbacks && callbacks->stage)
+        callbacks->stage(callbacks->user_data, stage);
+}
+
+static bool explode_cancelled(const ExplodeCallbacks* callbacks)
+{
+    return callbacks && callbacks->cancelled && callbacks->cancelled(callbacks->user_data);
+}
+
+// Samples frames shrunk to EXPLODE_STREAM_SAMPLE_SIZE when `shrink` is set
+static void explode_samples_init(ExplodeStreamSamples* samples, int width, int height, bool shrink)
+{
+    *samples = (ExplodeStreamSamples) { .width = width, .height = height };
+
+    int side = width > height ? width : height;
+    if (!shrink || side <= EXPLODE_STREAM_SAMPLE_SIZE)
+        return;
+    samples->width = (int64_t)width * EXPLODE_STREAM_SAMPLE_SIZE / side;
+    samples->height = (int64_t)height * EXPLODE_STREAM_SAMPLE_SIZE / side;
+    if (samples->width < 1)
+        samples->width = 1;
+    if (samples->height < 1)
+        samples->height = 1;
+}
+
+// Adds a frame of the conversion's size, counted `count` times
+static bool explode_samples_add(ExplodeStreamSamples* samples, const void* frame, int width, int height,
+                                size_t count)
+{
+    uint32_t* sample = malloc((size_t)samples->width * samples->height * sizeof(uint32_t));
+    if (sample == NULL)
+        return false;
+    if (samples->width == width && samples->height == height) {
+        memcpy(sample, frame, (size_t)width * height * sizeof(uint32_t));
+    } else {
+        // Nearest pixels, the palette only needs their colors
+        const uint32_t* pixels = frame;
+        for (int y = 0; y < samples->height; ++y) {
+            const uint32_t* row = &pixels[(int64_t)y * height / samples->height * width];
+            for (int x = 0; x < samples->width; ++x)
+                sample[(size_t)y * samples->width + x] = row[(int64_t)x * width / samples->width];
+        }
+    }
+
+    samples->owned[samples->owned_count++] = sample;
+    for (size_t i = 0; i < count; ++i)
+        samples->frames[samples->frames_count++] = sample;
+    return true;
+}
+
+// Adds the overlay from the cache, or resized straight to the samples' size
+// when it's NULL
+static bool explode_samples_add_overlay(ExplodeStreamSamples* samples, const OverlayFrames* overlay)
+{
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i) {
+        void* sample = overlay ? overlay->frames[i] : NULL;
+        if (sample == NULL) {
+            sample = malloc((size_t)samples->width * samples->height * sizeof(uint32_t));
+            if (sample == NULL)
+                return false;
+            if (!overlay_resize_frame(i, sample, samples->width, samples->height, RESIZE_FILTER_CUBIC))
+                memset(sample, 0, (size_t)samples->width * samples->height * sizeof(uint32_t));
+            samples->owned[samples->owned_count++] = sample;
+        }
+        samples->frames[samples->frames_count++] = sample;
+    }
+    return true;
+}
+
+static GifStream* explode_samples_open_output(const ExplodeStreamSamples* samples, const char* output_file,
+                                              int width, int height)
+{
+    GifFrames frames = {
+        .frames = (void**)samples->frames,
+        .frames_count = samples->frames_count,
+        .width = samples->width,
+        .height = samples->height,
+    };
+    return gif_stream_open(output_file, width, height, frames);
+}
+
+static void explode_samples_free(ExplodeStreamSamples* samples)
+{
+    for (size_t i = 0; i < samples->owned_count; ++i)
+        free(samples->owned[i]);
+}
+
+// Pushes the overlay from the cache, or resized straight to the canvas when
+// it's NULL
+static bool explode_stream_push_overlay(GifStream* output, const OverlayFrames* overlay, int width, int height,
+                                        bool reverse, const ExplodeCallbacks* callbacks)
+{
+    size_t frame_size = (size_t)width * height * 4;
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i) {
+        if (explode_cancelled(callbacks))
+            return false;
+
+        size_t index = reverse ? OVERLAY_FRAMES_COUNT - 1 - i : i;
+        uint8_t* canvas = gif_stream_canvas(output);
+        if (overlay)
+            memcpy(canvas, overlay->frames[index], frame_size);
+        else if (!overlay_resize_frame(index, canvas, width, height, RESIZE_FILTER_CUBIC))
+            return false;
+        if (!gif_stream_push(output, GIF_FRAME_DELAY))
+            return false;
+    }
+    return true;
+}
+
+// Overlays of tiled conversions, and those that would be evicted as soon as
+// released, are resized straight to the canvas as they are pushed
+static OverlayFrames* explode_stream_overlay(int width, int height)
+{
+    if (explode_tiled(width, height) || !overlay_cache_keeps(width, height))
+        return NULL;
+
+    TRACE_SCOPE("overlay_cache_acquire");
+    return overlay_cache_acquire(width, height, RESIZE_FILTER_CUBIC);
+}
+
+// Opens the output, with the palette built from the first frames of `reader`
+static GifStream* explode_stream_open_output(const char* output_file, GifReader* reader,
+                                             const OverlayFrames* overlay)
+{
+    GifFramesInfo info = gif_reader_info(reader);
+    ExplodeStreamSamples samples;
+    explode_samples_init(&samples, info.width, info.height, overlay == NULL);
+
+    uint8_t* frame = malloc((size_t)info.width * info.height * 4);
+    bool ok = frame != NULL;
+    for (size_t i = 0; ok && i < EXPLODE_STREAM_PALETTE_FRAMES && i < info.count; ++i) {
+        ok = gif_reader_next(reader, frame, NULL)
+            && explode_samples_add(&samples, frame, info.width, info.height, 1);
+    }
+    free(frame);
+    ok = ok && explode_samples_add_overlay(&samples, overlay);
+
+    GifStream* output = ok ? explode_samples_open_output(&samples, output_file, info.width, info.height) : NULL;
+    explode_samples_free(&samples);
+
+    return output;
+}
+
+bool animation_to_explode_gif(const char* input_file, const char* output_file, bool reverse,
+                              const ExplodeCallbacks* callbacks)
+{
+    TRACE_SCOPE("explode_stream");
+
+    if (explode_cancelled(callbacks))
+        return false;
+
+    GifReader* reader = gif_reader_open(input_file);
+    if (reader == NULL)
+        return false;
+
+    GifFramesInfo info = gif_reader_info(reader);
+    if (info.count == 0) {
+        gif_reader_close(reader);
+        return false;
+    }
+
+    explode_report_stage(callbacks, EXPLODE_STAGE_OVERLAY);
+    OverlayFrames* overlay = explode_stream_overlay(info.width, info.height);
+
+    GifStream* output = explode_stream_open_output(output_file, reader, overlay);
+    if (output == NULL || !gif_reader_rewind(reader) || explode_cancelled(callbacks)) {
+        if (output)
+            gif_stream_discard(output);
+        if (overlay)
+            overlay_cache_release(overlay);
+        gif_reader_close(reader);
+        return false;
+    }
+
+    explode_report_stage(callbacks, EXPLODE_STAGE_FRAMES);
+    ExplodeLevels* levels = explode_levels_create(info.width, info.height);
+
+    size_t frame_size = (size_t)info.width * info.height * 4;
+    ExplodeStream stream = {
+        .reader = reader,
+        .frames_count = info.count,
+        .reverse = reverse,
+    };
+    bool slots_allocated = true;
+    for (size_t i = 0; i < EXPLODE_STREAM_SLOTS; ++i) {
+        stream.slots[i].pixels = malloc(frame_size);
+        slots_allocated = slots_allocated && stream.slots[i].pixels != NULL;
+    }
+    sem_init(&stream.free_slots, 0, EXPLODE_STREAM_SLOTS);
+    sem_init(&stream.decoded_slots, 0, 0);
+    atomic_init(&stream.stopped, false);
+
+    pthread_t decode_thread;
+    bool thread_started = slots_allocated
+        && pthread_create(&decode_thread, NULL, explode_stream_decode, &stream) == 0;
+    if (!slots_allocated)
+        fprintf(stderr, "ERROR: not enough memory to decode `%s`\n", input_file);
+    else if (!thread_started)
+        fprintf(stderr, "ERROR: failed to start the decoding thread\n");
+    bool ok = thread_started;
+
+    if (ok && reverse)
+        ok = explode_stream_push_overlay(output, overlay, info.width, info.height, reverse, callbacks);
+
+    for (size_t i = 0; ok && i < explode_stream_items_count(&stream); ++i) {
+        if (explode_cancelled(callbacks)) {
+            ok = false;
+            break;
+        }
+
+        sem_wait(&stream.decoded_slots);
+        ExplodeStreamSlot* slot = &stream.slots[i % EXPLODE_STREAM_SLOTS];
+        if (slot->failed) {
+            fprintf(stderr, "ERROR: could not decode file `%s`\n", input_file);
+            ok = false;
+            break;
+        }
+
+        uint8_t* canvas = gif_stream_canvas(output);
+        int delay = slot->delay;
+        if (slot->level == 0) {
+            memcpy(canvas, slot->pixels, frame_size);
+        } else {
+            explode_levels_apply(levels, slot->level, slot->pixels, canvas);
+            delay = GIF_FRAME_DELAY;
+        }
+        sem_post(&stream.free_slots);
+
+        ok = gif_stream_push(output, delay);
+    }
+
+    if (ok && !reverse)
+        ok = explode_stream_push_overlay(output, overlay, info.width, info.height, reverse, callbacks);
+    if (ok && explode_cancelled(callbacks))
+        ok = false;
+
+    if (ok)
+        ok = gif_stream_close(output);
+    else
+        gif_stream_discard(output);
+
+    // Wakes the decoding thread up if it's waiting for a slot
+    atomic_store_explicit(&stream.stopped, true, memory_order_relaxed);
+    sem_post(&stream.free_slots);
+    if (thread_started)
+        pthread_join(decode_thread, NULL);
+
+    sem_destroy(&stream.decoded_slots);
+    sem_destroy(&stream.free_slots);
+    for (size_t i = 0; i < EXPLODE_STREAM_SLOTS; ++i)
+        free(stream.slots[i].pixels);
+    explode_levels_destroy(levels);
+    if (overlay)
+        overlay_cache_release(overlay);
+    gif_reader_close(reader);
+
+    return ok;
+}
+
+bool image_to_explode_gif_streamed(Image image, const char* output_file, bool reverse,
+                                   const ExplodeCallbacks* callbacks)
+{
+    TRACE_SCOPE("explode_streamed");
+
+    if (explode_cancelled(callbacks))
+        return false;
+
+    uint64_t cache_key;
+    if (result_cache_fetch(image, reverse, output_file, &cache_key))
+        return true;
+
+    // The exploded frames only move the source's pixels around, so it's
+    // counted once per level
+    explode_report_stage(callbacks, EXPLODE_STAGE_OVERLAY);
+    OverlayFrames* overlay = explode_stream_overlay(image.width, image.height);
+    ExplodeStreamSamples samples;
+    explode_samples_init(&samples, image.width, image.height, overlay == NULL);
+    bool sampled = explode_samples_add(&samples, image.data, image.width, image.height, 1 + EXPLODE_LEVELS_COUNT)
+        && explode_samples_add_overlay(&samples, overlay);
+    GifStream* output = sampled
+        ? explode_samples_open_output(&samples, output_file, image.width, image.height)
+        : NULL;
+    explode_samples_free(&samples);
+
+    if (output == NULL || explode_cancelled(callbacks)) {
+        if (output)
+            gif_stream_discard(output);
+        if (overlay)
+            overlay_cache_release(overlay);
+        return false;
+    }
+
+    explode_report_stage(callbacks, EXPLODE_STAGE_FRAMES);
+    ExplodeLevels* levels = explode_levels_create(image.width, image.height);
+
+    // Same frames as `explode_animation_create`: the source, the levels and
+    // the overlay, with everything after the source backwards when reversed
+    memcpy(gif_stream_canvas(output), image.data, (size_t)image.width * image.height * 4);
+    bool ok = gif_stream_push(output, GIF_FRAME_DELAY);
+
+    if (ok && reverse)
+        ok = explode_stream_push_overlay(output, overlay, image.width, image.height, reverse, callbacks);
+
+    for (int i = 0; ok && i < EXPLODE_LEVELS_COUNT; ++i) {
+        if (explode_cancelled(callbacks)) {
+            ok = false;
+            break;
+        }
+
+        int level = reverse ? EXPLODE_LEVELS_COUNT - i : i + 1;
+        explode_levels_apply(levels, level, image.data, gif_stream_canvas(output));
+        ok = gif_stream_push(output, GIF_FRAME_DELAY);
+    }
+
+    if (ok && !reverse)
+        ok = explode_stream_push_overlay(output, overlay, image.width, image.height, reverse, callbacks);
+    if (ok && explode_cancelled(callbacks))
+        ok = false;
+
+    if (ok)
+        ok = gif_stream_close(output);
+    else
+        gif_stream_discard(output);
+
+    explode_levels_destroy(levels);
+    if (overlay)
+        overlay_cache_release(overlay);
+
+    if (ok)
+        result_cache_store(cache_key, output_file);
+    return ok;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "explode.h"
+
+// Explodes an animated GIF or APNG on top of its own frames: the source
+// animation plays once, keeps playing while it explodes, and the overlay
+// follows. Reversed, the overlay comes first and the explosion plays
+// backwards into the source animation.
+//
+// Frames are decoded on a dedicated thread while the previous ones are
+// exploded and encoded, so memory is bounded by a few frames whatever the
+// length of the animation. `callbacks` may be NULL. Returns false if it failed
+// or was cancelled, in which case no output is left behind.
+bool animation_to_explode_gif(const char* input_file, const char* output_file, bool reverse,
+                              const ExplodeCallbacks* callbacks);
+
+// Same animation as `explode_animation_create`, saved as it's produced
+// instead of kept in memory: each frame is drawn to one of the few canvases
+// of the output stream, and encoded while the next ones are drawn, so memory
+// is bounded by a few frames whatever the size of the image. Images big
+// enough to be tiled (see `explode_tiled`) are produced in bands of rows. The
+// overlay comes from its cache when kept there, and is otherwise resized
+// straight to the canvases. The GIF palette is built from the source, weighted
+// by the explode levels, and the overlay. Animations in the result cache are
+// copied from it instead. `callbacks` may be NULL. Returns false if it failed
+// or was cancelled, in which case no output is left behind.
+bool image_to_explode_gif_streamed(Image image, const char* output_file, bool reverse,
+                                   const ExplodeCallbacks* callbacks);
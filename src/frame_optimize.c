@@ -0,0 +1,338 @@
+#include "frame_optimize.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+typedef struct {
+    const uint8_t* pixels;
+    const uint8_t* previous;
+    int width;
+    int height;
+    FrameOptimizeOptions options;
+
+    // Pixels that differ from the previous frame
+    FrameRect changed;
+    // Pixels that have to be cleared before drawing this frame
+    FrameRect clear;
+} FrameDiffTask;
+
+static inline bool frame_rect_empty(FrameRect rect)
+{
+    return rect.width <= 0 || rect.height <= 0;
+}
+
+static FrameRect frame_rect_union(FrameRect a, FrameRect b)
+{
+    if (frame_rect_empty(a))
+        return b;
+    if (frame_rect_empty(b))
+        return a;
+
+    int x0 = a.x < b.x ? a.x : b.x;
+    int y0 = a.y < b.y ? a.y : b.y;
+    int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (FrameRect) { x0, y0, x1 - x0, y1 - y0 };
+}
+
+static inline bool frame_rect_contains(FrameRect rect, int x, int y)
+{
+    return x >= rect.x && x < rect.x + rect.width && y >= rect.y && y < rect.y + rect.height;
+}
+
+// Grows the rectangle [x0, x1] x [y0, y1] stored in `bounds` to contain (x, y)
+static inline void frame_bounds_add(int* bounds, int x, int y)
+{
+    if (x < bounds[0])
+        bounds[0] = x;
+    if (y < bounds[1])
+        bounds[1] = y;
+    if (x > bounds[2])
+        bounds[2] = x;
+    if (y > bounds[3])
+        bounds[3] = y;
+}
+
+static inline FrameRect frame_bounds_rect(const int* bounds)
+{
+    if (bounds[2] < bounds[0])
+        return (FrameRect) { 0 };
+    return (FrameRect) { bounds[0], bounds[1], bounds[2] - bounds[0] + 1, bounds[3] - bounds[1] + 1 };
+}
+
+static inline bool frame_pixel_empty(const uint8_t* pixel, uint8_t alpha_threshold)
+{
+    return pixel[3] < (alpha_threshold ? alpha_threshold : 1);
+}
+
+static inline bool frame_pixel_opaque(const uint8_t* pixel, uint8_t alpha_threshold)
+{
+    return pixel[3] >= (alpha_threshold ? alpha_threshold : 255);
+}
+
+static void frame_diff_task(void* arg)
+{
+    FrameDiffTask* task = arg;
+    uint8_t threshold = task->options.alpha_threshold;
+    size_t stride = (size_t)task->width * 4;
+
+    int changed[4] = { task->width, task->height, -1, -1 };
+    int clear[4] = { task->width, task->height, -1, -1 };
+
+    for (int y = 0; y < task->height; ++y) {
+        const uint8_t* row = &task->pixels[y * stride];
+        const uint8_t* previous_row = &task->previous[y * stride];
+        if (memcmp(row, previous_row, stride) == 0)
+            continue;
+
+        for (int x = 0; x < task->width; ++x) {
+            const uint8_t* pixel = &row[x * 4];
+            const uint8_t* previous = &previous_row[x * 4];
+            bool empty = frame_pixel_empty(pixel, threshold);
+            bool previous_empty = frame_pixel_empty(previous, threshold);
+            if ((empty && previous_empty) || memcmp(pixel, previous, 4) == 0)
+                continue;
+
+            frame_bounds_add(changed, x, y);
+            // Drawing over only works if the new pixel hides the old one
+            if (!frame_pixel_opaque(pixel, threshold) && !previous_empty)
+                frame_bounds_add(clear, x, y);
+        }
+    }
+
+    task->changed = frame_bounds_rect(changed);
+    task->clear = frame_bounds_rect(clear);
+}
+
+static FrameRect frame_visible_bounds(const uint8_t* pixels, int width, int height, uint8_t alpha_threshold)
+{
+    int bounds[4] = { width, height, -1, -1 };
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            if (!frame_pixel_empty(&pixels[((size_t)y * width + x) * 4], alpha_threshold))
+                frame_bounds_add(bounds, x, y);
+        }
+    }
+    return frame_bounds_rect(bounds);
+}
+
+// Appends `frame`, whose diff against the last planned frame is `diff`, to
+// the plan. Returns false if nothing changed and it was merged into the last
+// frame instead.
+static bool frame_plan_merge(OptimizedFrame* last, const FrameDiffTask* diff, OptimizedFrame* frame)
+{
+    if (frame_rect_empty(diff->changed)) {
+        last->delay += frame->delay;
+        return false;
+    }
+
+    frame->rect = diff->changed;
+    if (!frame_rect_empty(diff->clear)) {
+        // The pixels written by the previous frame stay unchanged, so it
+        // can be grown to cover the area that has to be cleared.
+        last->rect = frame_rect_union(last->rect, diff->clear);
+        last->dispose = FRAME_DISPOSE_BACKGROUND;
+        frame->redraw = last->rect;
+        frame->rect = frame_rect_union(frame->rect, frame->redraw);
+    }
+    return true;
+}
+
+static void frame_plan_clear_on_loop(OptimizedFrame* last, int width, int height, FrameOptimizeOptions options)
+{
+    FrameRect visible = frame_visible_bounds(last->pixels, width, height, options.alpha_threshold);
+    if (!frame_rect_empty(visible)) {
+        last->rect = frame_rect_union(last->rect, visible);
+        last->dispose = FRAME_DISPOSE_BACKGROUND;
+    }
+}
+
+FramePlan frame_optimize(const uint8_t* const* frames, size_t frames_count, int width, int height,
+                         int delay, FrameOptimizeOptions options)
+{
+    TRACE_SCOPE("frame_optimize");
+
+    FramePlan plan = {
+        .frames = calloc(frames_count ? frames_count : 1, sizeof(*plan.frames)),
+        .width = width,
+        .height = height,
+    };
+    if (frames_count == 0)
+        return plan;
+
+    FrameDiffTask* tasks = calloc(frames_count, sizeof(*tasks));
+    ThreadPool* pool = thread_pool_global();
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    for (size_t i = 1; i < frames_count; ++i) {
+        tasks[i] = (FrameDiffTask) {
+            .pixels = frames[i],
+            .previous = frames[i - 1],
+            .width = width,
+            .height = height,
+            .options = options,
+        };
+        thread_pool_group_submit(pool, &group, frame_diff_task, &tasks[i]);
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+
+    plan.frames[plan.frames_count++] = (OptimizedFrame) {
+        .pixels = frames[0],
+        .rect = { 0, 0, width, height },
+        .delay = delay,
+    };
+
+    for (size_t i = 1; i < frames_count; ++i) {
+        OptimizedFrame frame = {
+            .pixels = frames[i],
+            .previous = frames[i - 1],
+            .delay = delay,
+        };
+        if (frame_plan_merge(&plan.frames[plan.frames_count - 1], &tasks[i], &frame))
+            plan.frames[plan.frames_count++] = frame;
+    }
+
+    if (options.clear_on_loop)
+        frame_plan_clear_on_loop(&plan.frames[plan.frames_count - 1], width, height, options);
+
+    free(tasks);
+
+    return plan;
+}
+
+void frame_plan_free(FramePlan* plan)
+{
+    free(plan->frames);
+    plan->frames = NULL;
+    plan->frames_count = 0;
+}
+
+struct FrameStream {
+    int width;
+    int height;
+    FrameOptimizeOptions options;
+    FrameSink sink;
+
+    uint8_t* canvases[FRAME_STREAM_CANVASES];
+    size_t canvases_count;
+    // Distinct frames pushed so far, the last one is still pending
+    size_t frames_count;
+    OptimizedFrame pending;
+};
+
+FrameStream* frame_stream_create(int width, int height, FrameOptimizeOptions options, FrameSink sink)
+{
+    FrameStream* stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        return NULL;
+    stream->width = width;
+    stream->height = height;
+    stream->options = options;
+    stream->sink = sink;
+
+    size_t canvas_size = (size_t)width * height * 4;
+    stream->canvases_count = FRAME_STREAM_CANVASES;
+    while (stream->canvases_count > 3 && stream->canvases_count * canvas_size > FRAME_STREAM_CANVASES_BYTES)
+        stream->canvases_count--;
+    for (size_t i = 0; i < stream->canvases_count; ++i) {
+        stream->canvases[i] = malloc(canvas_size);
+        if (stream->canvases[i] == NULL) {
+            frame_stream_destroy(stream);
+            return NULL;
+        }
+    }
+    return stream;
+}
+
+uint8_t* frame_stream_canvas(FrameStream* stream)
+{
+    // The canvas held frame `frames_count - canvases_count`, which the frame
+    // after it also reads as its previous one
+    size_t frames_count = stream->frames_count;
+    size_t canvases_count = stream->canvases_count;
+    if (frames_count >= canvases_count)
+        stream->sink.wait(stream->sink.encoder, frames_count - canvases_count + 2);
+    return stream->canvases[frames_count % canvases_count];
+}
+
+void frame_stream_push(FrameStream* stream, int delay)
+{
+    TRACE_SCOPE("frame_optimize");
+
+    size_t frames_count = stream->frames_count;
+    OptimizedFrame frame = {
+        .pixels = stream->canvases[frames_count % stream->canvases_count],
+        .delay = delay,
+    };
+
+    if (frames_count == 0) {
+        frame.rect = (FrameRect) { 0, 0, stream->width, stream->height };
+        stream->pending = frame;
+        stream->frames_count++;
+        return;
+    }
+
+    frame.previous = stream->canvases[(frames_count - 1) % stream->canvases_count];
+    FrameDiffTask diff = {
+        .pixels = frame.pixels,
+        .previous = frame.previous,
+        .width = stream->width,
+        .height = stream->height,
+        .options = stream->options,
+    };
+    frame_diff_task(&diff);
+
+    // The pending frame may still grow to clear what this one needs cleared,
+    // so it's only handed to the sink now
+    if (!frame_plan_merge(&stream->pending, &diff, &frame))
+        return;
+    stream->sink.add_frame(stream->sink.encoder, &stream->pending);
+    stream->pending = frame;
+    stream->frames_count++;
+}
+
+size_t frame_stream_finish(FrameStream* stream)
+{
+    if (stream->frames_count == 0)
+        return 0;
+
+    if (stream->options.clear_on_loop)
+        frame_plan_clear_on_loop(&stream->pending, stream->width, stream->height, stream->options);
+    stream->sink.add_frame(stream->sink.encoder, &stream->pending);
+    return stream->frames_count;
+}
+
+void frame_stream_destroy(FrameStream* stream)
+{
+    if (stream == NULL)
+        return;
+    for (size_t i = 0; i < stream->canvases_count; ++i)
+        free(stream->canvases[i]);
+    free(stream);
+}
+
+void frame_optimized_row(const OptimizedFrame* frame, int canvas_width, int row, uint8_t* out)
+{
+    int y = frame->rect.y + row;
+    size_t offset = ((size_t)y * canvas_width + frame->rect.x) * 4;
+    const uint8_t* pixels = &frame->pixels[offset];
+
+    if (frame->previous == NULL) {
+        memcpy(out, pixels, (size_t)frame->rect.width * 4);
+        return;
+    }
+
+    const uint8_t* previous = &frame->previous[offset];
+    for (int x = 0; x < frame->rect.width; ++x) {
+        const uint8_t* pixel = &pixels[x * 4];
+        bool unchanged = memcmp(pixel, &previous[x * 4], 4) == 0 || (pixel[3] == 0 && previous[x * 4 + 3] == 0);
+        if (unchanged && !frame_rect_contains(frame->redraw, frame->rect.x + x, y))
+            memset(&out[x * 4], 0, 4);
+        else
+            memcpy(&out[x * 4], pixel, 4);
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Turns a sequence of full-canvas RGBA frames into the smallest frames an
+// animated GIF or APNG needs: only the rectangle that changed is stored, with
+// unchanged pixels made transparent, and identical consecutive frames are
+// merged into a longer delay.
+//
+// Optimized frames are drawn over the previous one. When a pixel has to
+// become (more) transparent, which drawing over can't do, the previous frame
+// is disposed to transparent and the next frame redraws that area in full.
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} FrameRect;
+
+typedef enum {
+    FRAME_DISPOSE_NONE,
+    // Clear the frame's rectangle to transparent before drawing the next one
+    FRAME_DISPOSE_BACKGROUND,
+} FrameDispose;
+
+typedef struct {
+    // Full-canvas pixels of this frame and of the one drawn before it (NULL
+    // for the first frame)
+    const uint8_t* pixels;
+    const uint8_t* previous;
+    FrameRect rect;
+    // Part of `rect` cleared by the previous frame's disposal, which has to
+    // be written as is. Empty when nothing was cleared.
+    FrameRect redraw;
+    // In hundredths of a second
+    int delay;
+    FrameDispose dispose;
+} OptimizedFrame;
+
+typedef struct {
+    OptimizedFrame* frames;
+    size_t frames_count;
+    int width;
+    int height;
+} FramePlan;
+
+typedef struct {
+    // Pixels less opaque than this are fully transparent in the output, and
+    // others fully opaque (GIF). 0 keeps the full alpha channel (APNG).
+    uint8_t alpha_threshold;
+    // Leave an empty canvas after the last frame, for decoders that don't
+    // clear it when the animation loops.
+    bool clear_on_loop;
+} FrameOptimizeOptions;
+
+// `frames` must stay valid for as long as the plan is used.
+FramePlan frame_optimize(const uint8_t* const* frames, size_t frames_count, int width, int height,
+                         int delay, FrameOptimizeOptions options);
+void frame_plan_free(FramePlan* plan);
+
+// Writes row `row` of the frame's rectangle to `out`, `rect.width` RGBA
+// pixels, with unchanged pixels set to transparent black.
+void frame_optimized_row(const OptimizedFrame* frame, int canvas_width, int row, uint8_t* out);
+
+// Receives the frames planned by a `FrameStream`, e.g. an encoder
+typedef struct {
+    // The frame's pixels stay valid until `wait` says it was written
+    void (*add_frame)(void* encoder, const OptimizedFrame* frame);
+    // Blocks until the first `frames_count` frames added are written
+    void (*wait)(void* encoder, size_t frames_count);
+    void* encoder;
+} FrameSink;
+
+// Canvases kept by a `FrameStream`. Frames read the previous one, so this
+// allows up to 4 frames to be encoded while the next one is produced.
+#define FRAME_STREAM_CANVASES 6
+// Streams of frames so big that their canvases would take more than this
+// keep fewer of them, down to 3, and encode fewer frames ahead
+#define FRAME_STREAM_CANVASES_BYTES ((size_t)256 << 20)
+
+// Incremental `frame_optimize`, for animations produced one frame at a time
+// that are too long to keep in memory. Each frame is drawn to one of a few
+// canvases and planned against the previous one, then handed to the sink one
+// frame late, once it's known whether it has to be disposed.
+typedef struct FrameStream FrameStream;
+
+// Returns NULL if its canvases can't be allocated
+FrameStream* frame_stream_create(int width, int height, FrameOptimizeOptions options, FrameSink sink);
+// Canvas to draw the next frame to, `width * height` RGBA pixels. Waits for
+// the sink to be done with the frame that was drawn to it before.
+uint8_t* frame_stream_canvas(FrameStream* stream);
+// Plans the frame drawn to the canvas, shown for `delay` hundredths of a
+// second
+void frame_stream_push(FrameStream* stream, int delay);
+// Hands the last frame to the sink. Returns the amount of frames handed over.
+size_t frame_stream_finish(FrameStream* stream);
+// The sink must be done with every frame
+void frame_stream_destroy(FrameStream* stream);
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "generation.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "explode_stream.h"
+#include "gif_load.h"
+#include "image.h"
+#include "resize.h"
+#include "result_cache.h"
+#include "util/spsc_queue.h"
+#include "util/trace.h"
+
+// A job pushes at most one event per stage, plus the preview and the result
+#define GENERATION_QUEUE_CAPACITY 16
+
+struct Generation {
+    char* input_path;
+    char* output_path;
+    bool reverse;
+
+    pthread_t thread;
+    bool thread_started;
+    // Worker to caller
+    SpscQueue events;
+    atomic_bool cancelled;
+    atomic_bool finished;
+
+    Image image;
+    ExplodeAnimation* animation;
+    GenerationFrames saved_frames;
+};
+
+static void generation_push(Generation* generation, GenerationEventKind kind, GenerationStage stage)
+{
+    GenerationEvent event = { .kind = kind, .stage = stage };
+    if (!spsc_queue_push(&generation->events, &event))
+        fprintf(stderr, "ERROR: generation event queue is full\n");
+}
+
+static void generation_explode_stage(void* user_data, ExplodeStage stage)
+{
+    generation_push(user_data, GENERATION_EVENT_STAGE,
+                    stage == EXPLODE_STAGE_OVERLAY ? GENERATION_STAGE_OVERLAY : GENERATION_STAGE_FRAMES);
+}
+
+static bool generation_cancelled(void* user_data)
+{
+    Generation* generation = user_data;
+    return atomic_load_explicit(&generation->cancelled, memory_order_relaxed);
+}
+
+// Decodes the saved animation for the caller to show, scaled down to fit the
+// preview, so its thread only has to upload the frames
+static void generation_read_back(Generation* generation)
+{
+    TRACE_SCOPE("generation_read_back");
+
+    GifReader* reader = gif_reader_open(generation->output_path);
+    if (reader == NULL)
+        return;
+
+    GifFramesInfo info = gif_reader_info(reader);
+    GenerationFrames* saved = &generation->saved_frames;
+    saved->frames = calloc(info.count, sizeof(*saved->frames));
+    saved->ends = calloc(info.count, sizeof(*saved->ends));
+
+    int side = info.width > info.height ? info.width : info.height;
+    saved->width = info.width;
+    saved->height = info.height;
+    if (side > GENERATION_PREVIEW_MAX_SIZE) {
+        saved->width = (int64_t)info.width * GENERATION_PREVIEW_MAX_SIZE / side;
+        saved->height = (int64_t)info.height * GENERATION_PREVIEW_MAX_SIZE / side;
+        saved->width = saved->width > 0 ? saved->width : 1;
+        saved->height = saved->height > 0 ? saved->height : 1;
+    }
+
+    size_t frame_size = (size_t)saved->width * saved->height * 4;
+    void* pixels = side > GENERATION_PREVIEW_MAX_SIZE ? malloc((size_t)info.width * info.height * 4) : NULL;
+    bool ok = saved->frames != NULL && saved->ends != NULL && (side <= GENERATION_PREVIEW_MAX_SIZE || pixels != NULL);
+    float end = 0;
+    while (ok && saved->count < info.count && !generation_cancelled(generation)) {
+        void* frame = malloc(frame_size);
+        int delay;
+        if (frame == NULL || !gif_reader_next(reader, pixels ? pixels : frame, &delay)) {
+            free(frame);
+            break;
+        }
+        if (pixels != NULL
+            && !image_resize(pixels, info.width, info.height, frame, saved->width, saved->height,
+                             RESIZE_FILTER_CUBIC)) {
+            free(frame);
+            break;
+        }
+
+        end += delay / 100.f;
+        saved->frames[saved->count] = frame;
+        saved->ends[saved->count++] = end;
+    }
+
+    free(pixels);
+    gif_reader_close(reader);
+}
+
+static void generation_saved_frames_free(GenerationFrames* saved)
+{
+    for (size_t i = 0; i < saved->count; ++i)
+        free(saved->frames[i]);
+    free(saved->frames);
+    free(saved->ends);
+    *saved = (GenerationFrames) { 0 };
+}
+
+static void* generation_thread(void* arg)
+{
+    Generation* generation = arg;
+    GenerationEventKind result = GENERATION_EVENT_FAILED;
+
+    ExplodeCallbacks callbacks = {
+        .stage = generation_explode_stage,
+        .cancelled = generation_cancelled,
+        .user_data = generation,
+    };
+
+    generation_push(generation, GENERATION_EVENT_STAGE, GENERATION_STAGE_LOAD);
+
+    // Animations are too long to keep every frame, they are exploded and
+    // saved as they are decoded, without a preview
+    if (gif_file_is_animated(generation->input_path)) {
+        if (animation_to_explode_gif(generation->input_path, generation->output_path, generation->reverse, &callbacks))
+            result = GENERATION_EVENT_DONE;
+        goto done;
+    }
+
+    generation->image = load_image(generation->input_path);
+    if (generation->image.data == NULL) {
+        fprintf(stderr, "ERROR: failed to load file `%s`: %s\n", generation->input_path, strerror(errno));
+        goto done;
+    }
+
+    // So are images too big to keep every frame of
+    if (explode_tiled(generation->image.width, generation->image.height)) {
+        if (image_to_explode_gif_streamed(generation->image, generation->output_path, generation->reverse, &callbacks))
+            result = GENERATION_EVENT_DONE;
+        goto done;
+    }
+
+    // Saved before, so there's nothing to preview: the caller reads it back
+    uint64_t cache_key;
+    if (result_cache_fetch(generation->image, generation->reverse, generation->output_path, &cache_key)) {
+        result = GENERATION_EVENT_DONE;
+        goto done;
+    }
+
+    generation->animation = explode_animation_create(generation->image, generation->reverse, &callbacks);
+    if (generation->animation == NULL)
+        goto done;
+    // The push publishes the animation to the caller
+    generation_push(generation, GENERATION_EVENT_PREVIEW, GENERATION_STAGE_FRAMES);
+
+    if (generation_cancelled(generation))
+        goto done;
+
+    generation_push(generation, GENERATION_EVENT_STAGE, GENERATION_STAGE_ENCODE);
+    if (explode_animation_save(generation->animation, generation->output_path, &callbacks)) {
+        result_cache_store(cache_key, generation->output_path);
+        result = GENERATION_EVENT_DONE;
+    }
+
+done:
+    if (result == GENERATION_EVENT_DONE && generation->animation == NULL)
+        generation_read_back(generation);
+    generation_push(generation, result, GENERATION_STAGE_ENCODE);
+    atomic_store_explicit(&generation->finished, true, memory_order_release);
+    return NULL;
+}
+
+Generation* generation_start(const char* input_path, const char* output_path, bool reverse)
+{
+    Generation* generation = calloc(1, sizeof(*generation));
+    if (generation == NULL)
+        return NULL;
+    generation->input_path = strdup(input_path);
+    generation->output_path = strdup(output_path);
+    if (generation->input_path == NULL || generation->output_path == NULL) {
+        free(generation->output_path);
+        free(generation->input_path);
+        free(generation);
+        return NULL;
+    }
+    generation->reverse = reverse;
+    spsc_queue_init(&generation->events, sizeof(GenerationEvent), GENERATION_QUEUE_CAPACITY);
+    atomic_init(&generation->cancelled, false);
+    atomic_init(&generation->finished, false);
+
+    generation->thread_started = pthread_create(&generation->thread, NULL, generation_thread, generation) == 0;
+    if (!generation->thread_started) {
+        fprintf(stderr, "ERROR: failed to start the generation thread\n");
+        // Runs it in place, so the caller still gets its events
+        generation_thread(generation);
+    }
+
+    return generation;
+}
+
+bool generation_poll(Generation* generation, GenerationEvent* event)
+{
+    return spsc_queue_pop(&generation->events, event);
+}
+
+const ExplodeAnimation* generation_animation(const Generation* generation)
+{
+    return generation->animation;
+}
+
+const GenerationFrames* generation_saved_frames(const Generation* generation)
+{
+    return &generation->saved_frames;
+}
+
+void generation_cancel(Generation* generation)
+{
+    atomic_store_explicit(&generation->cancelled, true, memory_order_relaxed);
+}
+
+bool generation_finished(const Generation* generation)
+{
+    return atomic_load_explicit(&generation->finished, memory_order_acquire);
+}
+
+void generation_destroy(Generation* generation)
+{
+    if (generation == NULL)
+        return;
+
+    generation_cancel(generation);
+    if (generation->thread_started)
+        pthread_join(generation->thread, NULL);
+
+    explode_animation_destroy(generation->animation);
+    generation_saved_frames_free(&generation->saved_frames);
+    UnloadImage(generation->image);
+    spsc_queue_destroy(&generation->events);
+    free(generation->output_path);
+    free(generation->input_path);
+    free(generation);
+}
+
+const char* generation_stage_name(GenerationStage stage)
+{
+    switch (stage) {
+    case GENERATION_STAGE_LOAD:
+        return "Loading";
+    case GENERATION_STAGE_OVERLAY:
+        return "Preparing overlay";
+    case GENERATION_STAGE_FRAMES:
+        return "Exploding";
+    case GENERATION_STAGE_ENCODE:
+        return "Saving";
+    default:
+        return "";
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "explode.h"
+
+typedef enum {
+    GENERATION_STAGE_LOAD,
+    GENERATION_STAGE_OVERLAY,
+    GENERATION_STAGE_FRAMES,
+    GENERATION_STAGE_ENCODE,
+    COUNT_GENERATION_STAGES,
+} GenerationStage;
+
+typedef enum {
+    // A stage started
+    GENERATION_EVENT_STAGE,
+    // The frames are ready, see `generation_animation`. Animated and tiled
+    // inputs are saved as they are exploded, and cached ones are copied, so
+    // they have no preview.
+    GENERATION_EVENT_PREVIEW,
+    // The animation was saved, and read back if it had no preview (see
+    // `generation_saved_frames`). No event follows it.
+    GENERATION_EVENT_DONE,
+    // Loading or saving failed, or the generation was cancelled. No event
+    // follows it.
+    GENERATION_EVENT_FAILED,
+} GenerationEventKind;
+
+typedef struct {
+    GenerationEventKind kind;
+    GenerationStage stage;
+} GenerationEvent;
+
+// Largest side of the frames read back from a saved animation, as tiled
+// outputs can be much bigger than the window
+#define GENERATION_PREVIEW_MAX_SIZE 1024
+
+// Animation read back from the saved file, for the inputs without a preview
+typedef struct {
+    // `count` frames of `width` x `height` RGBA pixels
+    void** frames;
+    // Time at which each frame stops being shown, in seconds
+    float* ends;
+    size_t count;
+    int width;
+    int height;
+} GenerationFrames;
+
+// Loads, explodes and saves an image on a dedicated thread, reporting its
+// progress to the thread that started it.
+typedef struct Generation Generation;
+
+// The paths are copied. Returns NULL if the generation can't be allocated.
+Generation* generation_start(const char* input_path, const char* output_path, bool reverse);
+// Returns false when there are no pending events. Must be called by the
+// thread that started the generation.
+bool generation_poll(Generation* generation, GenerationEvent* event);
+// Valid once GENERATION_EVENT_PREVIEW has been polled, until the generation is
+// destroyed. The worker only reads it afterwards.
+const ExplodeAnimation* generation_animation(const Generation* generation);
+// Valid once GENERATION_EVENT_DONE has been polled, until the generation is
+// destroyed. Empty when there was a preview or the file couldn't be read.
+const GenerationFrames* generation_saved_frames(const Generation* generation);
+// Asks the worker to stop at the next stage boundary
+void generation_cancel(Generation* generation);
+// True once the worker returned and every resource it held can be freed
+// without blocking
+bool generation_finished(const Generation* generation);
+// Cancels the generation if it's still running, and waits for it. NULL is
+// ignored.
+void generation_destroy(Generation* generation);
+
+const char* generation_stage_name(GenerationStage stage);
@@ -0,0 +1,443 @@
+#include "gif_decoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode_limits.h"
+
+#define GIF_LZW_MAX_CODES 4096
+
+#define GIF_DISPOSE_BACKGROUND 2
+#define GIF_DISPOSE_PREVIOUS 3
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} GifDecoderRect;
+
+struct GifDecoder {
+    const uint8_t* data;
+    size_t size;
+    // Next block to read
+    size_t position;
+
+    int width;
+    int height;
+    uint8_t global_palette[256][3];
+    int global_colors;
+
+    // Composited RGBA frames: the current one, and the one saved for frames
+    // disposed to previous
+    uint8_t* canvas;
+    uint8_t* saved;
+    // Color indices of the frame being decoded
+    uint8_t* indices;
+
+    // Disposal of the frame drawn last, applied before drawing the next one
+    int dispose;
+    GifDecoderRect dispose_rect;
+
+    uint16_t prefix[GIF_LZW_MAX_CODES];
+    uint8_t suffix[GIF_LZW_MAX_CODES];
+    uint8_t first[GIF_LZW_MAX_CODES];
+    uint16_t length[GIF_LZW_MAX_CODES];
+};
+
+// LSB-first reader of the bits packed in a sequence of data sub-blocks
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+    size_t block_left;
+    bool ended;
+    uint32_t bits;
+    int bits_count;
+} GifBitReader;
+
+static inline uint16_t gif_read_u16(const uint8_t* data)
+{
+    return data[0] | data[1] << 8;
+}
+
+static int gif_bits_read_byte(GifBitReader* reader)
+{
+    while (reader->block_left == 0) {
+        if (reader->ended || reader->position >= reader->size) {
+            reader->ended = true;
+            return -1;
+        }
+        reader->block_left = reader->data[reader->position++];
+        if (reader->block_left == 0) {
+            reader->ended = true;
+            return -1;
+        }
+    }
+
+    if (reader->position >= reader->size) {
+        reader->ended = true;
+        return -1;
+    }
+    reader->block_left--;
+    return reader->data[reader->position++];
+}
+
+static int gif_bits_read(GifBitReader* reader, int code_size)
+{
+    while (reader->bits_count < code_size) {
+        int byte = gif_bits_read_byte(reader);
+        if (byte < 0)
+            return -1;
+        reader->bits |= (uint32_t)byte << reader->bits_count;
+        reader->bits_count += 8;
+    }
+
+    int code = reader->bits & ((1u << code_size) - 1);
+    reader->bits >>= code_size;
+    reader->bits_count -= code_size;
+    return code;
+}
+
+// Skips data sub-blocks starting at `position`, returns the position after
+// the terminator
+static size_t gif_skip_sub_blocks(const uint8_t* data, size_t size, size_t position)
+{
+    while (position < size) {
+        size_t block_size = data[position++];
+        if (block_size == 0)
+            break;
+        position += block_size;
+    }
+    return position < size ? position : size;
+}
+
+// Decompresses up to `out_size` color indices. Missing ones are left as is.
+static void gif_lzw_decode(GifDecoder* decoder, GifBitReader* reader, int min_code_size,
+                           uint8_t* out, size_t out_size)
+{
+    int clear = 1 << min_code_size;
+    int end = clear + 1;
+    for (int i = 0; i < clear; ++i) {
+        decoder->prefix[i] = 0xFFFF;
+        decoder->suffix[i] = i;
+        decoder->first[i] = i;
+        decoder->length[i] = 1;
+    }
+
+    int code_size = min_code_size + 1;
+    int next = clear + 2;
+    int previous = -1;
+    size_t written = 0;
+
+    while (written < out_size) {
+        int code = gif_bits_read(reader, code_size);
+        if (code < 0 || code == end)
+            break;
+
+        if (code == clear) {
+            code_size = min_code_size + 1;
+            next = clear + 2;
+            previous = -1;
+            continue;
+        }
+
+        if (previous < 0) {
+            if (code >= clear)
+                break;
+            out[written++] = code;
+            previous = code;
+            continue;
+        }
+
+        if (code > next || (code == next && next == GIF_LZW_MAX_CODES))
+            break;
+
+        if (next < GIF_LZW_MAX_CODES) {
+            // The new entry is the previous string followed by the first
+            // byte of this one, which is its own first byte when it is the
+            // entry being added
+            decoder->prefix[next] = previous;
+            decoder->suffix[next] = code < next ? decoder->first[code] : decoder->first[previous];
+            decoder->first[next] = decoder->first[previous];
+            decoder->length[next] = decoder->length[previous] + 1;
+            next++;
+            if (next == 1 << code_size && code_size < 12)
+                code_size++;
+        }
+
+        // Strings are stored backwards, from their last byte
+        size_t length = decoder->length[code];
+        size_t end_position = written + length;
+        int string = code;
+        for (size_t i = end_position; i > written; --i) {
+            if (i - 1 < out_size)
+                out[i - 1] = decoder->suffix[string];
+            string = decoder->prefix[string];
+        }
+        written = end_position < out_size ? end_position : out_size;
+        previous = code;
+    }
+}
+
+GifDecoder* gif_decoder_open(const uint8_t* data, size_t size, bool* failed)
+{
+    *failed = false;
+
+    if (size < 13 || (memcmp(data, "GIF87a", 6) != 0 && memcmp(data, "GIF89a", 6) != 0))
+        return NULL;
+
+    int width = gif_read_u16(&data[6]);
+    int height = gif_read_u16(&data[8]);
+    uint8_t flags = data[10];
+    if (width == 0 || height == 0)
+        return NULL;
+    if ((size_t)width * height > DECODE_MAX_PIXELS) {
+        *failed = true;
+        return NULL;
+    }
+
+    GifDecoder* decoder = calloc(1, sizeof(*decoder));
+    if (decoder == NULL) {
+        *failed = true;
+        return NULL;
+    }
+    decoder->data = data;
+    decoder->size = size;
+    decoder->width = width;
+    decoder->height = height;
+    decoder->position = 13;
+
+    if (flags & 0x80) {
+        decoder->global_colors = 2 << (flags & 0x07);
+        size_t table_size = (size_t)decoder->global_colors * 3;
+        if (decoder->position + table_size > size) {
+            free(decoder);
+            return NULL;
+        }
+        memcpy(decoder->global_palette, &data[decoder->position], table_size);
+        decoder->position += table_size;
+    }
+
+    size_t canvas_size = (size_t)width * height * 4;
+    decoder->canvas = calloc(canvas_size, 1);
+    decoder->indices = malloc((size_t)width * height);
+    if (decoder->canvas == NULL || decoder->indices == NULL) {
+        gif_decoder_close(decoder);
+        *failed = true;
+        return NULL;
+    }
+
+    return decoder;
+}
+
+int gif_decoder_width(const GifDecoder* decoder)
+{
+    return decoder->width;
+}
+
+int gif_decoder_height(const GifDecoder* decoder)
+{
+    return decoder->height;
+}
+
+size_t gif_decoder_frames_count(const GifDecoder* decoder)
+{
+    const uint8_t* data = decoder->data;
+    size_t size = decoder->size;
+    size_t position = decoder->position;
+    size_t count = 0;
+
+    while (position < size) {
+        uint8_t block = data[position++];
+        if (block == 0x21) {
+            position = gif_skip_sub_blocks(data, size, position + 1);
+        } else if (block == 0x2C) {
+            if (position + 9 > size)
+                break;
+            uint8_t flags = data[position + 8];
+            position += 9;
+            if (flags & 0x80)
+                position += (size_t)(2 << (flags & 0x07)) * 3;
+            // LZW minimum code size, then the data
+            position = gif_skip_sub_blocks(data, size, position + 1);
+            count++;
+        } else {
+            break;
+        }
+    }
+
+    return count;
+}
+
+static void gif_clear_rect(GifDecoder* decoder, GifDecoderRect rect)
+{
+    for (int y = rect.y; y < rect.y + rect.height; ++y)
+        memset(&decoder->canvas[((size_t)y * decoder->width + rect.x) * 4], 0, (size_t)rect.width * 4);
+}
+
+// Row of the image where the `row`-th row stored in an interlaced image goes
+static int gif_interlaced_row(int row, int height)
+{
+    static const int starts[4] = { 0, 4, 2, 1 };
+    static const int steps[4] = { 8, 8, 4, 2 };
+    for (int pass = 0; pass < 4; ++pass) {
+        int rows = (height - starts[pass] + steps[pass] - 1) / steps[pass];
+        if (rows < 0)
+            rows = 0;
+        if (row < rows)
+            return starts[pass] + row * steps[pass];
+        row -= rows;
+    }
+    return 0;
+}
+
+bool gif_decoder_next(GifDecoder* decoder, void* pixels, int* delay)
+{
+    const uint8_t* data = decoder->data;
+    size_t size = decoder->size;
+
+    int frame_dispose = 0;
+    int frame_delay = 0;
+    int transparent = -1;
+
+    while (decoder->position < size) {
+        uint8_t block = data[decoder->position++];
+
+        if (block == 0x3B)
+            return false;
+
+        if (block == 0x21) {
+            if (decoder->position >= size)
+                return false;
+            uint8_t label = data[decoder->position++];
+            // Graphic control extension
+            if (label == 0xF9 && decoder->position + 5 <= size && data[decoder->position] >= 4) {
+                const uint8_t* control = &data[decoder->position + 1];
+                frame_dispose = (control[0] >> 2) & 0x07;
+                frame_delay = gif_read_u16(&control[1]);
+                transparent = (control[0] & 0x01) ? control[3] : -1;
+            }
+            decoder->position = gif_skip_sub_blocks(data, size, decoder->position);
+            continue;
+        }
+
+        if (block != 0x2C || decoder->position + 9 > size)
+            return false;
+
+        const uint8_t* descriptor = &data[decoder->position];
+        GifDecoderRect rect = {
+            .x = gif_read_u16(&descriptor[0]),
+            .y = gif_read_u16(&descriptor[2]),
+            .width = gif_read_u16(&descriptor[4]),
+            .height = gif_read_u16(&descriptor[6]),
+        };
+        uint8_t flags = descriptor[8];
+        decoder->position += 9;
+
+        const uint8_t(*palette)[3] = decoder->global_palette;
+        int colors = decoder->global_colors;
+        if (flags & 0x80) {
+            colors = 2 << (flags & 0x07);
+            if (decoder->position + (size_t)colors * 3 > size)
+                return false;
+            palette = (const uint8_t(*)[3]) & data[decoder->position];
+            decoder->position += (size_t)colors * 3;
+        }
+
+        if (decoder->position >= size)
+            return false;
+        int min_code_size = data[decoder->position++];
+        if (min_code_size < 1 || min_code_size > 11)
+            return false;
+
+        // Clipped to the canvas
+        GifDecoderRect visible = rect;
+        if (visible.x > decoder->width)
+            visible.x = decoder->width;
+        if (visible.y > decoder->height)
+            visible.y = decoder->height;
+        if (visible.x + visible.width > decoder->width)
+            visible.width = decoder->width - visible.x;
+        if (visible.y + visible.height > decoder->height)
+            visible.height = decoder->height - visible.y;
+
+        // Decompress the whole frame, only the visible part is drawn
+        size_t indices_count = (size_t)rect.width * rect.height;
+        if (indices_count > DECODE_MAX_PIXELS)
+            return false;
+        uint8_t* indices = decoder->indices;
+        if (indices_count > (size_t)decoder->width * decoder->height)
+            indices = malloc(indices_count);
+        if (indices == NULL)
+            return false;
+        memset(indices, transparent >= 0 ? transparent : 0, indices_count);
+
+        GifBitReader reader = { .data = data, .size = size, .position = decoder->position };
+        gif_lzw_decode(decoder, &reader, min_code_size, indices, indices_count);
+        decoder->position = reader.ended
+            ? reader.position
+            : gif_skip_sub_blocks(data, size, reader.position + reader.block_left);
+
+        // Dispose the previous frame before drawing this one
+        if (decoder->dispose == GIF_DISPOSE_BACKGROUND)
+            gif_clear_rect(decoder, decoder->dispose_rect);
+        else if (decoder->dispose == GIF_DISPOSE_PREVIOUS && decoder->saved)
+            memcpy(decoder->canvas, decoder->saved, (size_t)decoder->width * decoder->height * 4);
+
+        if (frame_dispose == GIF_DISPOSE_PREVIOUS) {
+            if (decoder->saved == NULL)
+                decoder->saved = malloc((size_t)decoder->width * decoder->height * 4);
+            if (decoder->saved == NULL) {
+                if (indices != decoder->indices)
+                    free(indices);
+                return false;
+            }
+            memcpy(decoder->saved, decoder->canvas, (size_t)decoder->width * decoder->height * 4);
+        }
+
+        bool interlaced = flags & 0x40;
+        for (int row = 0; row < rect.height; ++row) {
+            int canvas_row = interlaced ? gif_interlaced_row(row, rect.height) : row;
+            if (canvas_row >= visible.height)
+                continue;
+            const uint8_t* source = &indices[(size_t)row * rect.width];
+            uint8_t* target = &decoder->canvas[((size_t)(visible.y + canvas_row) * decoder->width + visible.x) * 4];
+            for (int x = 0; x < visible.width; ++x) {
+                int index = source[x];
+                if (index == transparent || index >= colors)
+                    continue;
+                target[x * 4 + 0] = palette[index][0];
+                target[x * 4 + 1] = palette[index][1];
+                target[x * 4 + 2] = palette[index][2];
+                target[x * 4 + 3] = 255;
+            }
+        }
+
+        if (indices != decoder->indices)
+            free(indices);
+
+        decoder->dispose = frame_dispose;
+        decoder->dispose_rect = visible;
+
+        memcpy(pixels, decoder->canvas, (size_t)decoder->width * decoder->height * 4);
+        // Browsers play delays of 0 and 1 as 10, which is what the
+        // animations are authored for
+        if (delay)
+            *delay = frame_delay <= 1 ? 10 : frame_delay;
+
+        return true;
+    }
+
+    return false;
+}
+
+void gif_decoder_close(GifDecoder* decoder)
+{
+    if (decoder == NULL)
+        return;
+    free(decoder->indices);
+    free(decoder->saved);
+    free(decoder->canvas);
+    free(decoder);
+}
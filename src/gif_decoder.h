@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming GIF decoder. Frames are decompressed and drawn onto the canvas
+// one at a time, so only the canvas and the compressed file are kept in
+// memory.
+typedef struct GifDecoder GifDecoder;
+
+// `data` must stay valid until the decoder is closed. Returns NULL if it is
+// not a GIF. `failed` is set as well when it is one that must not be decoded
+// by other means either: bigger than DECODE_MAX_PIXELS, or too big to
+// allocate.
+GifDecoder* gif_decoder_open(const uint8_t* data, size_t size, bool* failed);
+int gif_decoder_width(const GifDecoder* decoder);
+int gif_decoder_height(const GifDecoder* decoder);
+// Counts the frames without decoding them
+size_t gif_decoder_frames_count(const GifDecoder* decoder);
+// Writes the next frame as `width * height` RGBA pixels, and its delay in
+// hundredths of a second. Returns false after the last frame, or if the file
+// is truncated.
+bool gif_decoder_next(GifDecoder* decoder, void* pixels, int* delay);
+void gif_decoder_close(GifDecoder* decoder);
@@ -0,0 +1,472 @@
+#include "gif_encoder.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+#include "util/buffer.h"
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+#define GIF_LZW_MAX_CODE 4095
+#define GIF_LZW_HASH_SIZE 5003
+
+typedef struct {
+    GifEncoder* encoder;
+    OptimizedFrame frame;
+    Buffer output;
+    bool done;
+    bool failed;
+} GifEncoderFrame;
+
+struct GifEncoder {
+    FILE* file;
+    int width;
+    int height;
+    bool failed;
+    // Global color table shared by every frame, NULL for one palette per frame
+    PaletteMap* palette_map;
+
+    ThreadPool* pool;
+    ThreadPoolGroup group;
+
+    pthread_mutex_t mutex;
+    // Signaled whenever frames are written
+    pthread_cond_t written;
+    GifEncoderFrame** frames;
+    size_t frames_count;
+    size_t frames_capacity;
+    size_t frames_written;
+};
+
+/*                                    *
+ *   Frame quantization               *
+ *                                    */
+
+static int gif_clamp_channel(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Builds a palette for this frame alone and maps the frame to it, with
+// Floyd-Steinberg dithering
+static bool gif_quantize(const uint8_t* pixels, int width, int height,
+                         Palette* palette, uint8_t* indices)
+{
+    PaletteHistogram* histogram = calloc(1, sizeof(*histogram));
+    if (histogram == NULL)
+        return false;
+    palette_histogram_add(histogram, pixels, (size_t)width * height, GIF_ALPHA_THRESHOLD);
+    palette_from_histogram(palette, histogram, PALETTE_MAX_COLORS - 1);
+    free(histogram);
+
+    bool opaque = palette->count > 1;
+
+    // Nearest palette entry for each histogram cell, resolved on demand
+    int16_t* lookup = malloc(PALETTE_HISTOGRAM_SIZE * sizeof(*lookup));
+    // Error of the current and next row, 3 channels, with one pixel of padding
+    int* errors = calloc((size_t)(width + 2) * 3 * 2, sizeof(*errors));
+    if (lookup == NULL || errors == NULL) {
+        free(errors);
+        free(lookup);
+        return false;
+    }
+    memset(lookup, 0xFF, PALETTE_HISTOGRAM_SIZE * sizeof(*lookup));
+
+    int* current = errors;
+    int* next = errors + (width + 2) * 3;
+
+    for (int y = 0; y < height; ++y) {
+        memset(next, 0, (width + 2) * 3 * sizeof(*next));
+
+        for (int x = 0; x < width; ++x) {
+            const uint8_t* pixel = &pixels[((size_t)y * width + x) * 4];
+            uint8_t* index = &indices[(size_t)y * width + x];
+
+            if (pixel[3] < GIF_ALPHA_THRESHOLD || !opaque) {
+                *index = palette->transparent_index;
+                continue;
+            }
+
+            int* error = &current[(x + 1) * 3];
+            uint8_t color[3];
+            for (int c = 0; c < 3; ++c)
+                color[c] = gif_clamp_channel(pixel[c] + error[c] / 16);
+
+            uint32_t cell = palette_cell(color[0], color[1], color[2]);
+            if (lookup[cell] < 0)
+                lookup[cell] = palette_nearest(palette, color[0], color[1], color[2]);
+            *index = lookup[cell];
+
+            for (int c = 0; c < 3; ++c) {
+                int diff = color[c] - palette->colors[*index][c];
+                current[(x + 2) * 3 + c] += diff * 7;
+                next[x * 3 + c] += diff * 3;
+                next[(x + 1) * 3 + c] += diff * 5;
+                next[(x + 2) * 3 + c] += diff * 1;
+            }
+        }
+
+        int* swap = current;
+        current = next;
+        next = swap;
+    }
+
+    free(errors);
+    free(lookup);
+    return true;
+}
+
+/*                                    *
+ *   LZW compression                  *
+ *                                    */
+
+typedef struct {
+    Buffer* output;
+    uint8_t block[255];
+    int block_size;
+    uint32_t bits;
+    int bits_count;
+    bool failed;
+} GifBitWriter;
+
+static void gif_bits_flush_block(GifBitWriter* writer)
+{
+    if (writer->block_size == 0)
+        return;
+    if (!buffer_append_byte(writer->output, writer->block_size)
+        || !buffer_append(writer->output, writer->block, writer->block_size))
+        writer->failed = true;
+    writer->block_size = 0;
+}
+
+static void gif_bits_write(GifBitWriter* writer, int code, int code_size)
+{
+    writer->bits |= (uint32_t)code << writer->bits_count;
+    writer->bits_count += code_size;
+    while (writer->bits_count >= 8) {
+        writer->block[writer->block_size++] = writer->bits & 0xFF;
+        writer->bits >>= 8;
+        writer->bits_count -= 8;
+        if (writer->block_size == 255)
+            gif_bits_flush_block(writer);
+    }
+}
+
+static bool gif_lzw_compress(Buffer* output, const uint8_t* indices, size_t count, int min_code_size)
+{
+    static const int empty = -1;
+
+    int32_t* hash_keys = malloc(GIF_LZW_HASH_SIZE * sizeof(*hash_keys));
+    int16_t* hash_codes = malloc(GIF_LZW_HASH_SIZE * sizeof(*hash_codes));
+    if (hash_keys == NULL || hash_codes == NULL) {
+        free(hash_codes);
+        free(hash_keys);
+        return false;
+    }
+    for (int i = 0; i < GIF_LZW_HASH_SIZE; ++i)
+        hash_keys[i] = empty;
+
+    int clear_code = 1 << min_code_size;
+    int end_code = clear_code + 1;
+    int next_code = end_code + 1;
+    int code_size = min_code_size + 1;
+
+    GifBitWriter writer = { .output = output };
+    if (!buffer_append_byte(output, min_code_size))
+        writer.failed = true;
+    gif_bits_write(&writer, clear_code, code_size);
+
+    if (count > 0) {
+        int prefix = indices[0];
+        for (size_t i = 1; i < count; ++i) {
+            int suffix = indices[i];
+            int32_t key = (prefix << 8) | suffix;
+
+            int slot = ((suffix << 4) ^ prefix) % GIF_LZW_HASH_SIZE;
+            while (hash_keys[slot] != empty && hash_keys[slot] != key)
+                slot = (slot + 1) % GIF_LZW_HASH_SIZE;
+
+            if (hash_keys[slot] == key) {
+                prefix = hash_codes[slot];
+                continue;
+            }
+
+            gif_bits_write(&writer, prefix, code_size);
+
+            if (next_code <= GIF_LZW_MAX_CODE) {
+                hash_keys[slot] = key;
+                hash_codes[slot] = next_code;
+                if (next_code == (1 << code_size) && code_size < 12)
+                    code_size++;
+                next_code++;
+            } else {
+                gif_bits_write(&writer, clear_code, code_size);
+                for (int j = 0; j < GIF_LZW_HASH_SIZE; ++j)
+                    hash_keys[j] = empty;
+                next_code = end_code + 1;
+                code_size = min_code_size + 1;
+            }
+
+            prefix = suffix;
+        }
+        gif_bits_write(&writer, prefix, code_size);
+    }
+
+    gif_bits_write(&writer, end_code, code_size);
+    if (writer.bits_count > 0)
+        gif_bits_write(&writer, 0, 8 - writer.bits_count);
+    gif_bits_flush_block(&writer);
+    bool ok = !writer.failed && buffer_append_byte(output, 0);
+
+    free(hash_codes);
+    free(hash_keys);
+    return ok;
+}
+
+/*                                    *
+ *   Encoder                          *
+ *                                    */
+
+static int gif_table_bits(const Palette* palette)
+{
+    int table_bits = 1;
+    while ((1 << table_bits) < palette->count)
+        table_bits++;
+    return table_bits;
+}
+
+static bool gif_append_color_table(Buffer* output, const Palette* palette, int table_bits)
+{
+    for (int i = 0; i < (1 << table_bits); ++i) {
+        uint8_t black[3] = { 0 };
+        if (!buffer_append(output, i < palette->count ? palette->colors[i] : black, 3))
+            return false;
+    }
+    return true;
+}
+
+static bool gif_encode_frame(GifEncoder* encoder, GifEncoderFrame* frame)
+{
+    FrameRect rect = frame->frame.rect;
+    size_t pixels_count = (size_t)rect.width * rect.height;
+
+    uint8_t* indices = malloc(pixels_count);
+    if (indices == NULL)
+        return false;
+    Palette local_palette;
+    const Palette* palette = &local_palette;
+
+    if (encoder->palette_map) {
+        // Mapped a row at a time, only the indices of the whole frame are kept
+        palette = &encoder->palette_map->palette;
+        uint8_t* row = malloc((size_t)rect.width * 4);
+        if (row == NULL) {
+            free(indices);
+            return false;
+        }
+        for (int y = 0; y < rect.height; ++y) {
+            frame_optimized_row(&frame->frame, encoder->width, y, row);
+            palette_map_row(encoder->palette_map, row, rect.width, rect.x, rect.y + y,
+                            GIF_ALPHA_THRESHOLD, &indices[(size_t)y * rect.width]);
+        }
+        free(row);
+    } else {
+        uint8_t* pixels = calloc(pixels_count, 4);
+        bool quantized = false;
+        if (pixels != NULL) {
+            for (int y = 0; y < rect.height; ++y)
+                frame_optimized_row(&frame->frame, encoder->width, y, &pixels[(size_t)y * rect.width * 4]);
+            quantized = gif_quantize(pixels, rect.width, rect.height, &local_palette, indices);
+        }
+        free(pixels);
+        if (!quantized) {
+            free(indices);
+            return false;
+        }
+    }
+
+    int table_bits = gif_table_bits(palette);
+
+    Buffer* output = &frame->output;
+
+    // Graphic control extension
+    const int disposal_none = 1;
+    const int disposal_restore_background = 2;
+    int disposal = frame->frame.dispose == FRAME_DISPOSE_BACKGROUND ? disposal_restore_background : disposal_none;
+    bool ok = buffer_append(output, (uint8_t[]) { 0x21, 0xF9, 0x04 }, 3)
+        && buffer_append_byte(output, (disposal << 2) | 1)
+        // Merged frames can add up to more than the 16 bits there are
+        && buffer_append_u16_le(output, frame->frame.delay > UINT16_MAX ? UINT16_MAX : frame->frame.delay)
+        && buffer_append_byte(output, palette->transparent_index)
+        && buffer_append_byte(output, 0);
+
+    // Image descriptor, with a local color table unless the global one is used
+    ok = ok && buffer_append_byte(output, 0x2C)
+        && buffer_append_u16_le(output, rect.x)
+        && buffer_append_u16_le(output, rect.y)
+        && buffer_append_u16_le(output, rect.width)
+        && buffer_append_u16_le(output, rect.height);
+    if (encoder->palette_map)
+        ok = ok && buffer_append_byte(output, 0);
+    else
+        ok = ok && buffer_append_byte(output, 0x80 | (table_bits - 1))
+            && gif_append_color_table(output, palette, table_bits);
+
+    ok = ok && gif_lzw_compress(output, indices, pixels_count, table_bits < 2 ? 2 : table_bits);
+
+    free(indices);
+    return ok;
+}
+
+// Writes every finished frame that follows the ones already written. Must be
+// called with the encoder locked.
+static void gif_encoder_flush(GifEncoder* encoder)
+{
+    while (encoder->frames_written < encoder->frames_count) {
+        GifEncoderFrame* frame = encoder->frames[encoder->frames_written];
+        if (!frame->done)
+            break;
+
+        if (frame->failed
+            || fwrite(frame->output.data, 1, frame->output.size, encoder->file) != frame->output.size)
+            encoder->failed = true;
+
+        buffer_free(&frame->output);
+        free(frame);
+        encoder->frames[encoder->frames_written++] = NULL;
+    }
+    pthread_cond_broadcast(&encoder->written);
+}
+
+static void gif_encoder_task(void* arg)
+{
+    GifEncoderFrame* frame = arg;
+    GifEncoder* encoder = frame->encoder;
+
+    bool ok;
+    {
+        TRACE_SCOPE("gif_encode_frame");
+        ok = gif_encode_frame(encoder, frame);
+    }
+
+    pthread_mutex_lock(&encoder->mutex);
+    frame->done = true;
+    frame->failed = !ok;
+    gif_encoder_flush(encoder);
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+GifEncoder* gif_encoder_open(const char* output_file, int width, int height, const Palette* palette)
+{
+    FILE* file = fopen(output_file, "wb");
+    if (file == NULL)
+        return NULL;
+
+    GifEncoder* encoder = calloc(1, sizeof(*encoder));
+    PaletteMap* palette_map = palette ? malloc(sizeof(*palette_map)) : NULL;
+    if (encoder == NULL || (palette != NULL && palette_map == NULL)) {
+        free(palette_map);
+        free(encoder);
+        fclose(file);
+        remove(output_file);
+        return NULL;
+    }
+    encoder->file = file;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->pool = thread_pool_global();
+    thread_pool_group_init(&encoder->group);
+    pthread_mutex_init(&encoder->mutex, NULL);
+    pthread_cond_init(&encoder->written, NULL);
+
+    Buffer header = { 0 };
+    bool ok = buffer_append(&header, "GIF89a", 6)
+        && buffer_append_u16_le(&header, width)
+        && buffer_append_u16_le(&header, height);
+    if (palette) {
+        encoder->palette_map = palette_map;
+        palette_map_init(encoder->palette_map, palette);
+
+        int table_bits = gif_table_bits(palette);
+        ok = ok && buffer_append_byte(&header, 0x80 | ((table_bits - 1) << 4) | (table_bits - 1))
+            && buffer_append_byte(&header, palette->transparent_index)
+            && buffer_append_byte(&header, 0)
+            && gif_append_color_table(&header, palette, table_bits);
+    } else {
+        ok = ok && buffer_append_byte(&header, 0) // No global color table
+            && buffer_append_byte(&header, 0)
+            && buffer_append_byte(&header, 0);
+    }
+
+    // Loop forever
+    ok = ok && buffer_append(&header, (uint8_t[]) { 0x21, 0xFF, 0x0B }, 3)
+        && buffer_append(&header, "NETSCAPE2.0", 11)
+        && buffer_append(&header, (uint8_t[]) { 0x03, 0x01, 0x00, 0x00, 0x00 }, 5);
+
+    if (!ok || fwrite(header.data, 1, header.size, file) != header.size)
+        encoder->failed = true;
+    buffer_free(&header);
+
+    return encoder;
+}
+
+void gif_encoder_add_frame(GifEncoder* encoder, const OptimizedFrame* optimized)
+{
+    GifEncoderFrame* frame = calloc(1, sizeof(*frame));
+
+    pthread_mutex_lock(&encoder->mutex);
+    if (frame != NULL && encoder->frames_count == encoder->frames_capacity) {
+        size_t capacity = encoder->frames_capacity ? encoder->frames_capacity * 2 : 32;
+        GifEncoderFrame** frames = realloc(encoder->frames, capacity * sizeof(*frames));
+        if (frames != NULL) {
+            encoder->frames = frames;
+            encoder->frames_capacity = capacity;
+        }
+    }
+    if (frame == NULL || encoder->frames_count == encoder->frames_capacity) {
+        // The frame is dropped, and the save fails once closed
+        encoder->failed = true;
+        pthread_mutex_unlock(&encoder->mutex);
+        free(frame);
+        return;
+    }
+    frame->encoder = encoder;
+    frame->frame = *optimized;
+    encoder->frames[encoder->frames_count++] = frame;
+    pthread_mutex_unlock(&encoder->mutex);
+
+    thread_pool_group_submit(encoder->pool, &encoder->group, gif_encoder_task, frame);
+}
+
+void gif_encoder_wait(GifEncoder* encoder, size_t frames_count)
+{
+    pthread_mutex_lock(&encoder->mutex);
+    while (encoder->frames_written < frames_count && encoder->frames_written < encoder->frames_count)
+        pthread_cond_wait(&encoder->written, &encoder->mutex);
+    pthread_mutex_unlock(&encoder->mutex);
+}
+
+bool gif_encoder_close(GifEncoder* encoder)
+{
+    thread_pool_group_wait(&encoder->group);
+    thread_pool_group_destroy(&encoder->group);
+
+    bool ok = !encoder->failed;
+    if (fputc(0x3B, encoder->file) == EOF)
+        ok = false;
+    if (fclose(encoder->file) != 0)
+        ok = false;
+
+    pthread_cond_destroy(&encoder->written);
+    pthread_mutex_destroy(&encoder->mutex);
+    free(encoder->palette_map);
+    free(encoder->frames);
+    free(encoder);
+
+    return ok;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "frame_optimize.h"
+#include "palette.h"
+
+// Pixels less opaque than this become the transparent color
+#define GIF_ALPHA_THRESHOLD 128
+
+// Streaming GIF89a writer. Frames are quantized and compressed on the global
+// thread pool, and written out in order as soon as they are ready.
+typedef struct GifEncoder GifEncoder;
+
+// With a `palette`, it's written as the global color table and every frame is
+// mapped to it with ordered dithering. Without one, each frame gets its own
+// palette and is dithered with error diffusion. Returns NULL if the file
+// can't be created.
+GifEncoder* gif_encoder_open(const char* output_file, int width, int height, const Palette* palette);
+// Queues a frame planned by `frame_optimize`. Its pixels must stay valid until
+// `gif_encoder_close` returns.
+void gif_encoder_add_frame(GifEncoder* encoder, const OptimizedFrame* frame);
+// Blocks until the first `frames_count` frames added are written, after which
+// their pixels can be reused.
+void gif_encoder_wait(GifEncoder* encoder, size_t frames_count);
+// Waits for every frame to be written and closes the file. Returns false if
+// anything could not be written.
+bool gif_encoder_close(GifEncoder* encoder);
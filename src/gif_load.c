@@ -1,84 +1,321 @@
+#define _GNU_SOURCE
 #include "gif_load.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "apng_decoder.h"
+#include "gif_decoder.h"
 #include "util/magick.h"
 #include "util/string.h"
+#include "util/trace.h"
 
 #include <MagickWand/MagickWand.h>
 
-GifFramesInfo gif_get_frames_info(const char* input_file)
+struct GifReader {
+    GifFramesInfo info;
+    size_t next;
+
+    // Native decoding, from the whole compressed file
+    uint8_t* data;
+    size_t size;
+    GifDecoder* gif;
+    ApngDecoder* apng;
+
+    // Everything else, coalesced by ImageMagick
+    char* input_file;
+    MagickWand* wand;
+};
+
+static uint8_t* gif_read_file(const char* input_file, size_t* size)
+{
+    FILE* file = fopen(input_file, "rb");
+    if (file == NULL)
+        return NULL;
+
+    uint8_t* data = NULL;
+    long length = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        length = ftell(file);
+    if (length > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = malloc(length);
+        if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+            free(data);
+            data = NULL;
+        }
+    }
+
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+// Opens the native decoder matching the file's signature. `failed` is set if
+// the file must not be read by ImageMagick either.
+static bool gif_reader_open_native(GifReader* reader, bool* failed)
 {
+    reader->gif = gif_decoder_open(reader->data, reader->size, failed);
+    if (reader->gif) {
+        reader->info = (GifFramesInfo) {
+            .count = gif_decoder_frames_count(reader->gif),
+            .width = gif_decoder_width(reader->gif),
+            .height = gif_decoder_height(reader->gif),
+        };
+        return true;
+    }
+
+    if (*failed)
+        return false;
+
+    reader->apng = apng_decoder_open(reader->data, reader->size, failed);
+    if (reader->apng) {
+        reader->info = (GifFramesInfo) {
+            .count = apng_decoder_frames_count(reader->apng),
+            .width = apng_decoder_width(reader->apng),
+            .height = apng_decoder_height(reader->apng),
+        };
+        return true;
+    }
+
+    return false;
+}
+
+static bool gif_reader_open_magick(GifReader* reader)
+{
+    const char* input_file = reader->input_file;
     if (string_ends_with(input_file, ".apng") || string_ends_with(input_file, ".png")) {
         input_file = string_append_prefix(input_file, "APNG:");
     }
 
-    GifFramesInfo info = {0};
+    MagickWand* wand = magick_wand_acquire();
+    if (MagickReadImage(wand, input_file) != MagickTrue) {
+        magick_log_wand_exception(wand);
+        magick_wand_release(wand);
+        return false;
+    }
 
-    MagickWandGenesis();
+    reader->info.width = MagickGetImageWidth(wand);
+    reader->info.height = MagickGetImageHeight(wand);
 
-    MagickWand* wand = NewMagickWand();
-    MagickReadImage(wand, input_file);
-    info.width = MagickGetImageWidth(wand);
-    info.height = MagickGetImageHeight(wand);
+    reader->wand = MagickCoalesceImages(wand);
+    magick_wand_release(wand);
+    if (reader->wand == NULL)
+        return false;
 
-    MagickWand* old_wand = wand;
-    wand = MagickCoalesceImages(old_wand);
-    old_wand = DestroyMagickWand(old_wand);
+    reader->info.count = MagickGetNumberImages(reader->wand);
+    MagickResetIterator(reader->wand);
 
-    MagickResetIterator(wand);
-    while (MagickNextImage(wand) != MagickFalse) {
-        info.count++;
+    return true;
+}
+
+GifReader* gif_reader_open(const char* input_file)
+{
+    TRACE_SCOPE("gif_reader_open");
+
+    GifReader* reader = calloc(1, sizeof(*reader));
+    reader->input_file = strdup(input_file);
+    reader->data = gif_read_file(input_file, &reader->size);
+
+    bool failed = false;
+    bool opened = reader->data && gif_reader_open_native(reader, &failed);
+    if (failed)
+        fprintf(stderr, "ERROR: `%s` is too big to decode\n", input_file);
+    if (!opened && !failed) {
+        free(reader->data);
+        reader->data = NULL;
+        opened = gif_reader_open_magick(reader);
     }
 
-    wand = DestroyMagickWand(wand);
+    if (!opened) {
+        gif_reader_close(reader);
+        return NULL;
+    }
 
-    MagickWandTerminus();
+    printf("Loaded GIF file `%s`\n", input_file);
 
-    return info;
+    return reader;
 }
 
-bool gif_load(const char* input_file,
-              void** frames, size_t frames_count)
+GifFramesInfo gif_reader_info(const GifReader* reader)
 {
-    if (string_ends_with(input_file, ".apng") || string_ends_with(input_file, ".png")) {
-        input_file = string_append_prefix(input_file, "APNG:");
+    return reader->info;
+}
+
+static bool gif_reader_next_magick(GifReader* reader, void* pixels, int* delay)
+{
+    // The frame read last is removed, so the next one is always first
+    MagickResetIterator(reader->wand);
+    if (MagickNextImage(reader->wand) == MagickFalse)
+        return false;
+
+    MagickBooleanType export_status = MagickExportImagePixels(reader->wand,
+                                                              0, 0, reader->info.width, reader->info.height,
+                                                              "RGBA", CharPixel,
+                                                              pixels);
+    if (export_status != MagickTrue) {
+        magick_log_wand_exception(reader->wand);
+        return false;
+    }
+
+    if (delay) {
+        ssize_t ticks_per_second = MagickGetImageTicksPerSecond(reader->wand);
+        size_t ticks = MagickGetImageDelay(reader->wand);
+        *delay = ticks_per_second > 0 ? (int)(ticks * 100 / ticks_per_second) : (int)ticks;
+    }
+
+    MagickRemoveImage(reader->wand);
+    return true;
+}
+
+bool gif_reader_next(GifReader* reader, void* pixels, int* delay)
+{
+    TRACE_SCOPE("gif_reader_next");
+
+    if (reader->next == reader->info.count)
+        return false;
+
+    bool ok;
+    if (reader->gif)
+        ok = gif_decoder_next(reader->gif, pixels, delay);
+    else if (reader->apng)
+        ok = apng_decoder_next(reader->apng, pixels, delay);
+    else
+        ok = gif_reader_next_magick(reader, pixels, delay);
+
+    if (ok)
+        reader->next++;
+    return ok;
+}
+
+bool gif_reader_rewind(GifReader* reader)
+{
+    reader->next = 0;
+
+    if (reader->data) {
+        gif_decoder_close(reader->gif);
+        apng_decoder_close(reader->apng);
+        reader->gif = NULL;
+        reader->apng = NULL;
+        bool failed;
+        return gif_reader_open_native(reader, &failed);
     }
 
-    MagickWandGenesis();
-
-    MagickWand* wand = NewMagickWand();
-    MagickReadImage(wand, input_file);
-    int frame_width = MagickGetImageWidth(wand);
-    int frame_height = MagickGetImageHeight(wand);
-
-    MagickWand* old_wand = wand;
-    wand = MagickCoalesceImages(old_wand);
-    old_wand = DestroyMagickWand(old_wand);
-
-    MagickResetIterator(wand);
-    size_t i = 0;
-    while ((MagickNextImage(wand) != MagickFalse) && i < frames_count) {
-        MagickBooleanType export_status = MagickExportImagePixels(wand,
-                                                                  0, 0, frame_width, frame_height,
-                                                                  "RGBA", CharPixel,
-                                                                  frames[i]);
-
-        if (export_status != MagickTrue) {
-            magick_log_wand_exception(wand);
-            DestroyMagickWand(wand);
-            MagickWandTerminus();
+    // The frames already read were dropped, so the file is read again
+    magick_wand_release(reader->wand);
+    reader->wand = NULL;
+    return gif_reader_open_magick(reader);
+}
+
+void gif_reader_close(GifReader* reader)
+{
+    if (reader == NULL)
+        return;
+    gif_decoder_close(reader->gif);
+    apng_decoder_close(reader->apng);
+    if (reader->wand)
+        magick_wand_release(reader->wand);
+    free(reader->data);
+    free(reader->input_file);
+    free(reader);
+}
+
+// Skips data sub-blocks, returns false at the end of the file
+static bool gif_file_skip_sub_blocks(FILE* file)
+{
+    int block_size;
+    while ((block_size = fgetc(file)) > 0) {
+        if (fseek(file, block_size, SEEK_CUR) != 0)
+            return false;
+    }
+    return block_size == 0;
+}
+
+// Walks the blocks following the screen descriptor in `header` until a second
+// image descriptor is found, seeking over the color tables and image data
+static bool gif_file_probe_gif(FILE* file, const uint8_t* header)
+{
+    uint8_t flags = header[10];
+    if ((flags & 0x80) && fseek(file, (2 << (flags & 0x07)) * 3, SEEK_CUR) != 0)
+        return false;
+
+    int frames_count = 0;
+    int block;
+    while ((block = fgetc(file)) != EOF) {
+        if (block == 0x21) {
+            // Extension label
+            if (fgetc(file) == EOF)
+                return false;
+        } else if (block == 0x2C) {
+            uint8_t descriptor[9];
+            if (fread(descriptor, 1, sizeof(descriptor), file) != sizeof(descriptor))
+                return false;
+            if (++frames_count > 1)
+                return true;
+            if ((descriptor[8] & 0x80) && fseek(file, (2 << (descriptor[8] & 0x07)) * 3, SEEK_CUR) != 0)
+                return false;
+            // LZW minimum code size
+            if (fgetc(file) == EOF)
+                return false;
+        } else {
             return false;
         }
 
-        i++;
+        if (!gif_file_skip_sub_blocks(file))
+            return false;
     }
+    return false;
+}
 
-    wand = DestroyMagickWand(wand);
+static uint32_t gif_file_read_u32_be(const uint8_t* data)
+{
+    return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
 
-    MagickWandTerminus();
+// Reads the chunks following the PNG signature until the animation control
+// chunk, which must come before the image data
+static bool gif_file_probe_apng(FILE* file)
+{
+    uint8_t chunk[8];
+    for (bool first = true; fread(chunk, 1, sizeof(chunk), file) == sizeof(chunk); first = false) {
+        uint32_t length = gif_file_read_u32_be(chunk);
+        const char* type = (const char*)&chunk[4];
+        if (first && memcmp(type, "IHDR", 4) != 0)
+            return false;
+        if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0)
+            return false;
 
-    printf("Loaded GIF file `%s`\n", input_file);
+        if (memcmp(type, "acTL", 4) == 0) {
+            uint8_t frames_count[4];
+            return length >= 8 && fread(frames_count, 1, sizeof(frames_count), file) == sizeof(frames_count)
+                && gif_file_read_u32_be(frames_count) > 1;
+        }
 
-    return true;
+        // Data and CRC
+        if (fseek(file, (long)length + 4, SEEK_CUR) != 0)
+            return false;
+    }
+    return false;
+}
+
+bool gif_file_is_animated(const char* input_file)
+{
+    FILE* file = fopen(input_file, "rb");
+    if (file == NULL)
+        return false;
+
+    static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    uint8_t header[13];
+    bool animated = false;
+    if (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        if (memcmp(header, "GIF87a", 6) == 0 || memcmp(header, "GIF89a", 6) == 0)
+            animated = gif_file_probe_gif(file, header);
+        else if (memcmp(header, png_signature, sizeof(png_signature)) == 0)
+            animated = fseek(file, sizeof(png_signature), SEEK_SET) == 0 && gif_file_probe_apng(file);
+    }
+
+    fclose(file);
+    return animated;
 }
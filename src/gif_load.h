@@ -9,6 +9,25 @@ typedef struct {
     int height;
 } GifFramesInfo;
 
-GifFramesInfo gif_get_frames_info(const char* input_file);
-bool gif_load(const char* input_file,
-              void** frames, size_t frames_count);
+// Animated GIF or APNG being read. GIF and PNG files are decoded natively one
+// frame at a time, from the compressed file kept in memory. Other files are
+// read and coalesced by ImageMagick once when opened, then frames are handed
+// out one at a time and dropped as soon as they have been copied out.
+typedef struct GifReader GifReader;
+
+// Returns NULL if the file can't be read.
+GifReader* gif_reader_open(const char* input_file);
+GifFramesInfo gif_reader_info(const GifReader* reader);
+// Copies the next frame to `pixels`, `width * height` RGBA pixels, and its
+// delay in hundredths of a second to `delay` (if not NULL). Returns false
+// once every frame has been read, or if the frame could not be exported.
+bool gif_reader_next(GifReader* reader, void* pixels, int* delay);
+// Starts reading from the first frame again. Returns false if the file can't
+// be read anymore.
+bool gif_reader_rewind(GifReader* reader);
+void gif_reader_close(GifReader* reader);
+
+// True for GIF and APNG files of more than one frame. Only the file's own
+// header and block structure are read, up to the second frame, and nothing is
+// decoded.
+bool gif_file_is_animated(const char* input_file);
@@ -1,70 +1,429 @@
+#define _GNU_SOURCE
 #include "gif_save.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "apng_encoder.h"
+#include "frame_optimize.h"
+#include "gif_encoder.h"
+#include "palette.h"
 #include "util/magick.h"
 #include "util/string.h"
+#include "util/trace.h"
 
 #include <MagickWand/MagickWand.h>
 
-bool gif_save(GifFrames frames, const char* output_file, bool reverse)
+size_t gif_frame_index(size_t i, size_t frames_count, bool reverse)
 {
-    if (string_ends_with(output_file, ".apng") || string_ends_with(output_file, ".png")) {
-        output_file = string_append_prefix(output_file, "APNG:");
+    if (!reverse || i == 0)
+        return i;
+    return frames_count - i;
+}
+
+static bool gif_use_magick = false;
+static bool gif_global_palette = true;
+static pthread_once_t gif_once = PTHREAD_ONCE_INIT;
+
+static void gif_init(void)
+{
+    const char* encoder = getenv("EXPLODE_ENCODER");
+    gif_use_magick = encoder != NULL && strcmp(encoder, "magick") == 0;
+
+    const char* palette = getenv("EXPLODE_GIF_PALETTE");
+    gif_global_palette = palette == NULL || strcmp(palette, "local") != 0;
+}
+
+// Animations are written next to their destination and renamed once
+// complete, so a failed or cancelled save never leaves a partial file behind,
+// nor removes one written by another save to the same path
+static char* gif_temp_path(const char* output_file)
+{
+    static atomic_size_t next_temp = 0;
+
+    char* temp_path = NULL;
+    if (asprintf(&temp_path, "%s.%d-%zu.tmp", output_file, (int)getpid(), atomic_fetch_add(&next_temp, 1)) < 0)
+        return NULL;
+    return temp_path;
+}
+
+// Moves the temporary file in place when `ok`, or deletes it
+static bool gif_temp_finish(const char* temp_path, const char* output_file, bool ok)
+{
+    if (ok && rename(temp_path, output_file) != 0)
+        ok = false;
+    if (!ok)
+        remove(temp_path);
+    return ok;
+}
+
+static bool gif_save_cancelled(const GifSaveCancel* cancel)
+{
+    return cancel && cancel->cancelled && cancel->cancelled(cancel->user_data);
+}
+
+// Plans the frames in display order
+static FramePlan gif_plan_frames(GifFrames frames, bool reverse, FrameOptimizeOptions options)
+{
+    const uint8_t** ordered = malloc(frames.frames_count * sizeof(*ordered));
+    for (size_t i = 0; i < frames.frames_count; ++i)
+        ordered[i] = frames.frames[gif_frame_index(i, frames.frames_count, reverse)];
+
+    FramePlan plan = frame_optimize(ordered, frames.frames_count, frames.width, frames.height,
+                                    GIF_FRAME_DELAY, options);
+    free(ordered);
+    return plan;
+}
+
+static bool gif_save_native(GifFrames frames, const char* output_file, const char* temp_path, bool reverse,
+                            const GifSaveCancel* cancel)
+{
+    Palette palette;
+    if (gif_global_palette) {
+        palette_build(&palette, (const uint8_t* const*)frames.frames, frames.frames_count,
+                      (size_t)frames.width * frames.height, GIF_ALPHA_THRESHOLD);
+    }
+
+    GifEncoder* encoder = gif_encoder_open(temp_path, frames.width, frames.height,
+                                           gif_global_palette ? &palette : NULL);
+    if (encoder == NULL) {
+        fprintf(stderr, "ERROR: could not create file `%s`: %s\n", output_file, strerror(errno));
+        return false;
     }
 
-    MagickWandGenesis();
+    // GIF transparency is on or off, and decoders disagree on whether the
+    // canvas is cleared when the animation loops.
+    FrameOptimizeOptions options = { .alpha_threshold = GIF_ALPHA_THRESHOLD, .clear_on_loop = true };
+    FramePlan plan = gif_plan_frames(frames, reverse, options);
+    bool cancelled = false;
+    for (size_t i = 0; i < plan.frames_count && !cancelled; ++i) {
+        cancelled = gif_save_cancelled(cancel);
+        if (!cancelled)
+            gif_encoder_add_frame(encoder, &plan.frames[i]);
+    }
+
+    bool ok = gif_temp_finish(temp_path, output_file, gif_encoder_close(encoder) && !cancelled);
+    frame_plan_free(&plan);
+    if (!ok) {
+        if (!cancelled)
+            fprintf(stderr, "ERROR: could not write file `%s`\n", output_file);
+        return false;
+    }
 
-    MagickWand* wand = NewMagickWand();
+    printf("Saved GIF file `%s`\n", output_file);
+
+    return true;
+}
+
+static bool apng_save_native(GifFrames frames, const char* output_file, const char* temp_path, bool reverse,
+                             const GifSaveCancel* cancel)
+{
+    FramePlan plan = gif_plan_frames(frames, reverse, (FrameOptimizeOptions) { 0 });
+
+    ApngEncoder* encoder = apng_encoder_open(temp_path, frames.width, frames.height, plan.frames_count);
+    if (encoder == NULL) {
+        fprintf(stderr, "ERROR: could not create file `%s`: %s\n", output_file, strerror(errno));
+        frame_plan_free(&plan);
+        return false;
+    }
+
+    bool cancelled = false;
+    for (size_t i = 0; i < plan.frames_count && !cancelled; ++i) {
+        cancelled = gif_save_cancelled(cancel);
+        if (!cancelled)
+            apng_encoder_add_frame(encoder, &plan.frames[i]);
+    }
+
+    bool ok = gif_temp_finish(temp_path, output_file, apng_encoder_close(encoder) && !cancelled);
+    frame_plan_free(&plan);
+    if (!ok) {
+        if (!cancelled)
+            fprintf(stderr, "ERROR: could not write file `%s`\n", output_file);
+        return false;
+    }
+
+    printf("Saved APNG file `%s`\n", output_file);
+
+    return true;
+}
+
+// Adds a frame after the current one, or before every frame but the first
+// when `reverse`. A `delay` of 0 keeps the default one.
+static bool gif_magick_add_frame(MagickWand* wand, const void* pixels, int width, int height, int delay,
+                                 bool reverse)
+{
+    MagickWand* frame_wand = magick_wand_acquire();
+    MagickSetSize(frame_wand, width, height);
+    MagickSetImageAlphaChannel(frame_wand, TransparentAlphaChannel);
+    MagickReadImage(frame_wand, "xc:none");
+
+    MagickBooleanType import_status = MagickImportImagePixels(frame_wand,
+                                                              0, 0, width, height,
+                                                              "RGBA", CharPixel,
+                                                              pixels);
+
+    if (import_status != MagickTrue) {
+        magick_log_wand_exception(frame_wand);
+        magick_wand_release(frame_wand);
+        return false;
+    }
+
+    if (delay > 0) {
+        MagickSetImageDelay(frame_wand, delay);
+    }
+
+    MagickAddImage(wand, frame_wand);
+    if (reverse)
+        MagickSetIteratorIndex(wand, 0);
+    else
+        MagickSetLastIterator(wand);
+
+    magick_wand_release(frame_wand);
+    return true;
+}
+
+static bool gif_save_magick(GifFrames frames, const char* output_file, const char* temp_path, bool reverse,
+                            const GifSaveCancel* cancel)
+{
+    // The format can't be told from the temporary file's extension
+    bool apng = string_ends_with(output_file, ".apng") || string_ends_with(output_file, ".png");
+    const char* magick_path = string_append_prefix(temp_path, apng ? "APNG:" : "GIF:");
+
+    MagickWand* wand = magick_wand_acquire();
     MagickSetSize(wand, frames.width, frames.height);
 
+    // Not needed for .apng
+    int delay = apng ? 0 : GIF_FRAME_DELAY;
     for (size_t i = 0; i < frames.frames_count; ++i) {
-        MagickWand* frame_wand = NewMagickWand();
-        MagickSetSize(frame_wand, frames.width, frames.height);
-        MagickSetImageAlphaChannel(frame_wand, TransparentAlphaChannel);
-        MagickReadImage(frame_wand, "xc:none");
-
-        MagickBooleanType import_status = MagickImportImagePixels(frame_wand,
-                                                                  0, 0, frames.width, frames.height,
-                                                                  "RGBA", CharPixel,
-                                                                  frames.frames[i]);
-
-        if (import_status != MagickTrue) {
-            magick_log_wand_exception(frame_wand);
-            DestroyMagickWand(frame_wand);
-            DestroyMagickWand(wand);
-            MagickWandTerminus();
+        if (gif_save_cancelled(cancel)
+            || !gif_magick_add_frame(wand, frames.frames[i], frames.width, frames.height, delay, reverse)) {
+            magick_wand_release(wand);
             return false;
         }
+    }
 
-        // Not needed for .apng
-        if (string_ends_with(output_file, ".gif")) {
-            MagickSetImageDelay(frame_wand, 4);
-        }
+    MagickSetOption(wand, "loop", "0");
 
-        MagickAddImage(wand, frame_wand);
-        if (reverse)
-            MagickSetIteratorIndex(wand, 0);
-        else
-            MagickSetLastIterator(wand);
+    bool ok = MagickWriteImages(wand, magick_path, MagickTrue) == MagickTrue;
+    if (!ok)
+        magick_log_wand_exception(wand);
+    magick_wand_release(wand);
 
-        frame_wand = DestroyMagickWand(frame_wand);
+    if (!gif_temp_finish(temp_path, output_file, ok)) {
+        fprintf(stderr, "ERROR: could not write file `%s`\n", output_file);
+        return false;
     }
 
-    MagickSetOption(wand, "loop", "0");
+    printf("Saved GIF file `%s`\n", output_file);
 
-    if (MagickWriteImages(wand, output_file, MagickTrue) != MagickTrue) {
-        magick_log_wand_exception(wand);
-        DestroyMagickWand(wand);
-        MagickWandTerminus();
+    return true;
+}
+
+bool gif_save(GifFrames frames, const char* output_file, bool reverse, const GifSaveCancel* cancel)
+{
+    TRACE_SCOPE("gif_save");
+    pthread_once(&gif_once, gif_init);
+
+    char* temp_path = gif_temp_path(output_file);
+    if (temp_path == NULL)
         return false;
+
+    bool saved;
+    bool apng = string_ends_with(output_file, ".apng") || string_ends_with(output_file, ".png");
+    if (!gif_use_magick && string_ends_with(output_file, ".gif"))
+        saved = gif_save_native(frames, output_file, temp_path, reverse, cancel);
+    else if (!gif_use_magick && apng)
+        saved = apng_save_native(frames, output_file, temp_path, reverse, cancel);
+    else
+        saved = gif_save_magick(frames, output_file, temp_path, reverse, cancel);
+
+    free(temp_path);
+    return saved;
+}
+
+struct GifStream {
+    char* output_file;
+    // Written until the stream is closed
+    char* temp_path;
+    int width;
+    int height;
+
+    // Native encoders, one of them
+    GifEncoder* gif_encoder;
+    ApngEncoder* apng_encoder;
+    FrameStream* frames;
+
+    // ImageMagick fallback
+    MagickWand* wand;
+    uint8_t* canvas;
+};
+
+static void gif_stream_add_gif_frame(void* encoder, const OptimizedFrame* frame)
+{
+    gif_encoder_add_frame(encoder, frame);
+}
+
+static void gif_stream_wait_gif(void* encoder, size_t frames_count)
+{
+    gif_encoder_wait(encoder, frames_count);
+}
+
+static void gif_stream_add_apng_frame(void* encoder, const OptimizedFrame* frame)
+{
+    apng_encoder_add_frame(encoder, frame);
+}
+
+static void gif_stream_wait_apng(void* encoder, size_t frames_count)
+{
+    apng_encoder_wait(encoder, frames_count);
+}
+
+GifStream* gif_stream_open(const char* output_file, int width, int height, GifFrames samples)
+{
+    pthread_once(&gif_once, gif_init);
+
+    bool gif = string_ends_with(output_file, ".gif");
+    bool apng = string_ends_with(output_file, ".apng") || string_ends_with(output_file, ".png");
+
+    GifStream* stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        return NULL;
+    stream->output_file = strdup(output_file);
+    stream->temp_path = gif_temp_path(output_file);
+    stream->width = width;
+    stream->height = height;
+    if (stream->output_file == NULL || stream->temp_path == NULL) {
+        free(stream->temp_path);
+        free(stream->output_file);
+        free(stream);
+        return NULL;
     }
+    const char* temp_path = stream->temp_path;
 
-    DestroyMagickWand(wand);
+    if (!gif_use_magick && gif) {
+        Palette palette;
+        if (gif_global_palette) {
+            palette_build(&palette, (const uint8_t* const*)samples.frames, samples.frames_count,
+                          (size_t)samples.width * samples.height, GIF_ALPHA_THRESHOLD);
+        }
 
-    MagickWandTerminus();
+        stream->gif_encoder = gif_encoder_open(temp_path, width, height, gif_global_palette ? &palette : NULL);
+        if (stream->gif_encoder) {
+            FrameOptimizeOptions options = { .alpha_threshold = GIF_ALPHA_THRESHOLD, .clear_on_loop = true };
+            FrameSink sink = { gif_stream_add_gif_frame, gif_stream_wait_gif, stream->gif_encoder };
+            stream->frames = frame_stream_create(width, height, options, sink);
+            if (stream->frames == NULL) {
+                gif_encoder_close(stream->gif_encoder);
+                remove(temp_path);
+            }
+        }
+    } else if (!gif_use_magick && apng) {
+        stream->apng_encoder = apng_encoder_open(temp_path, width, height, 0);
+        if (stream->apng_encoder) {
+            FrameSink sink = { gif_stream_add_apng_frame, gif_stream_wait_apng, stream->apng_encoder };
+            stream->frames = frame_stream_create(width, height, (FrameOptimizeOptions) { 0 }, sink);
+            if (stream->frames == NULL) {
+                apng_encoder_close(stream->apng_encoder);
+                remove(temp_path);
+            }
+        }
+    } else {
+        stream->wand = magick_wand_acquire();
+        MagickSetSize(stream->wand, width, height);
+        stream->canvas = malloc((size_t)width * height * 4);
+        if (stream->canvas == NULL) {
+            magick_wand_release(stream->wand);
+            stream->wand = NULL;
+        }
+    }
 
-    printf("Saved GIF file `%s`\n", output_file);
+    if (stream->frames == NULL && stream->wand == NULL) {
+        fprintf(stderr, "ERROR: could not create file `%s`: %s\n", output_file, strerror(errno));
+        free(stream->temp_path);
+        free(stream->output_file);
+        free(stream);
+        return NULL;
+    }
 
-    return true;
+    return stream;
+}
+
+uint8_t* gif_stream_canvas(GifStream* stream)
+{
+    return stream->frames ? frame_stream_canvas(stream->frames) : stream->canvas;
+}
+
+bool gif_stream_push(GifStream* stream, int delay)
+{
+    if (stream->frames) {
+        frame_stream_push(stream->frames, delay);
+        return true;
+    }
+
+    return gif_magick_add_frame(stream->wand, stream->canvas, stream->width, stream->height, delay, false);
+}
+
+static void gif_stream_free(GifStream* stream)
+{
+    frame_stream_destroy(stream->frames);
+    free(stream->canvas);
+    free(stream->temp_path);
+    free(stream->output_file);
+    free(stream);
+}
+
+bool gif_stream_close(GifStream* stream)
+{
+    TRACE_SCOPE("gif_save");
+
+    bool ok;
+    const char* kind = "GIF";
+    if (stream->gif_encoder) {
+        frame_stream_finish(stream->frames);
+        ok = gif_encoder_close(stream->gif_encoder);
+    } else if (stream->apng_encoder) {
+        frame_stream_finish(stream->frames);
+        ok = apng_encoder_close(stream->apng_encoder);
+        kind = "APNG";
+    } else {
+        // The format can't be told from the temporary file's extension
+        bool apng = string_ends_with(stream->output_file, ".apng") || string_ends_with(stream->output_file, ".png");
+        const char* magick_path = string_append_prefix(stream->temp_path, apng ? "APNG:" : "GIF:");
+
+        MagickSetOption(stream->wand, "loop", "0");
+        ok = MagickWriteImages(stream->wand, magick_path, MagickTrue) == MagickTrue;
+        if (!ok)
+            magick_log_wand_exception(stream->wand);
+        magick_wand_release(stream->wand);
+    }
+
+    ok = gif_temp_finish(stream->temp_path, stream->output_file, ok);
+    if (ok)
+        printf("Saved %s file `%s`\n", kind, stream->output_file);
+    else
+        fprintf(stderr, "ERROR: could not write file `%s`\n", stream->output_file);
+
+    gif_stream_free(stream);
+
+    return ok;
+}
+
+void gif_stream_discard(GifStream* stream)
+{
+    // Waits for the frames being encoded, as they use the stream's canvases
+    if (stream->gif_encoder)
+        gif_encoder_close(stream->gif_encoder);
+    else if (stream->apng_encoder)
+        apng_encoder_close(stream->apng_encoder);
+    else
+        magick_wand_release(stream->wand);
+
+    remove(stream->temp_path);
+    gif_stream_free(stream);
 }
@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
     void** frames;
@@ -10,4 +11,38 @@ typedef struct {
     int height;
 } GifFrames;
 
-bool gif_save(GifFrames frames, const char* output_file, bool reverse);
+// In hundredths of a second
+#define GIF_FRAME_DELAY 4
+
+// Reversed animations keep their first frame first, followed by the rest
+// backwards. That's the order ImageMagick ends up with when every frame is
+// inserted after the first one.
+size_t gif_frame_index(size_t i, size_t frames_count, bool reverse);
+
+typedef struct {
+    // Polled between frames. Saving stops, and nothing is written, as soon as
+    // it returns true.
+    bool (*cancelled)(void* user_data);
+    void* user_data;
+} GifSaveCancel;
+
+// `cancel` may be NULL
+bool gif_save(GifFrames frames, const char* output_file, bool reverse, const GifSaveCancel* cancel);
+
+// Animation saved as its frames are produced, for animations too long to keep
+// in memory. Only the native encoders stream, the ImageMagick fallback still
+// gathers every frame before writing them.
+typedef struct GifStream GifStream;
+
+// The GIF palette is built from `samples`, which should hold the colors of
+// the whole animation. Returns NULL if the file can't be created.
+GifStream* gif_stream_open(const char* output_file, int width, int height, GifFrames samples);
+// Canvas to draw the next frame to, `width * height` RGBA pixels
+uint8_t* gif_stream_canvas(GifStream* stream);
+// Adds the frame drawn to the canvas, shown for `delay` hundredths of a second
+bool gif_stream_push(GifStream* stream, int delay);
+// Writes the remaining frames and moves the file in place of `output_file`.
+// Returns false if anything could not be written.
+bool gif_stream_close(GifStream* stream);
+// Stops writing and deletes the partial file, leaving `output_file` as it was
+void gif_stream_discard(GifStream* stream);
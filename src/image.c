@@ -0,0 +1,72 @@
+#include "image.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "decode_limits.h"
+#include "resize.h"
+#include "util/trace.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "external/stb_image.h"
+
+Image load_image(const char* filename)
+{
+    TRACE_SCOPE("load_image");
+
+    Image image = { 0 };
+    int channels;
+    if (stbi_info(filename, &image.width, &image.height, &channels)
+        && (size_t)image.width * image.height > DECODE_MAX_PIXELS) {
+        fprintf(stderr, "ERROR: `%s` is too big to decode\n", filename);
+        image.data = NULL;
+    } else {
+        image.data = stbi_load(filename, &image.width, &image.height, &channels, 4);
+    }
+    image.mipmaps = 1;
+    image.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+    return image;
+}
+
+Image load_image_fitted(const char* filename, int max_size)
+{
+    TRACE_SCOPE("load_image_fitted");
+
+    // The header tells whether the image fits without decoding it
+    int width, height, channels;
+    if (max_size <= 0 || !stbi_info(filename, &width, &height, &channels)
+        || (width <= max_size && height <= max_size))
+        return load_image(filename);
+
+    Image image = load_image(filename);
+    if (image.data == NULL)
+        return image;
+
+    // The longest side becomes `max_size`, the other one keeps the ratio
+    int new_width = max_size;
+    int new_height = max_size;
+    if (image.width > image.height)
+        new_height = ((int64_t)image.height * max_size + image.width / 2) / image.width;
+    else
+        new_width = ((int64_t)image.width * max_size + image.height / 2) / image.height;
+    if (new_width < 1)
+        new_width = 1;
+    if (new_height < 1)
+        new_height = 1;
+
+    void* pixels = malloc((size_t)new_width * new_height * 4);
+    if (pixels == NULL
+        || !image_resize(image.data, image.width, image.height, pixels, new_width, new_height,
+                         RESIZE_FILTER_LANCZOS)) {
+        fprintf(stderr, "ERROR: could not shrink `%s` to %dx%d\n", filename, new_width, new_height);
+        free(pixels);
+        pixels = NULL;
+    }
+
+    stbi_image_free(image.data);
+    image.data = pixels;
+    image.width = new_width;
+    image.height = new_height;
+    return image;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <raylib.h>
+
+// Loads the first frame of an image file as RGBA. `data` is NULL on failure.
+Image load_image(const char* filename);
+// Same as `load_image`, but images wider or taller than `max_size` are shrunk
+// once with the Lanczos filter to fit it, keeping their aspect ratio, so they
+// are exploded at the size they are delivered at. 0 keeps every size.
+Image load_image_fitted(const char* filename, int max_size);
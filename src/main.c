@@ -1,5 +1,5 @@
+#define _GNU_SOURCE
 #include <assert.h>
-#include <errno.h>
 #include <libgen.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -9,17 +9,20 @@
 #include <raylib.h>
 #include <raymath.h>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "external/stb_image.h"
-
-#define ARENA_IMPLEMENTATION
-#include "external/arena.h"
-
 #include "resources/font.h"
 
+#include "batch.h"
+#include "emoji.h"
 #include "explode.h"
-#include "gif_load.h"
+#include "generation.h"
+#include "overlay_pack.h"
+#include "util/arena_pool.h"
+#include "util/magick.h"
 #include "util/string.h"
+#include "util/trace.h"
+
+#define ARENA_IMPLEMENTATION
+#include "external/arena.h"
 
 #define BACKGROUND_COLOR GetColor(0x181818FF)
 #define HIGHLIGHTED_BACKGROUND_COLOR ColorBrightness(BACKGROUND_COLOR, .1f)
@@ -29,39 +32,36 @@
 #define BUTTON_SELECTED_INDICATOR_NORMAL_COLOR ColorBrightness(BUTTON_PRESSED_COLOR, .3f)
 #define BUTTON_SELECTED_INDICATOR_SELECTED_COLOR WHITE
 
-#define MIN_FONT_SIZE 8
-#define MAX_FONT_SIZE 80
-#define FONT_ARRAY_SIZE (MAX_FONT_SIZE - MIN_FONT_SIZE + 1)
-Font fonts[FONT_ARRAY_SIZE] = { 0 };
+// Fonts are only rasterized at these sizes, the first time text of that size
+// or smaller is drawn, and scaled down to the sizes in between
+const int font_sizes[] = { 8, 12, 16, 20, 24, 32, 40, 48, 64, 80 };
+#define FONT_SIZES_COUNT (sizeof(font_sizes) / sizeof(font_sizes[0]))
+Font fonts[FONT_SIZES_COUNT] = { 0 };
 
-void fonts_load()
+Font font_get(int font_size)
 {
-    for (size_t i = 0; i < FONT_ARRAY_SIZE; ++i) {
-        size_t font_size = MIN_FONT_SIZE + i;
-        fonts[i] = LoadFontFromMemory(".ttf", font_ttf_bytes, sizeof(font_ttf_bytes), font_size, NULL, 0);
+    size_t i = 0;
+    while (i + 1 < FONT_SIZES_COUNT && font_sizes[i] < font_size)
+        ++i;
+
+    if (fonts[i].texture.id == 0) {
+        fonts[i] = LoadFontFromMemory(".ttf", font_ttf_bytes, sizeof(font_ttf_bytes), font_sizes[i], NULL, 0);
+        SetTextureFilter(fonts[i].texture, TEXTURE_FILTER_BILINEAR);
     }
+    return fonts[i];
 }
 
 void fonts_unload()
 {
-    for (size_t i = 0; i < FONT_ARRAY_SIZE; ++i) {
-        UnloadFont(fonts[i]);
+    for (size_t i = 0; i < FONT_SIZES_COUNT; ++i) {
+        if (fonts[i].texture.id != 0)
+            UnloadFont(fonts[i]);
     }
 }
 
-Image load_image(const char* filename)
-{
-    Image image;
-    int channels;
-    image.data = stbi_load(filename, &image.width, &image.height, &channels, 4);
-    image.mipmaps = 1;
-    image.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-    return image;
-}
-
 void draw_text_centered_area(const char* text, int font_size, int y, Rectangle area)
 {
-    const Font font = fonts[(size_t)(Clamp(font_size, MIN_FONT_SIZE, MAX_FONT_SIZE) - MIN_FONT_SIZE)];
+    const Font font = font_get(font_size);
 
     const int font_spacing = 2;
 
@@ -92,43 +92,73 @@ void draw_text_centered(const char* text, int font_size, int y)
 
 typedef struct {
     Texture* textures;
+    // Time at which each frame stops being shown, in seconds
+    float* ends;
     size_t count;
 } Textures;
 
-Textures textures_from_gif(const char* input_path)
+Textures textures_from_animation(const ExplodeAnimation* animation)
 {
-    GifFramesInfo frames_info = gif_get_frames_info(input_path);
-    printf("GIF info:\n");
-    printf("  > Frame count: %zu\n", frames_info.count);
-    printf("  > Frame width: %d\n", frames_info.width);
-    printf("  > Frame height: %d\n", frames_info.height);
+    TRACE_SCOPE("texture_upload");
 
-    Arena arena = { 0 };
+    GifFrames frames = explode_animation_frames(animation);
 
-    void** frames = arena_alloc(&arena, sizeof(void*) * frames_info.count);
-    for (size_t i = 0; i < frames_info.count; ++i) {
-        frames[i] = arena_alloc(&arena, frames_info.width * frames_info.height * sizeof(uint32_t));
+    Textures textures = { 0 };
+    textures.textures = malloc(sizeof(*textures.textures) * frames.frames_count);
+    textures.ends = malloc(sizeof(*textures.ends) * frames.frames_count);
+
+    for (size_t i = 0; i < frames.frames_count; ++i) {
+        textures.textures[i] = LoadTextureFromImage((Image) {
+            .data = frames.frames[i],
+            .width = frames.width,
+            .height = frames.height,
+            .mipmaps = 1,
+            .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+        });
+        textures.ends[i] = (i + 1) * GIF_FRAME_DELAY / 100.f;
     }
-    gif_load(input_path, frames, frames_info.count);
+    textures.count = frames.frames_count;
+
+    return textures;
+}
+
+// Uploads the animation read back by the generation, for the inputs that
+// were saved as they were exploded
+Textures textures_from_saved_frames(const GenerationFrames* saved)
+{
+    TRACE_SCOPE("texture_upload");
 
     Textures textures = { 0 };
-    textures.count = frames_info.count;
-    textures.textures = malloc(sizeof(*textures.textures) * frames_info.count);
-    for (size_t i = 0; i < frames_info.count; ++i) {
+    if (saved->count == 0)
+        return textures;
+
+    textures.textures = malloc(sizeof(*textures.textures) * saved->count);
+    textures.ends = malloc(sizeof(*textures.ends) * saved->count);
+
+    for (size_t i = 0; i < saved->count; ++i) {
         textures.textures[i] = LoadTextureFromImage((Image) {
-            .data = frames[i],
-            .width = frames_info.width,
-            .height = frames_info.height,
+            .data = saved->frames[i],
+            .width = saved->width,
+            .height = saved->height,
             .mipmaps = 1,
             .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
         });
+        textures.ends[i] = saved->ends[i];
     }
-
-    arena_free(&arena);
+    textures.count = saved->count;
 
     return textures;
 }
 
+// Frame shown `time` seconds into the animation
+Texture textures_frame_at(Textures textures, float time)
+{
+    size_t i = 0;
+    while (i + 1 < textures.count && time >= textures.ends[i])
+        i++;
+    return textures.textures[i];
+}
+
 void textures_destroy(Textures textures)
 {
     for (size_t i = 0; i < textures.count; ++i) {
@@ -136,6 +166,8 @@ void textures_destroy(Textures textures)
     }
     if (textures.textures)
         free(textures.textures);
+    if (textures.ends)
+        free(textures.ends);
 }
 
 int selector(const char* options[], size_t options_count, size_t option_selected,
@@ -205,32 +237,36 @@ int selector(const char* options[], size_t options_count, size_t option_selected
     return Clamp(clicked_option, -1, options_count);
 }
 
-typedef enum {
-    EMOJI_KIND_EXPLODE = 0,
-    EMOJI_KIND_IMPLODE,
-    COUNT_EMOJI_KINDS,
-} EmojiKind;
+int main(int argc, char** argv)
+{
+    trace_start_from_env();
 
-typedef enum {
-    EMOJI_FORMAT_GIF = 0,
-    EMOJI_FORMAT_PNG,
-    COUNT_EMOJI_FORMATS,
-} EmojiFormat;
+    // Without the pack the overlay frames are loaded and resized instead, but
+    // the warning should come first
+    overlay_pack_load();
+
+    if (argc > 1)
+        return batch_main(argc, argv);
 
-int main(void)
-{
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(800, 600, "Explode Generator");
 
-    fonts_load();
-
     bool emoji_customized = false;
     EmojiFormat emoji_format = EMOJI_FORMAT_PNG;
     EmojiKind emoji_kind = EMOJI_KIND_EXPLODE;
 
     Textures animation_frames = { 0 };
 
+    // Job of the latest dropped file
+    Generation* generation = NULL;
+    GenerationStage generation_stage = GENERATION_STAGE_LOAD;
+    // Cancelled jobs, freed once their worker returns
+    Generation** retired_generations = NULL;
+    size_t retired_generations_count = 0;
+
     char* animation_path = NULL;
+    bool animation_saved = false;
+    bool animation_failed = false;
 
     double gif_animation_duration = 0;
     double gif_animation_start = 0;
@@ -320,60 +356,69 @@ int main(void)
 
         FilePathList dropped_files = LoadDroppedFiles();
         if (dropped_files.count > 0) {
-            // Draw loading text
-            draw_text_centered("Loading...", 40, 0);
-            EndDrawing();
-            BeginDrawing();
-
             // Get input and output path
             const char* input_path = dropped_files.paths[0];
-            const char* output_path;
-            switch (emoji_format) {
-            case EMOJI_FORMAT_GIF:
-                output_path = string_append_prefix("_out.gif", input_path);
-                break;
-            case EMOJI_FORMAT_PNG:
-                output_path = string_append_prefix("_out.png", input_path);
-                break;
-            default:
-                output_path = string_append_prefix("_out.png", input_path);
+            const char* output_path = string_append_prefix(emoji_format_suffix(emoji_format), input_path);
+
+            // Drop the job in progress, its worker stops at the next stage
+            if (generation != NULL) {
+                generation_cancel(generation);
+                retired_generations = realloc(retired_generations,
+                                              sizeof(*retired_generations) * (retired_generations_count + 1));
+                retired_generations[retired_generations_count++] = generation;
             }
 
-            // Generate the gif
-            {
-                Image exploding_image = load_image(input_path);
-                if (exploding_image.data == NULL) {
-                    fprintf(stderr, "ERROR: failed to load file `%s`: %s\n", input_path, strerror(errno));
-                    goto continue_after_dropped_files;
-                }
+            generation = generation_start(input_path, output_path, emoji_kind_reverse(emoji_kind));
+            generation_stage = GENERATION_STAGE_LOAD;
 
-                bool reverse_gif;
-                switch (emoji_kind) {
-                case EMOJI_KIND_EXPLODE:
-                    reverse_gif = false;
-                    break;
-                case EMOJI_KIND_IMPLODE:
-                    reverse_gif = true;
-                    break;
-                default:
-                    reverse_gif = false;
-                }
-                image_to_explode_gif(exploding_image, output_path, reverse_gif);
+            textures_destroy(animation_frames);
+            animation_frames = (Textures) { 0 };
+            free(animation_path);
+            animation_path = strdup(basename((char*)output_path));
+            animation_saved = false;
+            animation_failed = generation == NULL;
+        }
+        UnloadDroppedFiles(dropped_files);
 
-                UnloadImage(exploding_image);
-            }
+        /*                                  *
+         *   Update: Generation progress    *
+         *                                  */
 
-            // Destroy old textures
-            textures_destroy(animation_frames);
+        GenerationEvent event;
+        while (generation != NULL && generation_poll(generation, &event)) {
+            switch (event.kind) {
+            case GENERATION_EVENT_STAGE:
+                generation_stage = event.stage;
+                break;
+            case GENERATION_EVENT_PREVIEW:
+                // Show the frames while they are being saved
+                animation_frames = textures_from_animation(generation_animation(generation));
+                gif_animation_start = GetTime();
+                gif_animation_duration = animation_frames.count ? animation_frames.ends[animation_frames.count - 1] : 0;
+                break;
+            case GENERATION_EVENT_DONE:
+            case GENERATION_EVENT_FAILED:
+                animation_saved = event.kind == GENERATION_EVENT_DONE;
+                animation_failed = !animation_saved;
+                if (animation_saved && animation_frames.count == 0) {
+                    animation_frames = textures_from_saved_frames(generation_saved_frames(generation));
+                    gif_animation_start = GetTime();
+                    gif_animation_duration = animation_frames.count ? animation_frames.ends[animation_frames.count - 1] : 0;
+                }
+                generation_destroy(generation);
+                generation = NULL;
+                break;
+            }
+        }
 
-            // Replace with new ones
-            animation_frames = textures_from_gif(output_path);
-            animation_path = basename((char*)output_path);
-            gif_animation_start = GetTime();
-            gif_animation_duration = animation_frames.count * 1.f / 25.f;
+        for (size_t i = 0; i < retired_generations_count;) {
+            if (generation_finished(retired_generations[i])) {
+                generation_destroy(retired_generations[i]);
+                retired_generations[i] = retired_generations[--retired_generations_count];
+            } else {
+                i++;
+            }
         }
-    continue_after_dropped_files:
-        UnloadDroppedFiles(dropped_files);
 
         /*          *
          *   Draw   *
@@ -381,20 +426,22 @@ int main(void)
 
         if (animation_frames.count != 0) {
             // Draw text
-            draw_text_centered("Image generated!", text_big_size, text_padding);
+            draw_text_centered(animation_saved ? "Image generated!"
+                                   : animation_failed ? "Failed to save image!"
+                                                      : "Saving...",
+                               text_big_size, text_padding);
             draw_text_centered(TextFormat("Image path: %s", animation_path), text_small_size,
                                text_padding + text_big_size + 3);
             draw_text_centered("Drag & Drop to generate a new image!", text_medium_size,
                                GetScreenHeight() - text_padding - text_medium_size);
 
             // Get animation frame
-            float gif_animation_factor = (GetTime() - gif_animation_start) / gif_animation_duration;
-            if (gif_animation_factor >= 1) {
+            float gif_animation_time = GetTime() - gif_animation_start;
+            if (gif_animation_time >= gif_animation_duration) {
                 gif_animation_start = GetTime();
-                gif_animation_factor = 0;
+                gif_animation_time = 0;
             }
-            Texture animation_frame
-                = animation_frames.textures[(int)floorf(gif_animation_factor * animation_frames.count)];
+            Texture animation_frame = textures_frame_at(animation_frames, gif_animation_time);
 
             // Draw frame background
             const float frame_background_padding = 10.f;
@@ -425,6 +472,25 @@ int main(void)
                            (Vector2) { 0 },
                            0.0f, WHITE);
 
+        } else if (generation != NULL) {
+            draw_text_centered(TextFormat("%s...", generation_stage_name(generation_stage)), 40, 0);
+
+            // One step per stage, and one for uploading the preview
+            const float progress_width = 400;
+            const float progress_height = 10;
+            Rectangle progress_area = {
+                .x = GetScreenWidth() / 2.f - progress_width / 2.f,
+                .y = GetScreenHeight() / 2.f + 40,
+                .width = progress_width,
+                .height = progress_height,
+            };
+            DrawRectangleRounded(progress_area, 1.f, 10, HIGHLIGHTED_BACKGROUND_COLOR);
+            progress_area.width *= (float)(generation_stage + 1) / (COUNT_GENERATION_STAGES + 1);
+            DrawRectangleRounded(progress_area, 1.f, 10, BUTTON_SELECTED_INDICATOR_SELECTED_COLOR);
+        } else if (animation_failed) {
+            draw_text_centered("Failed to generate image!", 40, 0);
+            draw_text_centered("Drag & Drop to try another image!", text_medium_size,
+                               GetScreenHeight() - text_padding - text_medium_size);
         } else {
             draw_text_centered("Drag & Drop some image!", 40, 0);
         }
@@ -433,10 +499,18 @@ int main(void)
     }
 
     textures_destroy(animation_frames);
+    free(animation_path);
+    generation_destroy(generation);
+    for (size_t i = 0; i < retired_generations_count; ++i)
+        generation_destroy(retired_generations[i]);
+    free(retired_generations);
 
     fonts_unload();
 
     CloseWindow();
 
+    arena_pool_trim();
+    magick_runtime_shutdown();
+
     return 0;
 }
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include "overlay_cache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "overlay_pack.h"
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+#define OVERLAY_CACHE_DEFAULT_LIMIT_MB 64
+#define OVERLAY_SPILL_MAGIC 0x4f564c31 // "OVL1"
+
+typedef struct {
+    size_t index;
+    void* output;
+    int width;
+    int height;
+    ResizeFilter filter;
+    bool ok;
+} OverlayResizeTask;
+
+typedef struct {
+    OverlaySource source;
+    void* output;
+    int width;
+    int height;
+    ResizeFilter filter;
+    int y_begin;
+    int y_end;
+    bool ok;
+} OverlayBandTask;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t filter;
+    uint32_t frames_count;
+} OverlaySpillHeader;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// Most recently used entry first
+static OverlayFrames* cache_head = NULL;
+static OverlayFrames* cache_tail = NULL;
+static size_t cache_size = 0;
+static size_t cache_limit = (size_t)OVERLAY_CACHE_DEFAULT_LIMIT_MB * 1024 * 1024;
+static char* cache_spill_dir = NULL;
+
+static void overlay_cache_init(void)
+{
+    const char* limit_mb = getenv("EXPLODE_OVERLAY_CACHE_MB");
+    if (limit_mb != NULL)
+        cache_limit = strtoull(limit_mb, NULL, 10) * 1024 * 1024;
+
+    const char* spill_dir = getenv("EXPLODE_OVERLAY_CACHE_DIR");
+    if (spill_dir != NULL && *spill_dir != '\0')
+        cache_spill_dir = strdup(spill_dir);
+}
+
+void overlay_sources(OverlaySource sources[OVERLAY_FRAMES_COUNT])
+{
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i) {
+        if (!overlay_pack_source(i, &sources[i].data, &sources[i].width, &sources[i].height))
+            sources[i] = (OverlaySource) { 0 };
+    }
+}
+
+static void overlay_resize_task(void* arg)
+{
+    OverlayResizeTask* task = arg;
+    task->ok = overlay_pack_read(task->index, task->output, task->width, task->height, task->filter);
+    if (task->ok)
+        return;
+
+    OverlaySource source;
+    task->ok = overlay_pack_source(task->index, &source.data, &source.width, &source.height)
+        && image_resize(source.data, source.width, source.height,
+                        task->output, task->width, task->height, task->filter);
+}
+
+// Returns false if any frame could not be resized
+static bool overlay_resize_all(OverlayFrames* entry)
+{
+    OverlayResizeTask tasks[OVERLAY_FRAMES_COUNT];
+
+    ThreadPool* pool = thread_pool_global();
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i) {
+        tasks[i] = (OverlayResizeTask) {
+            .index = i,
+            .output = entry->frames[i],
+            .width = entry->width,
+            .height = entry->height,
+            .filter = entry->filter,
+        };
+        thread_pool_group_submit(pool, &group, overlay_resize_task, &tasks[i]);
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+
+    bool ok = true;
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i)
+        ok = ok && tasks[i].ok;
+    return ok;
+}
+
+static void overlay_band_task(void* arg)
+{
+    OverlayBandTask* task = arg;
+    task->ok = image_resize_native_rows(task->source.data, task->source.width, task->source.height,
+                                        task->output, task->width, task->height, task->filter,
+                                        task->y_begin, task->y_end);
+}
+
+bool overlay_resize_frame(size_t index, void* output, int width, int height, ResizeFilter filter)
+{
+    TRACE_SCOPE("overlay_resize_frame");
+
+    if (overlay_pack_read(index, output, width, height, filter))
+        return true;
+
+    OverlaySource source;
+    if (!overlay_pack_source(index, &source.data, &source.width, &source.height))
+        return false;
+
+    size_t tasks_count = thread_pool_cpu_count();
+    if (tasks_count > (size_t)height)
+        tasks_count = height;
+    int band_rows = (height + tasks_count - 1) / tasks_count;
+
+    OverlayBandTask* tasks = calloc(tasks_count, sizeof(*tasks));
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    for (size_t i = 0; i < tasks_count; ++i) {
+        int y = i * band_rows;
+        tasks[i] = (OverlayBandTask) {
+            .source = source,
+            .output = output,
+            .width = width,
+            .height = height,
+            .filter = filter,
+            .y_begin = y < height ? y : height,
+            .y_end = y + band_rows < height ? y + band_rows : height,
+        };
+        thread_pool_group_submit(thread_pool_global(), &group, overlay_band_task, &tasks[i]);
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+
+    bool ok = true;
+    for (size_t i = 0; i < tasks_count; ++i)
+        ok = ok && tasks[i].ok;
+    free(tasks);
+
+    return ok;
+}
+
+static char* overlay_spill_path(const char* dir, int width, int height, ResizeFilter filter)
+{
+    char* path = NULL;
+    if (asprintf(&path, "%s/overlay_%dx%d_%d.rgba", dir, width, height, (int)filter) < 0)
+        return NULL;
+    return path;
+}
+
+static bool overlay_spill_read(const char* dir, OverlayFrames* entry)
+{
+    char* path = overlay_spill_path(dir, entry->width, entry->height, entry->filter);
+    if (path == NULL)
+        return false;
+
+    FILE* file = fopen(path, "rb");
+    free(path);
+    if (file == NULL)
+        return false;
+
+    OverlaySpillHeader header;
+    size_t frame_size = (size_t)entry->width * entry->height * sizeof(uint32_t);
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == OVERLAY_SPILL_MAGIC
+        && header.width == (uint32_t)entry->width
+        && header.height == (uint32_t)entry->height
+        && header.filter == (uint32_t)entry->filter
+        && header.frames_count == OVERLAY_FRAMES_COUNT
+        && fread(entry->frames[0], frame_size, OVERLAY_FRAMES_COUNT, file) == OVERLAY_FRAMES_COUNT;
+
+    fclose(file);
+    return ok;
+}
+
+static void overlay_spill_write(const char* dir, const OverlayFrames* entry)
+{
+    char* path = overlay_spill_path(dir, entry->width, entry->height, entry->filter);
+    if (path == NULL)
+        return;
+
+    // Write to a temporary file first so readers never see a partial entry
+    char* temp_path = NULL;
+    if (asprintf(&temp_path, "%s.%p.tmp", path, (void*)entry) < 0) {
+        free(path);
+        return;
+    }
+
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "WARNING: could not spill overlay cache entry to `%s`\n", temp_path);
+        free(temp_path);
+        free(path);
+        return;
+    }
+
+    OverlaySpillHeader header = {
+        .magic = OVERLAY_SPILL_MAGIC,
+        .width = entry->width,
+        .height = entry->height,
+        .filter = entry->filter,
+        .frames_count = OVERLAY_FRAMES_COUNT,
+    };
+    size_t frame_size = (size_t)entry->width * entry->height * sizeof(uint32_t);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(entry->frames[0], frame_size, OVERLAY_FRAMES_COUNT, file) == OVERLAY_FRAMES_COUNT;
+
+    if (fclose(file) != 0 || !ok || rename(temp_path, path) != 0)
+        remove(temp_path);
+
+    free(temp_path);
+    free(path);
+}
+
+static void overlay_cache_unlink(OverlayFrames* entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache_head = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache_tail = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+static void overlay_cache_push_front(OverlayFrames* entry)
+{
+    entry->prev = NULL;
+    entry->next = cache_head;
+    if (cache_head)
+        cache_head->prev = entry;
+    cache_head = entry;
+    if (cache_tail == NULL)
+        cache_tail = entry;
+}
+
+// Must be called with the cache locked. Evicted entries are spilled after
+// unlocking, as writing them out may take a while.
+static OverlayFrames* overlay_cache_evict(void)
+{
+    OverlayFrames* evicted = NULL;
+
+    OverlayFrames* entry = cache_tail;
+    while (entry != NULL && cache_size > cache_limit) {
+        OverlayFrames* prev = entry->prev;
+        if (entry->users == 0) {
+            overlay_cache_unlink(entry);
+            cache_size -= entry->size;
+            entry->next = evicted;
+            evicted = entry;
+        }
+        entry = prev;
+    }
+
+    return evicted;
+}
+
+static void overlay_cache_dispose(OverlayFrames* evicted, const char* spill_dir)
+{
+    while (evicted != NULL) {
+        OverlayFrames* next = evicted->next;
+        if (spill_dir != NULL && !evicted->spilled
+            && !overlay_pack_has(evicted->width, evicted->height, evicted->filter))
+            overlay_spill_write(spill_dir, evicted);
+        free(evicted);
+        evicted = next;
+    }
+}
+
+OverlayFrames* overlay_cache_acquire(int width, int height, ResizeFilter filter)
+{
+    pthread_once(&cache_once, overlay_cache_init);
+
+    pthread_mutex_lock(&cache_mutex);
+
+    for (OverlayFrames* entry = cache_head; entry != NULL; entry = entry->next) {
+        if (entry->width != width || entry->height != height || entry->filter != filter)
+            continue;
+
+        entry->users++;
+        overlay_cache_unlink(entry);
+        overlay_cache_push_front(entry);
+
+        // Another thread may still be filling it in
+        while (entry->frames[0] == NULL && !entry->failed)
+            pthread_cond_wait(&cache_loaded, &cache_mutex);
+
+        if (entry->failed) {
+            // Already out of the list, the last one to leave frees it
+            bool last = --entry->users == 0;
+            pthread_mutex_unlock(&cache_mutex);
+            if (last)
+                free(entry);
+            return NULL;
+        }
+
+        pthread_mutex_unlock(&cache_mutex);
+        return entry;
+    }
+
+    size_t frame_size = (size_t)width * height * sizeof(uint32_t);
+    OverlayFrames* entry = malloc(sizeof(*entry) + frame_size * OVERLAY_FRAMES_COUNT);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+    *entry = (OverlayFrames) {
+        .width = width,
+        .height = height,
+        .filter = filter,
+        .size = frame_size * OVERLAY_FRAMES_COUNT,
+        .users = 1,
+    };
+    overlay_cache_push_front(entry);
+    cache_size += entry->size;
+
+    char* spill_dir = cache_spill_dir ? strdup(cache_spill_dir) : NULL;
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    // Frames are only published once filled in, so hits on this entry wait
+    void* frames[OVERLAY_FRAMES_COUNT];
+    unsigned char* data = (unsigned char*)(entry + 1);
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i)
+        frames[i] = data + i * frame_size;
+
+    OverlayFrames loading = *entry;
+    memcpy(loading.frames, frames, sizeof(frames));
+    // Sizes held by the pack are inflated from it rather than spilled
+    bool spilled = spill_dir != NULL && !overlay_pack_has(width, height, filter)
+        && overlay_spill_read(spill_dir, &loading);
+    bool ok = spilled || overlay_resize_all(&loading);
+
+    pthread_mutex_lock(&cache_mutex);
+    if (!ok) {
+        // Not cached, so the next acquire tries again
+        overlay_cache_unlink(entry);
+        cache_size -= entry->size;
+        entry->failed = true;
+        pthread_cond_broadcast(&cache_loaded);
+        bool last = --entry->users == 0;
+        pthread_mutex_unlock(&cache_mutex);
+
+        if (last)
+            free(entry);
+        free(spill_dir);
+        return NULL;
+    }
+    memcpy(entry->frames, frames, sizeof(frames));
+    entry->spilled = spilled;
+    pthread_cond_broadcast(&cache_loaded);
+    OverlayFrames* evicted = overlay_cache_evict();
+    pthread_mutex_unlock(&cache_mutex);
+
+    overlay_cache_dispose(evicted, spill_dir);
+    free(spill_dir);
+
+    return entry;
+}
+
+void overlay_cache_release(OverlayFrames* frames)
+{
+    pthread_mutex_lock(&cache_mutex);
+    frames->users--;
+    OverlayFrames* evicted = overlay_cache_evict();
+    char* spill_dir = evicted && cache_spill_dir ? strdup(cache_spill_dir) : NULL;
+    pthread_mutex_unlock(&cache_mutex);
+
+    overlay_cache_dispose(evicted, spill_dir);
+    free(spill_dir);
+}
+
+bool overlay_cache_keeps(int width, int height)
+{
+    pthread_once(&cache_once, overlay_cache_init);
+
+    size_t size = (size_t)width * height * sizeof(uint32_t) * OVERLAY_FRAMES_COUNT;
+    pthread_mutex_lock(&cache_mutex);
+    bool keeps = size <= cache_limit || cache_spill_dir != NULL;
+    pthread_mutex_unlock(&cache_mutex);
+    return keeps;
+}
+
+void overlay_cache_set_limit(size_t bytes)
+{
+    pthread_once(&cache_once, overlay_cache_init);
+
+    pthread_mutex_lock(&cache_mutex);
+    cache_limit = bytes;
+    OverlayFrames* evicted = overlay_cache_evict();
+    char* spill_dir = evicted && cache_spill_dir ? strdup(cache_spill_dir) : NULL;
+    pthread_mutex_unlock(&cache_mutex);
+
+    overlay_cache_dispose(evicted, spill_dir);
+    free(spill_dir);
+}
+
+void overlay_cache_set_spill_dir(const char* path)
+{
+    pthread_once(&cache_once, overlay_cache_init);
+
+    pthread_mutex_lock(&cache_mutex);
+    free(cache_spill_dir);
+    cache_spill_dir = path ? strdup(path) : NULL;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "resize.h"
+
+#define OVERLAY_FRAMES_COUNT 22
+
+// The explosion overlay resized to a given size. Entries are shared between
+// every conversion of that size and must not be modified.
+typedef struct OverlayFrames OverlayFrames;
+
+struct OverlayFrames {
+    int width;
+    int height;
+    ResizeFilter filter;
+    void* frames[OVERLAY_FRAMES_COUNT];
+
+    // Owned by the cache
+    size_t size;
+    size_t users;
+    bool spilled;
+    // The frames could not be resized, it's out of the cache and freed by its
+    // last user
+    bool failed;
+    OverlayFrames* prev;
+    OverlayFrames* next;
+};
+
+// An explosion overlay frame at its original size
+typedef struct {
+    void* data;
+    int width;
+    int height;
+} OverlaySource;
+
+// Inflated from the overlay pack on first use (see overlay_pack.h)
+void overlay_sources(OverlaySource sources[OVERLAY_FRAMES_COUNT]);
+
+// Returns the overlay frames resized to `width` x `height`, resizing them only
+// if they are not cached yet. Each call must be paired with
+// `overlay_cache_release`. Returns NULL if any frame can't be loaded or
+// resized, in which case nothing is cached.
+//
+// The cache is bounded by EXPLODE_OVERLAY_CACHE_MB megabytes (64 by default).
+// When EXPLODE_OVERLAY_CACHE_DIR is set, evicted entries are spilled there
+// and read back on the next miss instead of being resized again.
+OverlayFrames* overlay_cache_acquire(int width, int height, ResizeFilter filter);
+void overlay_cache_release(OverlayFrames* frames);
+// Whether the overlay of that size outlives its users, in the cache or
+// spilled. Bigger ones are evicted as soon as they are released, so
+// conversions that produce one frame at a time are better off resizing each
+// overlay frame as they need it (see `overlay_resize_frame`).
+bool overlay_cache_keeps(int width, int height);
+
+// Resizes overlay frame `index` straight to `output`, without going through
+// the cache, for sizes whose overlay is too big to keep. The frame is split
+// in bands of rows on the global thread pool, so it can't be called from one
+// of its tasks. It always uses the built-in resampler, as ImageMagick resizes
+// whole frames.
+bool overlay_resize_frame(size_t index, void* output, int width, int height, ResizeFilter filter);
+
+void overlay_cache_set_limit(size_t bytes);
+// NULL disables spilling
+void overlay_cache_set_spill_dir(const char* path);
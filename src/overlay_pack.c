@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include "overlay_pack.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "external/stb_image.h"
+#include "overlay_cache.h"
+#include "util/trace.h"
+
+// All are set by the build
+#ifndef OVERLAY_PACK_BUILD_PATH
+#define OVERLAY_PACK_BUILD_PATH "overlays.pack"
+#endif
+#ifndef OVERLAY_PACK_INSTALL_PATH
+#define OVERLAY_PACK_INSTALL_PATH "/usr/local/share/explode-generator/overlays.pack"
+#endif
+#ifndef OVERLAY_FRAMES_INSTALL_DIR
+#define OVERLAY_FRAMES_INSTALL_DIR "/usr/local/share/explode-generator"
+#endif
+
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+static bool pack_loaded = false;
+
+static const unsigned char* pack_data = NULL;
+// Converted from the little-endian entries of the file
+static OverlayPackEntry* pack_entries = NULL;
+static size_t pack_entries_count = 0;
+
+// Original frames, inflated or loaded on first use
+static void* pack_sources[OVERLAY_FRAMES_COUNT];
+static int pack_sources_widths[OVERLAY_FRAMES_COUNT];
+static int pack_sources_heights[OVERLAY_FRAMES_COUNT];
+static bool pack_sources_failed[OVERLAY_FRAMES_COUNT];
+static pthread_mutex_t pack_sources_mutexes[OVERLAY_FRAMES_COUNT] = {
+    [0 ... OVERLAY_FRAMES_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void overlay_pack_entry_from_le(OverlayPackEntry* entry)
+{
+    entry->index = le32toh(entry->index);
+    entry->width = le32toh(entry->width);
+    entry->height = le32toh(entry->height);
+    entry->original = le32toh(entry->original);
+    entry->offset = le64toh(entry->offset);
+    entry->size = le64toh(entry->size);
+}
+
+// Every frame must be there exactly once at its original size, and every
+// resampled size for all of the frames, or lookups would mix up frames
+static bool overlay_pack_entries_valid(const OverlayPackEntry* entries, size_t entries_count, size_t size)
+{
+    bool originals[OVERLAY_FRAMES_COUNT] = { 0 };
+    for (size_t i = 0; i < entries_count; ++i) {
+        const OverlayPackEntry* entry = &entries[i];
+        if (entry->index >= OVERLAY_FRAMES_COUNT
+            || entry->width == 0 || entry->width > INT32_MAX
+            || entry->height == 0 || entry->height > INT32_MAX
+            || entry->offset > size || entry->size > size - entry->offset)
+            return false;
+
+        if (entry->original) {
+            if (originals[entry->index])
+                return false;
+            originals[entry->index] = true;
+            continue;
+        }
+
+        size_t same_size = 0;
+        for (size_t j = 0; j < entries_count; ++j) {
+            const OverlayPackEntry* other = &entries[j];
+            if (other->original || other->width != entry->width || other->height != entry->height)
+                continue;
+            if (j != i && other->index == entry->index)
+                return false;
+            ++same_size;
+        }
+        if (same_size != OVERLAY_FRAMES_COUNT)
+            return false;
+    }
+
+    for (size_t i = 0; i < OVERLAY_FRAMES_COUNT; ++i) {
+        if (!originals[i])
+            return false;
+    }
+    return true;
+}
+
+static bool overlay_pack_map(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not open overlay pack `%s`: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(OverlayPackHeader))
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    OverlayPackEntry* entries = NULL;
+    size_t entries_count = 0;
+    if (data != MAP_FAILED) {
+        OverlayPackHeader header;
+        memcpy(&header, data, sizeof(header));
+        entries_count = le32toh(header.entries_count);
+        if (le32toh(header.magic) == OVERLAY_PACK_MAGIC
+            && le32toh(header.version) == OVERLAY_PACK_VERSION
+            && le32toh(header.frames_count) == OVERLAY_FRAMES_COUNT
+            && entries_count <= (st.st_size - sizeof(header)) / sizeof(OverlayPackEntry))
+            entries = malloc(entries_count * sizeof(*entries));
+    }
+    if (entries != NULL) {
+        memcpy(entries, (const unsigned char*)data + sizeof(OverlayPackHeader), entries_count * sizeof(*entries));
+        for (size_t i = 0; i < entries_count; ++i)
+            overlay_pack_entry_from_le(&entries[i]);
+    }
+
+    if (entries == NULL || !overlay_pack_entries_valid(entries, entries_count, st.st_size)) {
+        fprintf(stderr, "ERROR: `%s` is not a valid overlay pack\n", path);
+        free(entries);
+        if (data != MAP_FAILED)
+            munmap(data, st.st_size);
+        return false;
+    }
+
+    pack_data = data;
+    pack_entries = entries;
+    pack_entries_count = entries_count;
+    return true;
+}
+
+static const char* overlay_frames_dir(void)
+{
+    const char* dir = getenv("EXPLODE_OVERLAY_DIR");
+    return dir != NULL && *dir != '\0' ? dir : OVERLAY_FRAMES_INSTALL_DIR;
+}
+
+static void overlay_pack_init(void)
+{
+    TRACE_SCOPE("overlay_pack_load");
+
+    const char* path = getenv("EXPLODE_OVERLAY_PACK");
+    if (path != NULL && *path != '\0') {
+        pack_loaded = overlay_pack_map(path);
+    } else {
+        const char* paths[] = { OVERLAY_PACK_BUILD_PATH, OVERLAY_PACK_INSTALL_PATH };
+        for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]) && path == NULL; ++i) {
+            if (access(paths[i], R_OK) == 0) {
+                path = paths[i];
+                pack_loaded = overlay_pack_map(path);
+            }
+        }
+        if (path == NULL)
+            fprintf(stderr, "WARNING: could not find the overlay pack, set EXPLODE_OVERLAY_PACK to its path\n");
+    }
+
+    if (!pack_loaded)
+        fprintf(stderr, "WARNING: loading the overlay frames from `%s` instead\n", overlay_frames_dir());
+}
+
+bool overlay_pack_load(void)
+{
+    pthread_once(&pack_once, overlay_pack_init);
+    return pack_loaded;
+}
+
+static const OverlayPackEntry* overlay_pack_find(size_t index, int width, int height, bool original)
+{
+    if (!overlay_pack_load())
+        return NULL;
+
+    for (size_t i = 0; i < pack_entries_count; ++i) {
+        const OverlayPackEntry* entry = &pack_entries[i];
+        if (entry->index != index || (entry->original != 0) != original)
+            continue;
+        if (original || (entry->width == (uint32_t)width && entry->height == (uint32_t)height))
+            return entry;
+    }
+    return NULL;
+}
+
+static bool overlay_pack_inflate(const OverlayPackEntry* entry, void* output)
+{
+    TRACE_SCOPE("overlay_pack_inflate");
+
+    uLongf expected = (uLongf)entry->width * entry->height * sizeof(uint32_t);
+    uLongf size = expected;
+    return uncompress(output, &size, pack_data + entry->offset, entry->size) == Z_OK && size == expected;
+}
+
+// Without a pack, the frames are read from the PNG files they are made from
+static void* overlay_frame_load(size_t index, int* width, int* height)
+{
+    TRACE_SCOPE("overlay_frame_load");
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/explode_frame_%02zu.png", overlay_frames_dir(), index);
+
+    int channels;
+    void* data = stbi_load(path, width, height, &channels, 4);
+    if (data == NULL)
+        fprintf(stderr, "ERROR: could not load overlay frame `%s`: %s\n", path, stbi_failure_reason());
+    return data;
+}
+
+bool overlay_pack_source(size_t index, void** data, int* width, int* height)
+{
+    const OverlayPackEntry* entry = overlay_pack_find(index, 0, 0, true);
+    if (entry == NULL && pack_loaded)
+        return false;
+
+    pthread_mutex_lock(&pack_sources_mutexes[index]);
+    // Only tried once, so a missing frame is reported once
+    if (pack_sources[index] == NULL && !pack_sources_failed[index]) {
+        void* source = NULL;
+        int source_width, source_height;
+        if (entry != NULL) {
+            source_width = entry->width;
+            source_height = entry->height;
+            source = malloc((size_t)source_width * source_height * sizeof(uint32_t));
+            if (source != NULL && !overlay_pack_inflate(entry, source)) {
+                free(source);
+                source = NULL;
+            }
+        } else {
+            source = overlay_frame_load(index, &source_width, &source_height);
+        }
+
+        if (source != NULL) {
+            pack_sources[index] = source;
+            pack_sources_widths[index] = source_width;
+            pack_sources_heights[index] = source_height;
+        } else {
+            pack_sources_failed[index] = true;
+        }
+    }
+    *data = pack_sources[index];
+    *width = pack_sources_widths[index];
+    *height = pack_sources_heights[index];
+    pthread_mutex_unlock(&pack_sources_mutexes[index]);
+
+    return *data != NULL;
+}
+
+bool overlay_pack_has(int width, int height, ResizeFilter filter)
+{
+    // The copies are made by the built-in resampler
+    return filter == RESIZE_FILTER_CUBIC && !image_resize_uses_magick()
+        && overlay_pack_find(0, width, height, false) != NULL;
+}
+
+bool overlay_pack_read(size_t index, void* output, int width, int height, ResizeFilter filter)
+{
+    if (filter != RESIZE_FILTER_CUBIC || image_resize_uses_magick())
+        return false;
+
+    const OverlayPackEntry* entry = overlay_pack_find(index, width, height, false);
+    return entry != NULL && overlay_pack_inflate(entry, output);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "resize.h"
+
+// The explosion overlay frames, packed at build time by `pack-overlays` into
+// `overlays.pack`: every frame at its original size, plus copies resampled
+// with the cubic filter to the sizes listed here. Each frame is a separate
+// zlib stream, so the pack is memory-mapped and frames are only inflated
+// when first needed.
+//
+// The pack is looked up at EXPLODE_OVERLAY_PACK, then in the build
+// directory, then where it is installed. Without it, the original frames are
+// loaded from `explode_frame_NN.png` files in EXPLODE_OVERLAY_DIR (by default
+// the directory the pack is installed to) and every size is resampled.
+
+#define OVERLAY_PACK_MAGIC 0x504c564f // "OVLP"
+#define OVERLAY_PACK_VERSION 1
+#define OVERLAY_PACK_SIZES_COUNT 7
+
+// Square sizes of the pre-resampled copies
+static const int overlay_pack_sizes[OVERLAY_PACK_SIZES_COUNT] = { 32, 48, 64, 96, 128, 256, 512 };
+
+// The file starts with a header followed by `entries_count` entries, in
+// little-endian byte order
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frames_count;
+    uint32_t entries_count;
+} OverlayPackHeader;
+
+typedef struct {
+    uint32_t index;
+    uint32_t width;
+    uint32_t height;
+    // 1 for the frame at its original size
+    uint32_t original;
+    // Of the zlib stream, from the start of the file
+    uint64_t offset;
+    uint64_t size;
+} OverlayPackEntry;
+
+// Maps the pack, warning if it can't be found, and returns whether it could.
+// Called at startup so the warning comes before any conversion.
+bool overlay_pack_load(void);
+
+// Overlay frame `index` at its original size, inflated or loaded on first
+// use and kept for the rest of the process
+bool overlay_pack_source(size_t index, void** data, int* width, int* height);
+
+// Whether the pack holds the overlay resampled to exactly `width` x `height`
+// the way `image_resize` would, so the frames can be inflated instead
+bool overlay_pack_has(int width, int height, ResizeFilter filter);
+// Inflates overlay frame `index` resampled to `width` x `height` into
+// `output`, or returns false if the pack doesn't hold that size
+bool overlay_pack_read(size_t index, void* output, int width, int height, ResizeFilter filter);
@@ -0,0 +1,371 @@
+#include "palette.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "util/thread_pool.h"
+#include "util/trace.h"
+
+// Amplitude of the ordered dithering, roughly the distance between
+// neighbouring colors of a 256 colors palette.
+#define PALETTE_DITHER_SPREAD 16
+// Cells of the lookup table resolved per task
+#define PALETTE_MAP_TASK_CELLS 4096
+
+typedef struct {
+    uint32_t color; // 5-5-5 histogram cell
+    uint64_t count;
+} PaletteEntry;
+
+typedef struct {
+    size_t begin;
+    size_t end;
+    uint64_t count;
+} PaletteBox;
+
+// 8x8 Bayer matrix
+static const uint8_t palette_bayer[8][8] = {
+    { 0, 32, 8, 40, 2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44, 4, 36, 14, 46, 6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    { 3, 35, 11, 43, 1, 33, 9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47, 7, 39, 13, 45, 5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/*                                    *
+ *   Histogram and median cut         *
+ *                                    */
+
+static inline int palette_cell_axis(uint32_t cell, int axis)
+{
+    return (cell >> ((2 - axis) * PALETTE_HISTOGRAM_BITS)) & ((1 << PALETTE_HISTOGRAM_BITS) - 1);
+}
+
+void palette_histogram_add(PaletteHistogram* histogram, const uint8_t* pixels, size_t pixels_count,
+                           uint8_t alpha_threshold)
+{
+    for (size_t i = 0; i < pixels_count; ++i) {
+        const uint8_t* pixel = &pixels[i * 4];
+        if (pixel[3] < alpha_threshold)
+            continue;
+        uint32_t cell = palette_cell(pixel[0], pixel[1], pixel[2]);
+        histogram->counts[cell]++;
+        for (int c = 0; c < 3; ++c)
+            histogram->sums[cell][c] += pixel[c];
+    }
+}
+
+// Counting sort of entries [begin, end) by one channel
+static void palette_sort(PaletteEntry* entries, PaletteEntry* scratch, size_t begin, size_t end, int axis)
+{
+    size_t offsets[(1 << PALETTE_HISTOGRAM_BITS) + 1] = { 0 };
+    for (size_t i = begin; i < end; ++i)
+        offsets[palette_cell_axis(entries[i].color, axis) + 1]++;
+    for (int i = 1; i <= (1 << PALETTE_HISTOGRAM_BITS); ++i)
+        offsets[i] += offsets[i - 1];
+
+    for (size_t i = begin; i < end; ++i)
+        scratch[offsets[palette_cell_axis(entries[i].color, axis)]++] = entries[i];
+    memcpy(&entries[begin], scratch, (end - begin) * sizeof(*entries));
+}
+
+static int palette_box_longest_axis(const PaletteEntry* entries, PaletteBox box)
+{
+    int min[3] = { 255, 255, 255 };
+    int max[3] = { 0, 0, 0 };
+    for (size_t i = box.begin; i < box.end; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+            int value = palette_cell_axis(entries[i].color, axis);
+            if (value < min[axis])
+                min[axis] = value;
+            if (value > max[axis])
+                max[axis] = value;
+        }
+    }
+
+    int longest = 0;
+    for (int axis = 1; axis < 3; ++axis) {
+        if (max[axis] - min[axis] > max[longest] - min[longest])
+            longest = axis;
+    }
+    return longest;
+}
+
+void palette_from_histogram(Palette* palette, const PaletteHistogram* histogram, int max_colors)
+{
+    if (max_colors > PALETTE_MAX_COLORS - 1)
+        max_colors = PALETTE_MAX_COLORS - 1;
+
+    size_t entries_count = 0;
+    PaletteEntry* entries = malloc(PALETTE_HISTOGRAM_SIZE * sizeof(*entries));
+    PaletteEntry* scratch = malloc(PALETTE_HISTOGRAM_SIZE * sizeof(*scratch));
+    for (uint32_t i = 0; i < PALETTE_HISTOGRAM_SIZE; ++i) {
+        if (histogram->counts[i])
+            entries[entries_count++] = (PaletteEntry) { i, histogram->counts[i] };
+    }
+
+    PaletteBox boxes[PALETTE_MAX_COLORS];
+    int boxes_count = 0;
+
+    if (entries_count > 0) {
+        uint64_t count = 0;
+        for (size_t i = 0; i < entries_count; ++i)
+            count += entries[i].count;
+        boxes[boxes_count++] = (PaletteBox) { 0, entries_count, count };
+    }
+
+    while (boxes_count < max_colors) {
+        // Split the most populated box that still has more than one color
+        int selected = -1;
+        for (int i = 0; i < boxes_count; ++i) {
+            if (boxes[i].end - boxes[i].begin < 2)
+                continue;
+            if (selected < 0 || boxes[i].count > boxes[selected].count)
+                selected = i;
+        }
+        if (selected < 0)
+            break;
+
+        PaletteBox box = boxes[selected];
+        int axis = palette_box_longest_axis(entries, box);
+
+        palette_sort(entries, scratch, box.begin, box.end, axis);
+
+        uint64_t half = 0;
+        size_t split = box.begin;
+        while (split < box.end - 1 && half + entries[split].count <= box.count / 2)
+            half += entries[split++].count;
+        if (split == box.begin) {
+            half += entries[split].count;
+            split++;
+        }
+
+        boxes[selected] = (PaletteBox) { box.begin, split, half };
+        boxes[boxes_count++] = (PaletteBox) { split, box.end, box.count - half };
+    }
+
+    palette->count = 0;
+    for (int i = 0; i < boxes_count; ++i) {
+        uint64_t total[3] = { 0 };
+        uint64_t count = 0;
+        for (size_t j = boxes[i].begin; j < boxes[i].end; ++j) {
+            for (int c = 0; c < 3; ++c)
+                total[c] += histogram->sums[entries[j].color][c];
+            count += entries[j].count;
+        }
+        for (int c = 0; c < 3; ++c)
+            palette->colors[palette->count][c] = count ? (uint8_t)((total[c] + count / 2) / count) : 0;
+        palette->count++;
+    }
+
+    palette->transparent_index = palette->count++;
+    memset(palette->colors[palette->transparent_index], 0, 3);
+
+    free(scratch);
+    free(entries);
+}
+
+int palette_nearest(const Palette* palette, int r, int g, int b)
+{
+    int best = 0;
+    int best_distance = INT32_MAX;
+    for (int i = 0; i < palette->count; ++i) {
+        if (i == palette->transparent_index)
+            continue;
+        int dr = palette->colors[i][0] - r;
+        int dg = palette->colors[i][1] - g;
+        int db = palette->colors[i][2] - b;
+        int distance = dr * dr + dg * dg + db * db;
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+/*                                    *
+ *   Global palette                   *
+ *                                    */
+
+typedef struct {
+    PaletteHistogram histogram;
+    const uint8_t* const* frames;
+    size_t frames_count;
+    size_t pixels_count;
+    uint8_t alpha_threshold;
+    size_t first;
+    size_t step;
+} PaletteHistogramTask;
+
+static void palette_histogram_task(void* arg)
+{
+    PaletteHistogramTask* task = arg;
+    for (size_t i = task->first; i < task->frames_count; i += task->step)
+        palette_histogram_add(&task->histogram, task->frames[i], task->pixels_count, task->alpha_threshold);
+}
+
+void palette_build(Palette* palette, const uint8_t* const* frames, size_t frames_count,
+                   size_t pixels_count, uint8_t alpha_threshold)
+{
+    TRACE_SCOPE("palette_build");
+
+    // One histogram per worker rather than per frame, they are 1 MB each
+    size_t tasks_count = thread_pool_cpu_count();
+    if (tasks_count > frames_count)
+        tasks_count = frames_count;
+    if (tasks_count == 0)
+        tasks_count = 1;
+
+    PaletteHistogramTask* tasks = calloc(tasks_count, sizeof(*tasks));
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    for (size_t i = 0; i < tasks_count; ++i) {
+        tasks[i].frames = frames;
+        tasks[i].frames_count = frames_count;
+        tasks[i].pixels_count = pixels_count;
+        tasks[i].alpha_threshold = alpha_threshold;
+        tasks[i].first = i;
+        tasks[i].step = tasks_count;
+        thread_pool_group_submit(thread_pool_global(), &group, palette_histogram_task, &tasks[i]);
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+
+    PaletteHistogram* histogram = &tasks[0].histogram;
+    for (size_t i = 1; i < tasks_count; ++i) {
+        for (size_t cell = 0; cell < PALETTE_HISTOGRAM_SIZE; ++cell) {
+            histogram->counts[cell] += tasks[i].histogram.counts[cell];
+            for (int c = 0; c < 3; ++c)
+                histogram->sums[cell][c] += tasks[i].histogram.sums[cell][c];
+        }
+    }
+
+    palette_from_histogram(palette, histogram, PALETTE_MAX_COLORS - 1);
+
+    free(tasks);
+}
+
+/*                                    *
+ *   Mapping                          *
+ *                                    */
+
+typedef struct {
+    PaletteMap* map;
+    uint32_t begin;
+    uint32_t end;
+} PaletteMapTask;
+
+static void palette_map_task(void* arg)
+{
+    PaletteMapTask* task = arg;
+    for (uint32_t cell = task->begin; cell < task->end; ++cell) {
+        // Center of the cell
+        int r = palette_cell_axis(cell, 0) << 3 | 4;
+        int g = palette_cell_axis(cell, 1) << 3 | 4;
+        int b = palette_cell_axis(cell, 2) << 3 | 4;
+        task->map->lookup[cell] = palette_nearest(&task->map->palette, r, g, b);
+    }
+}
+
+void palette_map_init(PaletteMap* map, const Palette* palette)
+{
+    map->palette = *palette;
+
+    PaletteMapTask tasks[PALETTE_HISTOGRAM_SIZE / PALETTE_MAP_TASK_CELLS];
+    ThreadPoolGroup group;
+    thread_pool_group_init(&group);
+    for (size_t i = 0; i < sizeof(tasks) / sizeof(*tasks); ++i) {
+        tasks[i] = (PaletteMapTask) { map, i * PALETTE_MAP_TASK_CELLS, (i + 1) * PALETTE_MAP_TASK_CELLS };
+        thread_pool_group_submit(thread_pool_global(), &group, palette_map_task, &tasks[i]);
+    }
+    thread_pool_group_wait(&group);
+    thread_pool_group_destroy(&group);
+}
+
+// Dither offset added to every channel at (x, y), centered on zero
+static inline int palette_dither_offset(int x, int y)
+{
+    return (palette_bayer[y & 7][x & 7] * PALETTE_DITHER_SPREAD) / 64 - PALETTE_DITHER_SPREAD / 2;
+}
+
+static inline uint8_t palette_map_pixel(const PaletteMap* map, const uint8_t* pixel, int offset,
+                                        uint8_t alpha_threshold)
+{
+    if (pixel[3] < alpha_threshold)
+        return map->palette.transparent_index;
+
+    int color[3];
+    for (int c = 0; c < 3; ++c) {
+        int value = pixel[c] + offset;
+        color[c] = value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+    return map->lookup[palette_cell(color[0], color[1], color[2])];
+}
+
+#ifdef __SSE2__
+
+// Four pixels at a time: the dither offset is applied with saturating adds
+// and subtracts, and the lookup cells are computed in 32-bit lanes.
+static int palette_map_row_sse2(const PaletteMap* map, const uint8_t* pixels, int count, int x, int y,
+                                uint8_t alpha_threshold, uint8_t* indices)
+{
+    // Offsets of the 8 pixels of a period of the pattern, split by sign
+    uint8_t add[8][4] = { 0 };
+    uint8_t sub[8][4] = { 0 };
+    for (int i = 0; i < 8; ++i) {
+        int offset = palette_dither_offset(x + i, y);
+        for (int c = 0; c < 3; ++c) {
+            add[i][c] = offset > 0 ? offset : 0;
+            sub[i][c] = offset < 0 ? -offset : 0;
+        }
+    }
+    __m128i adds[2] = { _mm_loadu_si128((const __m128i*)add[0]), _mm_loadu_si128((const __m128i*)add[4]) };
+    __m128i subs[2] = { _mm_loadu_si128((const __m128i*)sub[0]), _mm_loadu_si128((const __m128i*)sub[4]) };
+
+    const __m128i channel_mask = _mm_set1_epi32(0xF8);
+    const __m128i threshold = _mm_set1_epi32(alpha_threshold);
+    uint32_t cells[4];
+    uint32_t transparent[4];
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        int phase = (i >> 2) & 1;
+        __m128i color = _mm_loadu_si128((const __m128i*)&pixels[i * 4]);
+        __m128i alpha = _mm_srli_epi32(color, 24);
+        color = _mm_subs_epu8(_mm_adds_epu8(color, adds[phase]), subs[phase]);
+
+        __m128i r = _mm_and_si128(color, channel_mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(color, 8), channel_mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(color, 16), channel_mask);
+        __m128i cell = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 7), _mm_slli_epi32(g, 2)), _mm_srli_epi32(b, 3));
+        _mm_storeu_si128((__m128i*)cells, cell);
+        _mm_storeu_si128((__m128i*)transparent, _mm_cmplt_epi32(alpha, threshold));
+
+        for (int j = 0; j < 4; ++j)
+            indices[i + j] = transparent[j] ? map->palette.transparent_index : map->lookup[cells[j]];
+    }
+
+    return i;
+}
+
+#endif // __SSE2__
+
+void palette_map_row(const PaletteMap* map, const uint8_t* pixels, int count, int x, int y,
+                     uint8_t alpha_threshold, uint8_t* indices)
+{
+    int i = 0;
+#ifdef __SSE2__
+    i = palette_map_row_sse2(map, pixels, count, x, y, alpha_threshold, indices);
+#endif
+    for (; i < count; ++i)
+        indices[i] = palette_map_pixel(map, &pixels[i * 4], palette_dither_offset(x + i, y), alpha_threshold);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PALETTE_MAX_COLORS 256
+#define PALETTE_HISTOGRAM_BITS 5
+#define PALETTE_HISTOGRAM_SIZE (1 << (PALETTE_HISTOGRAM_BITS * 3))
+
+// Up to 255 opaque colors followed by one transparent entry
+typedef struct {
+    uint8_t colors[PALETTE_MAX_COLORS][3];
+    int count;
+    int transparent_index;
+} Palette;
+
+// Color counts over a 5-5-5 grid, with the sum of the exact colors of each
+// cell so palette entries are not snapped to the grid.
+typedef struct {
+    uint64_t counts[PALETTE_HISTOGRAM_SIZE];
+    uint64_t sums[PALETTE_HISTOGRAM_SIZE][3];
+} PaletteHistogram;
+
+// RGB to palette index for every cell of the 5-5-5 grid
+typedef struct {
+    Palette palette;
+    uint8_t lookup[PALETTE_HISTOGRAM_SIZE];
+} PaletteMap;
+
+static inline uint32_t palette_cell(uint8_t r, uint8_t g, uint8_t b)
+{
+    return ((uint32_t)(r >> 3) << 10) | ((uint32_t)(g >> 3) << 5) | (b >> 3);
+}
+
+// Pixels less opaque than `alpha_threshold` are left out.
+void palette_histogram_add(PaletteHistogram* histogram, const uint8_t* pixels, size_t pixels_count,
+                           uint8_t alpha_threshold);
+// Median cut of the histogram down to `max_colors` opaque colors (at most
+// PALETTE_MAX_COLORS - 1), then the transparent entry.
+void palette_from_histogram(Palette* palette, const PaletteHistogram* histogram, int max_colors);
+// Nearest opaque entry
+int palette_nearest(const Palette* palette, int r, int g, int b);
+
+// One palette for a whole animation, from the histogram of every frame
+// computed on the global thread pool.
+void palette_build(Palette* palette, const uint8_t* const* frames, size_t frames_count,
+                   size_t pixels_count, uint8_t alpha_threshold);
+
+void palette_map_init(PaletteMap* map, const Palette* palette);
+// Maps `count` RGBA pixels starting at (x, y) on the canvas to palette
+// indices, with ordered dithering. The dither pattern only depends on the
+// canvas position, so pixels that don't change between frames keep their
+// index.
+void palette_map_row(const PaletteMap* map, const uint8_t* pixels, int count, int x, int y,
+                     uint8_t alpha_threshold, uint8_t* indices);
@@ -1,6 +1,18 @@
 #include "resize.h"
 
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "util/magick.h"
+#include "util/trace.h"
 
 #include <MagickWand/MagickWand.h>
 
@@ -14,12 +26,23 @@
         description = (char*)MagickRelinquishMemory(description);                      \
     }
 
-bool image_resize(void* inp_pixels, int old_width, int old_height,
-                  void* out_pixels, int new_width, int new_height)
+static FilterType resize_filter_to_magick(ResizeFilter filter)
 {
-    MagickWandGenesis();
+    switch (filter) {
+    case RESIZE_FILTER_CUBIC:
+        return CubicFilter;
+    case RESIZE_FILTER_LANCZOS:
+        return LanczosFilter;
+    default:
+        return CubicFilter;
+    }
+}
 
-    MagickWand* wand = NewMagickWand();
+bool image_resize_magick(void* inp_pixels, int old_width, int old_height,
+                         void* out_pixels, int new_width, int new_height,
+                         ResizeFilter filter)
+{
+    MagickWand* wand = magick_wand_acquire();
     MagickSetSize(wand, old_width, old_height);
     MagickReadImage(wand, "xc:none");
 
@@ -30,20 +53,420 @@ bool image_resize(void* inp_pixels, int old_width, int old_height,
 
     if (import_status != MagickTrue) {
         log_wand_exception(wand);
-        DestroyMagickWand(wand);
-        MagickWandTerminus();
+        magick_wand_release(wand);
         return false;
     }
 
-    MagickResizeImage(wand, new_width, new_height, CubicFilter);
+    MagickResizeImage(wand, new_width, new_height, resize_filter_to_magick(filter));
 
     MagickExportImagePixels(wand,
                             0, 0, new_width, new_height,
                             "RGBA", CharPixel, out_pixels),
 
-    DestroyMagickWand(wand);
+    magick_wand_release(wand);
+
+    return true;
+}
+
+// Fixed-point precision of the filter weights
+#define RESIZE_WEIGHT_BITS 14
+#define RESIZE_WEIGHT_ONE (1 << RESIZE_WEIGHT_BITS)
+#define RESIZE_PI 3.14159265358979323846
+// Working set of the native resampler: the output is produced in bands of
+// rows, whose input rows are premultiplied and resized horizontally in
+// buffers of about this size
+#define RESIZE_BAND_BYTES (4 << 20)
+
+// Filter weights for one axis. Output pixel `i` is a weighted sum of `counts[i]`
+// consecutive input pixels starting at `starts[i]`.
+typedef struct {
+    int* starts;
+    int* counts;
+    int16_t* weights;
+    int max_taps;
+} ResizeAxis;
+
+static double resize_sinc(double x)
+{
+    if (x == 0.0)
+        return 1.0;
+    x *= RESIZE_PI;
+    return sin(x) / x;
+}
+
+static double resize_filter_support(ResizeFilter filter)
+{
+    switch (filter) {
+    case RESIZE_FILTER_LANCZOS:
+        return 3.0;
+    case RESIZE_FILTER_CUBIC:
+    default:
+        return 2.0;
+    }
+}
+
+static double resize_filter_weight(ResizeFilter filter, double x)
+{
+    x = fabs(x);
+
+    switch (filter) {
+    case RESIZE_FILTER_LANCZOS:
+        return x < 3.0 ? resize_sinc(x) * resize_sinc(x / 3.0) : 0.0;
+    case RESIZE_FILTER_CUBIC:
+    default:
+        // B-spline (B = 1, C = 0), which is what ImageMagick calls "Cubic"
+        if (x < 1.0)
+            return (3.0 * x * x * x - 6.0 * x * x + 4.0) / 6.0;
+        if (x < 2.0)
+            return (2.0 - x) * (2.0 - x) * (2.0 - x) / 6.0;
+        return 0.0;
+    }
+}
+
+static bool resize_axis_create(ResizeAxis* axis, int in_size, int out_size, ResizeFilter filter)
+{
+    double scale = (double)in_size / out_size;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    double support = resize_filter_support(filter) * filter_scale;
+
+    axis->max_taps = (int)ceil(support) * 2 + 1;
+    axis->starts = malloc(out_size * sizeof(*axis->starts));
+    axis->counts = malloc(out_size * sizeof(*axis->counts));
+    axis->weights = malloc((size_t)out_size * axis->max_taps * sizeof(*axis->weights));
+    double* weights = malloc(axis->max_taps * sizeof(*weights));
+
+    if (!axis->starts || !axis->counts || !axis->weights || !weights) {
+        free(weights);
+        return false;
+    }
+
+    for (int i = 0; i < out_size; ++i) {
+        double center = (i + 0.5) * scale;
+
+        int start = (int)(center - support + 0.5);
+        int end = (int)(center + support + 0.5);
+        if (start < 0)
+            start = 0;
+        if (end > in_size)
+            end = in_size;
+        if (end - start > axis->max_taps)
+            end = start + axis->max_taps;
+
+        double total = 0.0;
+        for (int x = start; x < end; ++x) {
+            weights[x - start] = resize_filter_weight(filter, (x - center + 0.5) / filter_scale);
+            total += weights[x - start];
+        }
+
+        // Convert to fixed point, putting the rounding error on the biggest
+        // weight so they always add up to exactly one.
+        int16_t* fixed = &axis->weights[(size_t)i * axis->max_taps];
+        int fixed_total = 0;
+        int biggest = 0;
+        for (int k = 0; k < end - start; ++k) {
+            double weight = total != 0.0 ? weights[k] / total : 0.0;
+            fixed[k] = (int16_t)lround(weight * RESIZE_WEIGHT_ONE);
+            fixed_total += fixed[k];
+            if (fixed[k] > fixed[biggest])
+                biggest = k;
+        }
+        fixed[biggest] += RESIZE_WEIGHT_ONE - fixed_total;
 
-    MagickWandTerminus();
+        axis->starts[i] = start;
+        axis->counts[i] = end - start;
+    }
 
+    free(weights);
     return true;
 }
+
+static void resize_axis_destroy(ResizeAxis* axis)
+{
+    free(axis->starts);
+    free(axis->counts);
+    free(axis->weights);
+}
+
+static inline uint8_t resize_clamp_channel(int32_t sum)
+{
+    sum = (sum + (RESIZE_WEIGHT_ONE >> 1)) >> RESIZE_WEIGHT_BITS;
+    return sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+}
+
+// Filtering straight alpha bleeds the color of transparent pixels into their
+// neighbours, so pixels are resampled premultiplied.
+static void resize_premultiply(const uint8_t* in, uint8_t* out, size_t pixels_count)
+{
+    for (size_t i = 0; i < pixels_count; ++i) {
+        uint32_t a = in[i * 4 + 3];
+        out[i * 4 + 0] = (in[i * 4 + 0] * a + 127) / 255;
+        out[i * 4 + 1] = (in[i * 4 + 1] * a + 127) / 255;
+        out[i * 4 + 2] = (in[i * 4 + 2] * a + 127) / 255;
+        out[i * 4 + 3] = a;
+    }
+}
+
+static void resize_unpremultiply(uint8_t* pixels, size_t pixels_count)
+{
+    for (size_t i = 0; i < pixels_count; ++i) {
+        uint32_t a = pixels[i * 4 + 3];
+        if (a == 0) {
+            memset(&pixels[i * 4], 0, 4);
+            continue;
+        }
+        for (int c = 0; c < 3; ++c) {
+            uint32_t value = (pixels[i * 4 + c] * 255 + a / 2) / a;
+            pixels[i * 4 + c] = value > 255 ? 255 : value;
+        }
+    }
+}
+
+#ifdef __SSE2__
+
+// Taps are processed in pairs: the channels of both pixels are interleaved as
+// 16-bit integers so a single madd multiplies and adds them with their weights.
+static inline __m128i resize_madd_pair(uint32_t pixel0, uint32_t pixel1, int16_t weight0, int16_t weight1)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i pixels = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel0), _mm_cvtsi32_si128(pixel1));
+    __m128i weights = _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)weight1 << 16) | (uint16_t)weight0));
+    return _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+}
+
+static inline __m128i resize_round_shift(__m128i sum)
+{
+    sum = _mm_add_epi32(sum, _mm_set1_epi32(RESIZE_WEIGHT_ONE >> 1));
+    return _mm_srai_epi32(sum, RESIZE_WEIGHT_BITS);
+}
+
+static void resize_horizontal_sse2(const uint8_t* in, int in_width, uint8_t* out, int out_width,
+                                   const ResizeAxis* axis, int y_begin, int y_end)
+{
+    for (int y = y_begin; y < y_end; ++y) {
+        const uint8_t* in_row = &in[(size_t)y * in_width * 4];
+        uint8_t* out_row = &out[(size_t)y * out_width * 4];
+
+        for (int x = 0; x < out_width; ++x) {
+            const int16_t* weights = &axis->weights[(size_t)x * axis->max_taps];
+            const uint8_t* taps = &in_row[axis->starts[x] * 4];
+            int count = axis->counts[x];
+
+            __m128i sum = _mm_setzero_si128();
+            int k = 0;
+            for (; k + 2 <= count; k += 2) {
+                uint32_t pixel0, pixel1;
+                memcpy(&pixel0, &taps[k * 4], 4);
+                memcpy(&pixel1, &taps[(k + 1) * 4], 4);
+                sum = _mm_add_epi32(sum, resize_madd_pair(pixel0, pixel1, weights[k], weights[k + 1]));
+            }
+            if (k < count) {
+                uint32_t pixel0;
+                memcpy(&pixel0, &taps[k * 4], 4);
+                sum = _mm_add_epi32(sum, resize_madd_pair(pixel0, 0, weights[k], 0));
+            }
+
+            __m128i packed = _mm_packs_epi32(resize_round_shift(sum), _mm_setzero_si128());
+            uint32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+            memcpy(&out_row[x * 4], &pixel, 4);
+        }
+    }
+}
+
+static void resize_vertical_sse2(const uint8_t* in, int in_y_begin, uint8_t* out, int width,
+                                 const ResizeAxis* axis, int y_begin, int y_end)
+{
+    size_t stride = (size_t)width * 4;
+    __m128i zero = _mm_setzero_si128();
+
+    for (int y = y_begin; y < y_end; ++y) {
+        const int16_t* weights = &axis->weights[(size_t)y * axis->max_taps];
+        const uint8_t* taps = &in[(axis->starts[y] - in_y_begin) * stride];
+        uint8_t* out_row = &out[y * stride];
+        int count = axis->counts[y];
+
+        // 16 channels (4 pixels) at a time
+        size_t x = 0;
+        for (; x + 16 <= stride; x += 16) {
+            __m128i sum0 = zero, sum1 = zero, sum2 = zero, sum3 = zero;
+
+            for (int k = 0; k < count; k += 2) {
+                __m128i row0 = _mm_loadu_si128((const __m128i*)&taps[k * stride + x]);
+                __m128i row1 = zero;
+                int16_t weight1 = 0;
+                if (k + 1 < count) {
+                    row1 = _mm_loadu_si128((const __m128i*)&taps[(k + 1) * stride + x]);
+                    weight1 = weights[k + 1];
+                }
+                __m128i pair_weights = _mm_set1_epi32(
+                    (int32_t)(((uint32_t)(uint16_t)weight1 << 16) | (uint16_t)weights[k]));
+
+                __m128i low = _mm_unpacklo_epi8(row0, row1);
+                __m128i high = _mm_unpackhi_epi8(row0, row1);
+                sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi8(low, zero), pair_weights));
+                sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi8(low, zero), pair_weights));
+                sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(high, zero), pair_weights));
+                sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi8(high, zero), pair_weights));
+            }
+
+            __m128i packed0 = _mm_packs_epi32(resize_round_shift(sum0), resize_round_shift(sum1));
+            __m128i packed1 = _mm_packs_epi32(resize_round_shift(sum2), resize_round_shift(sum3));
+            _mm_storeu_si128((__m128i*)&out_row[x], _mm_packus_epi16(packed0, packed1));
+        }
+
+        for (; x < stride; ++x) {
+            int32_t sum = 0;
+            for (int k = 0; k < count; ++k)
+                sum += taps[k * stride + x] * weights[k];
+            out_row[x] = resize_clamp_channel(sum);
+        }
+    }
+}
+
+#define resize_horizontal resize_horizontal_sse2
+#define resize_vertical resize_vertical_sse2
+#else
+
+static void resize_horizontal_scalar(const uint8_t* in, int in_width, uint8_t* out, int out_width,
+                                     const ResizeAxis* axis, int y_begin, int y_end)
+{
+    for (int y = y_begin; y < y_end; ++y) {
+        const uint8_t* in_row = &in[(size_t)y * in_width * 4];
+        uint8_t* out_row = &out[(size_t)y * out_width * 4];
+
+        for (int x = 0; x < out_width; ++x) {
+            const int16_t* weights = &axis->weights[(size_t)x * axis->max_taps];
+            const uint8_t* taps = &in_row[axis->starts[x] * 4];
+            int32_t sum[4] = { 0 };
+            for (int k = 0; k < axis->counts[x]; ++k) {
+                for (int c = 0; c < 4; ++c)
+                    sum[c] += taps[k * 4 + c] * weights[k];
+            }
+            for (int c = 0; c < 4; ++c)
+                out_row[x * 4 + c] = resize_clamp_channel(sum[c]);
+        }
+    }
+}
+
+// `in` holds the input rows from `in_y_begin` on
+static void resize_vertical_scalar(const uint8_t* in, int in_y_begin, uint8_t* out, int width,
+                                   const ResizeAxis* axis, int y_begin, int y_end)
+{
+    size_t stride = (size_t)width * 4;
+
+    for (int y = y_begin; y < y_end; ++y) {
+        const int16_t* weights = &axis->weights[(size_t)y * axis->max_taps];
+        const uint8_t* taps = &in[(axis->starts[y] - in_y_begin) * stride];
+        uint8_t* out_row = &out[y * stride];
+
+        for (size_t x = 0; x < stride; ++x) {
+            int32_t sum = 0;
+            for (int k = 0; k < axis->counts[y]; ++k)
+                sum += taps[k * stride + x] * weights[k];
+            out_row[x] = resize_clamp_channel(sum);
+        }
+    }
+}
+
+#define resize_horizontal resize_horizontal_scalar
+#define resize_vertical resize_vertical_scalar
+#endif // __SSE2__
+
+bool image_resize_native_rows(void* inp_pixels, int old_width, int old_height,
+                              void* out_pixels, int new_width, int new_height,
+                              ResizeFilter filter, int y_begin, int y_end)
+{
+    if (old_width <= 0 || old_height <= 0 || new_width <= 0 || new_height <= 0)
+        return false;
+
+    ResizeAxis horizontal = { 0 };
+    ResizeAxis vertical = { 0 };
+    bool ok = resize_axis_create(&horizontal, old_width, new_width, filter)
+        && resize_axis_create(&vertical, old_height, new_height, filter);
+
+    // Input rows premultiplied and resized horizontally at once
+    size_t row_size = ((size_t)old_width + new_width) * 4;
+    int band_rows = RESIZE_BAND_BYTES / row_size;
+    if (band_rows < vertical.max_taps)
+        band_rows = vertical.max_taps;
+
+    uint8_t* premultiplied = NULL;
+    uint8_t* intermediate = NULL;
+    if (ok) {
+        premultiplied = malloc((size_t)band_rows * old_width * 4);
+        intermediate = malloc((size_t)band_rows * new_width * 4);
+        ok = premultiplied != NULL && intermediate != NULL;
+    }
+
+    const uint8_t* in = inp_pixels;
+    uint8_t* out = out_pixels;
+    for (int y = y_begin; ok && y < y_end;) {
+        // Output rows whose taps all fit in the band
+        int in_begin = vertical.starts[y];
+        int in_end = in_begin;
+        int band_end = y;
+        while (band_end < y_end) {
+            int end = vertical.starts[band_end] + vertical.counts[band_end];
+            if (end < in_end)
+                end = in_end;
+            if (end - in_begin > band_rows)
+                break;
+            in_end = end;
+            band_end++;
+        }
+
+        resize_premultiply(&in[(size_t)in_begin * old_width * 4], premultiplied,
+                           (size_t)(in_end - in_begin) * old_width);
+        resize_horizontal(premultiplied, old_width, intermediate, new_width, &horizontal, 0, in_end - in_begin);
+        resize_vertical(intermediate, in_begin, out, new_width, &vertical, y, band_end);
+        resize_unpremultiply(&out[(size_t)y * new_width * 4], (size_t)(band_end - y) * new_width);
+
+        y = band_end;
+    }
+
+    resize_axis_destroy(&vertical);
+    resize_axis_destroy(&horizontal);
+    free(intermediate);
+    free(premultiplied);
+
+    return ok;
+}
+
+bool image_resize_native(void* inp_pixels, int old_width, int old_height,
+                         void* out_pixels, int new_width, int new_height,
+                         ResizeFilter filter)
+{
+    return image_resize_native_rows(inp_pixels, old_width, old_height,
+                                    out_pixels, new_width, new_height,
+                                    filter, 0, new_height);
+}
+
+static bool resize_use_magick = false;
+static pthread_once_t resize_once = PTHREAD_ONCE_INIT;
+
+static void resize_init(void)
+{
+    const char* backend = getenv("EXPLODE_RESIZE");
+    resize_use_magick = backend != NULL && strcmp(backend, "magick") == 0;
+}
+
+bool image_resize(void* inp_pixels, int old_width, int old_height,
+                  void* out_pixels, int new_width, int new_height,
+                  ResizeFilter filter)
+{
+    TRACE_SCOPE("image_resize");
+    pthread_once(&resize_once, resize_init);
+
+    if (!resize_use_magick
+        && image_resize_native(inp_pixels, old_width, old_height,
+                               out_pixels, new_width, new_height, filter))
+        return true;
+
+    return image_resize_magick(inp_pixels, old_width, old_height,
+                               out_pixels, new_width, new_height, filter);
+}
+
+bool image_resize_uses_magick(void)
+{
+    pthread_once(&resize_once, resize_init);
+    return resize_use_magick;
+}
@@ -2,5 +2,30 @@
 
 #include <stdbool.h>
 
+typedef enum {
+    RESIZE_FILTER_CUBIC = 0,
+    RESIZE_FILTER_LANCZOS,
+    COUNT_RESIZE_FILTERS,
+} ResizeFilter;
+
+// Resizes RGBA pixels with the built-in resampler, falling back to
+// ImageMagick if it fails. Setting EXPLODE_RESIZE=magick always uses
+// ImageMagick.
 bool image_resize(void* inp_pixels, int old_width, int old_height,
-                  void* out_pixels, int new_width, int new_height);
+                  void* out_pixels, int new_width, int new_height,
+                  ResizeFilter filter);
+// Whether `image_resize` was set to always use ImageMagick
+bool image_resize_uses_magick(void);
+
+bool image_resize_native(void* inp_pixels, int old_width, int old_height,
+                         void* out_pixels, int new_width, int new_height,
+                         ResizeFilter filter);
+// Only writes rows [y_begin, y_end) of `out_pixels`, so bands of a frame can
+// be resized in parallel. Whatever the sizes, the input is processed a few
+// megabytes at a time.
+bool image_resize_native_rows(void* inp_pixels, int old_width, int old_height,
+                              void* out_pixels, int new_width, int new_height,
+                              ResizeFilter filter, int y_begin, int y_end);
+bool image_resize_magick(void* inp_pixels, int old_width, int old_height,
+                         void* out_pixels, int new_width, int new_height,
+                         ResizeFilter filter);
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "result_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util/hash.h"
+#include "util/string.h"
+#include "util/trace.h"
+
+#define RESULT_CACHE_DEFAULT_LIMIT_MB 256
+// Bumped whenever the generated animations change, so older entries miss
+#define RESULT_CACHE_VERSION 2
+// Entries are named after their key, e.g. `0123456789abcdef.gif`
+#define RESULT_CACHE_NAME_LENGTH (16 + 4)
+
+typedef struct {
+    char name[RESULT_CACHE_NAME_LENGTH + 1];
+    size_t size;
+    struct timespec used;
+} ResultCacheEntry;
+
+static pthread_once_t result_cache_once = PTHREAD_ONCE_INIT;
+// Eviction scans the whole directory, once at a time is enough
+static pthread_mutex_t result_cache_evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char* result_cache_dir = NULL;
+static size_t result_cache_limit = (size_t)RESULT_CACHE_DEFAULT_LIMIT_MB * 1024 * 1024;
+// Settings read by the encoders and the resampler, which change the bytes saved
+static char result_cache_settings[128];
+
+static void result_cache_init(void)
+{
+    const char* dir = getenv("EXPLODE_RESULT_CACHE_DIR");
+    if (dir == NULL || *dir == '\0')
+        return;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "WARNING: could not create result cache directory `%s`: %s\n", dir, strerror(errno));
+        return;
+    }
+    result_cache_dir = strdup(dir);
+
+    const char* limit_mb = getenv("EXPLODE_RESULT_CACHE_MB");
+    if (limit_mb != NULL)
+        result_cache_limit = strtoull(limit_mb, NULL, 10) * 1024 * 1024;
+
+    const char* encoder = getenv("EXPLODE_ENCODER");
+    const char* palette = getenv("EXPLODE_GIF_PALETTE");
+    const char* resize = getenv("EXPLODE_RESIZE");
+    snprintf(result_cache_settings, sizeof(result_cache_settings), "encoder=%s palette=%s resize=%s",
+             encoder ? encoder : "", palette ? palette : "", resize ? resize : "");
+}
+
+static const char* result_cache_format(const char* output_file)
+{
+    return string_ends_with(output_file, ".gif") ? "gif" : "png";
+}
+
+static uint64_t result_cache_key(Image image, bool reverse, const char* output_file)
+{
+    char params[256];
+    int length = snprintf(params, sizeof(params), "v%d %dx%d reverse=%d format=%s %s",
+                          RESULT_CACHE_VERSION, image.width, image.height, reverse,
+                          result_cache_format(output_file), result_cache_settings);
+
+    uint64_t seed = hash_xxh64(params, length, 0);
+    return hash_xxh64(image.data, (size_t)image.width * image.height * 4, seed);
+}
+
+static char* result_cache_path(uint64_t key, const char* output_file)
+{
+    char* path = NULL;
+    if (asprintf(&path, "%s/%016" PRIx64 ".%s", result_cache_dir, key, result_cache_format(output_file)) < 0)
+        return NULL;
+    return path;
+}
+
+// Copies `source` to the already opened `output`
+static bool result_cache_copy(int source, int output)
+{
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t size = read(source, chunk, sizeof(chunk));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return size == 0;
+
+        for (ssize_t written = 0; written < size;) {
+            ssize_t count = write(output, chunk + written, size - written);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            written += count;
+        }
+    }
+}
+
+bool result_cache_fetch(Image image, bool reverse, const char* output_file, uint64_t* key)
+{
+    pthread_once(&result_cache_once, result_cache_init);
+    if (result_cache_dir == NULL)
+        return false;
+
+    TRACE_SCOPE("result_cache_fetch");
+
+    *key = result_cache_key(image, reverse, output_file);
+    char* path = result_cache_path(*key, output_file);
+    int source = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (source < 0) {
+        free(path);
+        return false;
+    }
+
+    // Copied next to the output and renamed, so a failed copy doesn't remove
+    // an output written by someone else
+    char* temp_path = NULL;
+    int output = -1;
+    if (asprintf(&temp_path, "%s.XXXXXX", output_file) >= 0)
+        output = mkostemp(temp_path, O_CLOEXEC);
+    else
+        temp_path = NULL;
+    bool hit = output >= 0 && result_cache_copy(source, output);
+    if (output >= 0) {
+        fchmod(output, 0644);
+        if (close(output) != 0)
+            hit = false;
+        if (hit && rename(temp_path, output_file) != 0)
+            hit = false;
+        if (!hit)
+            remove(temp_path);
+    }
+    close(source);
+
+    if (hit) {
+        // Marks the entry as recently used
+        utimensat(AT_FDCWD, path, NULL, 0);
+        printf("Saved cached animation `%s`\n", output_file);
+    }
+
+    free(temp_path);
+    free(path);
+    return hit;
+}
+
+static bool result_cache_is_entry(const char* name)
+{
+    return strlen(name) == RESULT_CACHE_NAME_LENGTH
+        && strspn(name, "0123456789abcdef") == 16
+        && (strcmp(name + 16, ".gif") == 0 || strcmp(name + 16, ".png") == 0);
+}
+
+static int result_cache_compare_used(const void* a, const void* b)
+{
+    const struct timespec* x = &((const ResultCacheEntry*)a)->used;
+    const struct timespec* y = &((const ResultCacheEntry*)b)->used;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec)
+        return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Removes the entries used least recently until the cache fits its limit
+static void result_cache_evict(void)
+{
+    TRACE_SCOPE("result_cache_evict");
+
+    pthread_mutex_lock(&result_cache_evict_mutex);
+
+    DIR* dir = opendir(result_cache_dir);
+    if (dir == NULL) {
+        pthread_mutex_unlock(&result_cache_evict_mutex);
+        return;
+    }
+
+    ResultCacheEntry* entries = NULL;
+    size_t entries_count = 0;
+    size_t entries_capacity = 0;
+    size_t total = 0;
+    bool listed = true;
+
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat st;
+        if (!result_cache_is_entry(dirent->d_name)
+            || fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (entries_count == entries_capacity) {
+            size_t capacity = entries_capacity ? entries_capacity * 2 : 64;
+            ResultCacheEntry* grown = realloc(entries, capacity * sizeof(*entries));
+            if (grown == NULL) {
+                // The oldest entries may not have been seen, the next store
+                // tries again
+                listed = false;
+                break;
+            }
+            entries = grown;
+            entries_capacity = capacity;
+        }
+        ResultCacheEntry* entry = &entries[entries_count++];
+        strcpy(entry->name, dirent->d_name);
+        entry->size = st.st_size;
+        entry->used = st.st_mtim;
+        total += entry->size;
+    }
+
+    if (listed && total > result_cache_limit) {
+        qsort(entries, entries_count, sizeof(*entries), result_cache_compare_used);
+        for (size_t i = 0; i < entries_count && total > result_cache_limit; ++i) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0 || errno == ENOENT)
+                total -= entries[i].size;
+        }
+    }
+
+    closedir(dir);
+    free(entries);
+
+    pthread_mutex_unlock(&result_cache_evict_mutex);
+}
+
+void result_cache_store(uint64_t key, const char* output_file)
+{
+    pthread_once(&result_cache_once, result_cache_init);
+    if (result_cache_dir == NULL)
+        return;
+
+    TRACE_SCOPE("result_cache_store");
+
+    char* path = result_cache_path(key, output_file);
+    char* temp_path = NULL;
+    if (path == NULL || asprintf(&temp_path, "%s/.tmp-XXXXXX", result_cache_dir) < 0) {
+        free(path);
+        return;
+    }
+
+    // Written to a temporary file first so readers never see a partial entry
+    int source = open(output_file, O_RDONLY | O_CLOEXEC);
+    int output = source >= 0 ? mkostemp(temp_path, O_CLOEXEC) : -1;
+    bool ok = output >= 0 && result_cache_copy(source, output);
+    if (output >= 0) {
+        fchmod(output, 0644);
+        if (close(output) != 0)
+            ok = false;
+        if (!ok || rename(temp_path, path) != 0) {
+            fprintf(stderr, "WARNING: could not add `%s` to the result cache\n", output_file);
+            remove(temp_path);
+            ok = false;
+        }
+    }
+    if (source >= 0)
+        close(source);
+
+    free(temp_path);
+    free(path);
+
+    if (ok)
+        result_cache_evict();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <raylib.h>
+
+// Saved animations kept on disk, keyed by a hash of the source pixels and of
+// everything else that changes the saved file: the kind, the output format
+// (from the suffix of the output path) and the encoder settings. Converting
+// the same image again copies the saved file instead of running any stage.
+//
+// The cache is enabled by EXPLODE_RESULT_CACHE_DIR, and bounded by
+// EXPLODE_RESULT_CACHE_MB megabytes (256 by default). Every hit touches the
+// entry's modification time, and the entries used least recently are removed
+// first. Several processes may share the same directory.
+
+// Copies the cached animation of `image` to `output_file`. On a miss, `key`
+// is set for `result_cache_store`. Always misses while the cache is disabled.
+bool result_cache_fetch(Image image, bool reverse, const char* output_file, uint64_t* key);
+// Adds the animation just saved to `output_file`, after a miss of
+// `result_cache_fetch`. Ignored while the cache is disabled.
+void result_cache_store(uint64_t key, const char* output_file);
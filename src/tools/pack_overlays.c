@@ -0,0 +1,128 @@
+// Packs the explosion overlay frames into the file read by overlay_pack.c,
+// along with copies resampled to the common emoji sizes. Run by the build.
+#define _GNU_SOURCE
+#include <endian.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "resources/explode_frames.h"
+
+#include "overlay_cache.h"
+#include "overlay_pack.h"
+#include "resize.h"
+
+#define PACK_ENTRIES_COUNT (OVERLAY_FRAMES_COUNT * (1 + OVERLAY_PACK_SIZES_COUNT))
+
+static const OverlaySource pack_sources[OVERLAY_FRAMES_COUNT] = {
+    { explode_frame_00_data, explode_frame_00_width, explode_frame_00_height },
+    { explode_frame_01_data, explode_frame_01_width, explode_frame_01_height },
+    { explode_frame_02_data, explode_frame_02_width, explode_frame_02_height },
+    { explode_frame_03_data, explode_frame_03_width, explode_frame_03_height },
+    { explode_frame_04_data, explode_frame_04_width, explode_frame_04_height },
+    { explode_frame_05_data, explode_frame_05_width, explode_frame_05_height },
+    { explode_frame_06_data, explode_frame_06_width, explode_frame_06_height },
+    { explode_frame_07_data, explode_frame_07_width, explode_frame_07_height },
+    { explode_frame_08_data, explode_frame_08_width, explode_frame_08_height },
+    { explode_frame_09_data, explode_frame_09_width, explode_frame_09_height },
+    { explode_frame_10_data, explode_frame_10_width, explode_frame_10_height },
+    { explode_frame_11_data, explode_frame_11_width, explode_frame_11_height },
+    { explode_frame_12_data, explode_frame_12_width, explode_frame_12_height },
+    { explode_frame_13_data, explode_frame_13_width, explode_frame_13_height },
+    { explode_frame_14_data, explode_frame_14_width, explode_frame_14_height },
+    { explode_frame_15_data, explode_frame_15_width, explode_frame_15_height },
+    { explode_frame_16_data, explode_frame_16_width, explode_frame_16_height },
+    { explode_frame_17_data, explode_frame_17_width, explode_frame_17_height },
+    { explode_frame_18_data, explode_frame_18_width, explode_frame_18_height },
+    { explode_frame_19_data, explode_frame_19_width, explode_frame_19_height },
+    { explode_frame_20_data, explode_frame_20_width, explode_frame_20_height },
+    { explode_frame_21_data, explode_frame_21_width, explode_frame_21_height },
+};
+
+// Compresses `pixels` to the end of `file` and fills in where it went, in
+// the byte order of the file
+static bool pack_write_frame(FILE* file, const void* pixels, int width, int height, OverlayPackEntry* entry)
+{
+    uLong size = (uLong)width * height * sizeof(uint32_t);
+    uLongf compressed_size = compressBound(size);
+    unsigned char* compressed = malloc(compressed_size);
+    if (compressed == NULL || compress2(compressed, &compressed_size, pixels, size, Z_BEST_COMPRESSION) != Z_OK) {
+        free(compressed);
+        return false;
+    }
+
+    long offset = ftell(file);
+    bool ok = offset >= 0 && fwrite(compressed, 1, compressed_size, file) == compressed_size;
+    free(compressed);
+
+    entry->width = htole32(width);
+    entry->height = htole32(height);
+    entry->offset = htole64(offset);
+    entry->size = htole64(compressed_size);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <OUTPUT>\n", argv[0]);
+        return 1;
+    }
+    const char* output_path = argv[1];
+
+    FILE* file = fopen(output_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: could not open `%s`\n", output_path);
+        return 1;
+    }
+
+    // The header and entries are written once the frames are
+    OverlayPackHeader header = {
+        .magic = htole32(OVERLAY_PACK_MAGIC),
+        .version = htole32(OVERLAY_PACK_VERSION),
+        .frames_count = htole32(OVERLAY_FRAMES_COUNT),
+        .entries_count = htole32(PACK_ENTRIES_COUNT),
+    };
+    OverlayPackEntry entries[PACK_ENTRIES_COUNT] = { 0 };
+    bool ok = fseek(file, sizeof(header) + sizeof(entries), SEEK_SET) == 0;
+
+    size_t max_size = overlay_pack_sizes[OVERLAY_PACK_SIZES_COUNT - 1];
+    void* resized = malloc(max_size * max_size * sizeof(uint32_t));
+    ok = ok && resized != NULL;
+
+    OverlayPackEntry* entry = entries;
+    for (size_t i = 0; ok && i < OVERLAY_FRAMES_COUNT; ++i) {
+        const OverlaySource* source = &pack_sources[i];
+        *entry = (OverlayPackEntry) { .index = htole32(i), .original = htole32(1) };
+        ok = pack_write_frame(file, source->data, source->width, source->height, entry++);
+
+        // Resampled the same way the overlay cache does, so the copies are
+        // exactly what it would compute
+        for (size_t j = 0; ok && j < OVERLAY_PACK_SIZES_COUNT; ++j) {
+            int size = overlay_pack_sizes[j];
+            *entry = (OverlayPackEntry) { .index = htole32(i) };
+            ok = image_resize_native(source->data, source->width, source->height,
+                                     resized, size, size, RESIZE_FILTER_CUBIC)
+                && pack_write_frame(file, resized, size, size, entry++);
+        }
+    }
+    free(resized);
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(entries, sizeof(entries), 1, file) == 1;
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "ERROR: could not write overlay pack `%s`\n", output_path);
+        remove(output_path);
+        return 1;
+    }
+
+    const OverlayPackEntry* last = &entries[PACK_ENTRIES_COUNT - 1];
+    uint64_t pack_size = le64toh(last->offset) + le64toh(last->size);
+    printf("Packed %d overlay frames at %d sizes into `%s` (%" PRIu64 " bytes)\n",
+           OVERLAY_FRAMES_COUNT, 1 + OVERLAY_PACK_SIZES_COUNT, output_path, pack_size);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include "arena_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+#if ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP && defined(ARENA_POOL_HUGE_PAGES)
+#include <sys/mman.h>
+
+#define ARENA_POOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#endif
+
+#define ARENA_POOL_DEFAULT_LIMIT_MB 256
+
+typedef struct ArenaPoolEntry ArenaPoolEntry;
+
+struct ArenaPoolEntry {
+    // First, so the arena handed out can be cast back to its entry
+    Arena arena;
+    ArenaPoolEntry* next;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static ArenaPoolEntry* pool_idle = NULL;
+static size_t pool_size = 0;
+static size_t pool_limit = (size_t)ARENA_POOL_DEFAULT_LIMIT_MB * 1024 * 1024;
+
+static void arena_pool_init(void)
+{
+    const char* limit_mb = getenv("EXPLODE_ARENA_POOL_MB");
+    if (limit_mb != NULL)
+        pool_limit = strtoull(limit_mb, NULL, 10) * 1024 * 1024;
+}
+
+size_t arena_capacity(const Arena* arena)
+{
+    size_t capacity = 0;
+    for (Region* region = arena->begin; region != NULL; region = region->next)
+        capacity += region->capacity * sizeof(uintptr_t);
+    return capacity;
+}
+
+// Replaces the regions of `arena` by a single one of `capacity` bytes
+static void arena_pool_reserve(Arena* arena, size_t capacity)
+{
+    arena_free(arena);
+
+#if ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP && defined(ARENA_POOL_HUGE_PAGES)
+    capacity = (capacity + ARENA_POOL_HUGE_PAGE_SIZE - 1) / ARENA_POOL_HUGE_PAGE_SIZE * ARENA_POOL_HUGE_PAGE_SIZE;
+#endif
+
+    arena_alloc(arena, capacity);
+
+#if ARENA_BACKEND == ARENA_BACKEND_LINUX_MMAP && defined(ARENA_POOL_HUGE_PAGES)
+    // Only a hint, the kernel may not have transparent huge pages enabled
+    madvise(arena->begin, sizeof(Region) + capacity, MADV_HUGEPAGE);
+#endif
+
+    arena_reset(arena);
+}
+
+Arena* arena_pool_acquire(size_t capacity)
+{
+    pthread_once(&pool_once, arena_pool_init);
+
+    pthread_mutex_lock(&pool_mutex);
+
+    // Smallest idle arena that is big enough, or else the biggest one
+    ArenaPoolEntry** best = NULL;
+    size_t best_capacity = 0;
+    for (ArenaPoolEntry** link = &pool_idle; *link != NULL; link = &(*link)->next) {
+        size_t entry_capacity = arena_capacity(&(*link)->arena);
+        bool fits = entry_capacity >= capacity;
+        bool best_fits = best_capacity >= capacity;
+        if (best == NULL
+            || (fits && (!best_fits || entry_capacity < best_capacity))
+            || (!fits && !best_fits && entry_capacity > best_capacity)) {
+            best = link;
+            best_capacity = entry_capacity;
+        }
+    }
+
+    ArenaPoolEntry* entry = NULL;
+    if (best != NULL) {
+        entry = *best;
+        *best = entry->next;
+        pool_size -= best_capacity;
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (entry == NULL)
+        entry = calloc(1, sizeof(*entry));
+
+    // An arena that overflowed into more regions last time is merged into a
+    // single one that holds all of them, so the next use fits.
+    if (entry->arena.begin != NULL && entry->arena.begin->next != NULL) {
+        size_t used = arena_capacity(&entry->arena);
+        if (capacity < used)
+            capacity = used;
+    }
+
+    if (entry->arena.begin == NULL
+        || entry->arena.begin->next != NULL
+        || entry->arena.begin->capacity * sizeof(uintptr_t) < capacity)
+        arena_pool_reserve(&entry->arena, capacity);
+    else
+        arena_reset(&entry->arena);
+
+    return &entry->arena;
+}
+
+void arena_pool_release(Arena* arena)
+{
+    if (arena == NULL)
+        return;
+
+    ArenaPoolEntry* entry = (ArenaPoolEntry*)arena;
+    size_t capacity = arena_capacity(arena);
+
+    if (trace_enabled()) {
+        size_t used = 0;
+        for (Region* region = arena->begin; region != NULL; region = region->next)
+            used += region->count * sizeof(uintptr_t);
+        trace_arena_usage(used);
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    bool keep = pool_size + capacity <= pool_limit;
+    if (keep) {
+        entry->next = pool_idle;
+        pool_idle = entry;
+        pool_size += capacity;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!keep) {
+        arena_free(arena);
+        free(entry);
+    }
+}
+
+void arena_pool_trim(void)
+{
+    pthread_mutex_lock(&pool_mutex);
+    ArenaPoolEntry* idle = pool_idle;
+    pool_idle = NULL;
+    pool_size = 0;
+    pthread_mutex_unlock(&pool_mutex);
+
+    while (idle != NULL) {
+        ArenaPoolEntry* next = idle->next;
+        arena_free(&idle->arena);
+        free(idle);
+        idle = next;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "external/arena.h"
+
+// Arenas kept between conversions, so their regions are reset and reused
+// instead of being allocated again. Each arena is backed by a single region
+// that grows to the largest capacity asked for.
+//
+// Idle arenas are kept up to EXPLODE_ARENA_POOL_MB megabytes (256 by default),
+// the others are freed when released.
+
+// Returns an empty arena whose first region holds at least `capacity` bytes.
+// Must be paired with `arena_pool_release`.
+Arena* arena_pool_acquire(size_t capacity);
+void arena_pool_release(Arena* arena);
+// Frees every idle arena
+void arena_pool_trim(void);
+
+// Bytes reserved by the regions of `arena`
+size_t arena_capacity(const Arena* arena);
@@ -0,0 +1,54 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool buffer_reserve(Buffer* buffer, size_t size)
+{
+    if (buffer->size + size <= buffer->capacity)
+        return true;
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->size + size)
+        capacity *= 2;
+    uint8_t* data = realloc(buffer->data, capacity);
+    if (data == NULL)
+        return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+bool buffer_append(Buffer* buffer, const void* data, size_t size)
+{
+    if (!buffer_reserve(buffer, size))
+        return false;
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+bool buffer_append_byte(Buffer* buffer, uint8_t byte)
+{
+    return buffer_append(buffer, &byte, 1);
+}
+
+bool buffer_append_u16_le(Buffer* buffer, uint16_t value)
+{
+    uint8_t bytes[2] = { value & 0xFF, value >> 8 };
+    return buffer_append(buffer, bytes, sizeof(bytes));
+}
+
+bool buffer_append_u32_be(Buffer* buffer, uint32_t value)
+{
+    uint8_t bytes[4] = { value >> 24, (value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF };
+    return buffer_append(buffer, bytes, sizeof(bytes));
+}
+
+void buffer_free(Buffer* buffer)
+{
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
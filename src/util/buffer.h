@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Growable array of bytes used to assemble encoded output in memory
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+// These return false if the buffer could not grow, leaving it unchanged
+bool buffer_reserve(Buffer* buffer, size_t size);
+bool buffer_append(Buffer* buffer, const void* data, size_t size);
+bool buffer_append_byte(Buffer* buffer, uint8_t byte);
+bool buffer_append_u16_le(Buffer* buffer, uint16_t value);
+bool buffer_append_u32_be(Buffer* buffer, uint32_t value);
+void buffer_free(Buffer* buffer);
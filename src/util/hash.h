@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 64-bit xxHash (XXH64) of `size` bytes. Not cryptographic, but fast enough
+// to key whole images by their pixels.
+uint64_t hash_xxh64(const void* data, size_t size, uint64_t seed);
@@ -0,0 +1,69 @@
+#include "magick.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <MagickWand/MagickWand.h>
+
+// Idle wands kept around for reuse, anything beyond this is destroyed
+#define MAGICK_WAND_POOL_CAPACITY 64
+
+static pthread_mutex_t magick_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool magick_initialized = false;
+static MagickWand* magick_wand_pool[MAGICK_WAND_POOL_CAPACITY];
+static size_t magick_wand_pool_count = 0;
+
+MagickWand* magick_wand_acquire(void)
+{
+    pthread_mutex_lock(&magick_mutex);
+
+    if (!magick_initialized) {
+        MagickWandGenesis();
+        magick_initialized = true;
+    }
+
+    MagickWand* wand = NULL;
+    if (magick_wand_pool_count > 0)
+        wand = magick_wand_pool[--magick_wand_pool_count];
+
+    pthread_mutex_unlock(&magick_mutex);
+
+    if (wand == NULL)
+        wand = NewMagickWand();
+
+    return wand;
+}
+
+void magick_wand_release(MagickWand* wand)
+{
+    if (wand == NULL)
+        return;
+
+    ClearMagickWand(wand);
+
+    pthread_mutex_lock(&magick_mutex);
+    if (magick_wand_pool_count < MAGICK_WAND_POOL_CAPACITY) {
+        magick_wand_pool[magick_wand_pool_count++] = wand;
+        wand = NULL;
+    }
+    pthread_mutex_unlock(&magick_mutex);
+
+    if (wand != NULL)
+        DestroyMagickWand(wand);
+}
+
+void magick_runtime_shutdown(void)
+{
+    pthread_mutex_lock(&magick_mutex);
+
+    while (magick_wand_pool_count > 0)
+        DestroyMagickWand(magick_wand_pool[--magick_wand_pool_count]);
+
+    if (magick_initialized) {
+        MagickWandTerminus();
+        magick_initialized = false;
+    }
+
+    pthread_mutex_unlock(&magick_mutex);
+}
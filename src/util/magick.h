@@ -1,5 +1,7 @@
 #pragma once
 
+#include <MagickWand/MagickWand.h>
+
 #define magick_log_wand_exception(wand)                                                \
     {                                                                                  \
         ExceptionType severity;                                                        \
@@ -9,3 +11,14 @@
                                                                                        \
         description = (char*)MagickRelinquishMemory(description);                      \
     }
+
+// ImageMagick is initialized once, on the first wand acquired, and stays alive
+// until `magick_runtime_shutdown`. Wands are recycled through a pool, and both
+// functions are safe to call from several threads at once.
+MagickWand* magick_wand_acquire(void);
+// Clears the wand and returns it to the pool. NULL is ignored.
+void magick_wand_release(MagickWand* wand);
+
+// Destroys the pooled wands and shuts ImageMagick down. Every wand must have
+// been released before calling it.
+void magick_runtime_shutdown(void);
@@ -0,0 +1,49 @@
+#include "spsc_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void spsc_queue_init(SpscQueue* queue, size_t item_size, size_t capacity)
+{
+    size_t rounded = 1;
+    while (rounded < capacity)
+        rounded <<= 1;
+
+    queue->items = malloc(rounded * item_size);
+    queue->item_size = item_size;
+    queue->capacity = rounded;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+void spsc_queue_destroy(SpscQueue* queue)
+{
+    free(queue->items);
+    queue->items = NULL;
+}
+
+bool spsc_queue_push(SpscQueue* queue, const void* item)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head == queue->capacity)
+        return false;
+
+    memcpy(&queue->items[(tail & (queue->capacity - 1)) * queue->item_size], item, queue->item_size);
+    // Publishes the item to the consumer
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool spsc_queue_pop(SpscQueue* queue, void* item)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail)
+        return false;
+
+    memcpy(item, &queue->items[(head & (queue->capacity - 1)) * queue->item_size], queue->item_size);
+    // Hands the slot back to the producer
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free bounded queue between exactly one producer thread and one
+// consumer thread. Items are copied in and out by value.
+typedef struct {
+    uint8_t* items;
+    size_t item_size;
+    // Power of two
+    size_t capacity;
+
+    // Padded apart so they don't share a cache line, each one is only
+    // written by one side
+    atomic_size_t head; // Next item to pop, written by the consumer
+    char padding[64];
+    atomic_size_t tail; // Next item to push, written by the producer
+} SpscQueue;
+
+// `capacity` is rounded up to a power of two.
+void spsc_queue_init(SpscQueue* queue, size_t item_size, size_t capacity);
+void spsc_queue_destroy(SpscQueue* queue);
+// Producer side. Returns false if the queue is full.
+bool spsc_queue_push(SpscQueue* queue, const void* item);
+// Consumer side. Returns false if the queue is empty.
+bool spsc_queue_pop(SpscQueue* queue, void* item);
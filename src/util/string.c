@@ -24,10 +24,12 @@ bool string_ends_with(const char* str, const char* suffix)
 
     char* str_lower = alloca(len_str + 1);
     memcpy(str_lower, str, len_str);
+    str_lower[len_str] = '\0';
     strtolwr(str_lower);
 
     char* suffix_lower = alloca(len_suffix + 1);
     memcpy(suffix_lower, suffix, len_suffix);
+    suffix_lower[len_suffix] = '\0';
     strtolwr(suffix_lower);
 
     return strncmp(str_lower + len_str - len_suffix, suffix_lower, len_suffix) == 0;
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    ThreadPoolTask task;
+    void* arg;
+    ThreadPoolGroup* group;
+} ThreadPoolItem;
+
+struct ThreadPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t idle;
+
+    ThreadPoolItem* queue;
+    size_t queue_capacity;
+    size_t queue_head;
+    size_t queue_count;
+
+    size_t running;
+    bool stopping;
+
+    pthread_t* workers;
+    size_t workers_count;
+};
+
+size_t thread_pool_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1;
+}
+
+static void* thread_pool_worker(void* data)
+{
+    ThreadPool* pool = data;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->queue_count == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+
+        if (pool->queue_count == 0 && pool->stopping)
+            break;
+
+        ThreadPoolItem item = pool->queue[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % pool->queue_capacity;
+        pool->queue_count--;
+        pool->running++;
+        pthread_cond_signal(&pool->not_full);
+
+        pthread_mutex_unlock(&pool->mutex);
+        item.task(item.arg);
+        if (item.group != NULL) {
+            pthread_mutex_lock(&item.group->mutex);
+            if (--item.group->pending == 0)
+                pthread_cond_broadcast(&item.group->done);
+            pthread_mutex_unlock(&item.group->mutex);
+        }
+        pthread_mutex_lock(&pool->mutex);
+
+        pool->running--;
+        if (pool->running == 0 && pool->queue_count == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+ThreadPool* thread_pool_create(size_t workers_count, size_t queue_capacity)
+{
+    if (workers_count == 0)
+        workers_count = 1;
+    if (queue_capacity == 0)
+        queue_capacity = 1;
+
+    ThreadPool* pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->queue = calloc(queue_capacity, sizeof(*pool->queue));
+    pool->queue_capacity = queue_capacity;
+    pool->workers = calloc(workers_count, sizeof(*pool->workers));
+    if (pool->queue == NULL || pool->workers == NULL) {
+        free(pool->workers);
+        free(pool->queue);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (size_t i = 0; i < workers_count; ++i) {
+        if (pthread_create(&pool->workers[i], NULL, thread_pool_worker, pool) != 0)
+            break;
+        pool->workers_count++;
+    }
+
+    if (pool->workers_count == 0) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+static void thread_pool_push(ThreadPool* pool, ThreadPoolItem item)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    while (pool->queue_count == pool->queue_capacity)
+        pthread_cond_wait(&pool->not_full, &pool->mutex);
+
+    size_t tail = (pool->queue_head + pool->queue_count) % pool->queue_capacity;
+    pool->queue[tail] = item;
+    pool->queue_count++;
+    pthread_cond_signal(&pool->not_empty);
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_submit(ThreadPool* pool, ThreadPoolTask task, void* arg)
+{
+    thread_pool_push(pool, (ThreadPoolItem) {
+                               .task = task,
+                               .arg = arg,
+                           });
+}
+
+void thread_pool_wait(ThreadPool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->queue_count > 0 || pool->running > 0)
+        pthread_cond_wait(&pool->idle, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_destroy(ThreadPool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->workers_count; ++i)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool->queue);
+    free(pool);
+}
+
+#define THREAD_POOL_GLOBAL_QUEUE_CAPACITY 1024
+
+static ThreadPool* global_pool = NULL;
+static pthread_once_t global_pool_once = PTHREAD_ONCE_INIT;
+
+static void thread_pool_global_init(void)
+{
+    global_pool = thread_pool_create(thread_pool_cpu_count(), THREAD_POOL_GLOBAL_QUEUE_CAPACITY);
+}
+
+ThreadPool* thread_pool_global(void)
+{
+    pthread_once(&global_pool_once, thread_pool_global_init);
+    return global_pool;
+}
+
+void thread_pool_group_init(ThreadPoolGroup* group)
+{
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->done, NULL);
+    group->pending = 0;
+}
+
+void thread_pool_group_destroy(ThreadPoolGroup* group)
+{
+    pthread_cond_destroy(&group->done);
+    pthread_mutex_destroy(&group->mutex);
+}
+
+void thread_pool_group_submit(ThreadPool* pool, ThreadPoolGroup* group, ThreadPoolTask task, void* arg)
+{
+    if (pool == NULL) {
+        task(arg);
+        return;
+    }
+
+    pthread_mutex_lock(&group->mutex);
+    group->pending++;
+    pthread_mutex_unlock(&group->mutex);
+
+    thread_pool_push(pool, (ThreadPoolItem) {
+                               .task = task,
+                               .arg = arg,
+                               .group = group,
+                           });
+}
+
+void thread_pool_group_wait(ThreadPoolGroup* group)
+{
+    pthread_mutex_lock(&group->mutex);
+    while (group->pending > 0)
+        pthread_cond_wait(&group->done, &group->mutex);
+    pthread_mutex_unlock(&group->mutex);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (*ThreadPoolTask)(void* arg);
+
+typedef struct ThreadPool ThreadPool;
+
+// Tracks a subset of the tasks of a pool so they can be waited on without
+// waiting for unrelated work submitted by other threads.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    size_t pending;
+} ThreadPoolGroup;
+
+size_t thread_pool_cpu_count(void);
+
+// Creates a pool of `workers_count` threads. `queue_capacity` bounds the
+// amount of pending tasks: `thread_pool_submit` blocks while the queue is full.
+ThreadPool* thread_pool_create(size_t workers_count, size_t queue_capacity);
+void thread_pool_submit(ThreadPool* pool, ThreadPoolTask task, void* arg);
+// Blocks until every task submitted so far has finished running.
+void thread_pool_wait(ThreadPool* pool);
+void thread_pool_destroy(ThreadPool* pool);
+
+// Process-wide pool with one worker per core, created on first use. Its tasks
+// must not wait on other tasks of the same pool.
+ThreadPool* thread_pool_global(void);
+
+void thread_pool_group_init(ThreadPoolGroup* group);
+void thread_pool_group_destroy(ThreadPoolGroup* group);
+// Without a pool (e.g. `thread_pool_global` failed) the task runs right away
+// on the calling thread.
+void thread_pool_group_submit(ThreadPool* pool, ThreadPoolGroup* group, ThreadPoolTask task, void* arg);
+// Blocks until every task submitted to `group` so far has finished running.
+void thread_pool_group_wait(ThreadPoolGroup* group);
@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+// Events kept until the trace is saved, about 56 MB. Past that, e.g. in a
+// long-running daemon, further events are only counted.
+#define TRACE_MAX_EVENTS (1 << 20)
+
+typedef enum {
+    TRACE_EVENT_SCOPE,
+    TRACE_EVENT_COUNTER,
+} TraceEventKind;
+
+typedef struct {
+    TraceEventKind kind;
+    const char* name;
+    const char* arg_name;
+    int64_t arg_value;
+    uint64_t start;
+    uint64_t duration;
+    uint32_t thread;
+} TraceEvent;
+
+atomic_bool trace_active = false;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char* trace_path = NULL;
+static uint64_t trace_origin = 0;
+static TraceEvent* trace_events = NULL;
+static size_t trace_events_count = 0;
+static size_t trace_events_capacity = 0;
+static size_t trace_events_dropped = 0;
+static size_t trace_arena_high_water = 0;
+
+static atomic_uint trace_next_thread = 1;
+static _Thread_local uint32_t trace_thread = 0;
+
+// Microseconds
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t trace_thread_id(void)
+{
+    if (trace_thread == 0)
+        trace_thread = atomic_fetch_add(&trace_next_thread, 1);
+    return trace_thread;
+}
+
+static void trace_push(TraceEvent event)
+{
+    pthread_mutex_lock(&trace_mutex);
+    // Scopes still open when the trace was saved are dropped
+    if (!trace_enabled()) {
+        pthread_mutex_unlock(&trace_mutex);
+        return;
+    }
+    if (trace_events_count == trace_events_capacity) {
+        size_t capacity = trace_events_capacity ? trace_events_capacity * 2 : 1024;
+        if (capacity > TRACE_MAX_EVENTS)
+            capacity = TRACE_MAX_EVENTS;
+        TraceEvent* events = capacity > trace_events_capacity
+            ? realloc(trace_events, capacity * sizeof(*trace_events))
+            : NULL;
+        if (events == NULL) {
+            trace_events_dropped++;
+            pthread_mutex_unlock(&trace_mutex);
+            return;
+        }
+        trace_events = events;
+        trace_events_capacity = capacity;
+    }
+    trace_events[trace_events_count++] = event;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_start(const char* path)
+{
+    pthread_mutex_lock(&trace_mutex);
+    bool first = trace_path == NULL;
+    free(trace_path);
+    trace_path = strdup(path);
+    trace_origin = trace_now();
+    pthread_mutex_unlock(&trace_mutex);
+
+    if (first)
+        atexit(trace_stop);
+    atomic_store(&trace_active, true);
+}
+
+void trace_start_from_env(void)
+{
+    const char* path = getenv("EXPLODE_TRACE");
+    if (path != NULL && *path != '\0')
+        trace_start(path);
+}
+
+TraceScope trace_scope_begin_slow(const char* name, const char* arg_name, int64_t arg_value)
+{
+    return (TraceScope) {
+        .name = name,
+        .arg_name = arg_name,
+        .arg_value = arg_value,
+        .start = trace_now(),
+    };
+}
+
+void trace_scope_end_slow(TraceScope* scope)
+{
+    uint64_t end = trace_now();
+    trace_push((TraceEvent) {
+        .kind = TRACE_EVENT_SCOPE,
+        .name = scope->name,
+        .arg_name = scope->arg_name,
+        .arg_value = scope->arg_value,
+        .start = scope->start,
+        .duration = end - scope->start,
+        .thread = trace_thread_id(),
+    });
+}
+
+// Resident set size in kilobytes
+static int64_t trace_rss_kb(void)
+{
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return 0;
+
+    long size, resident;
+    int read = fscanf(statm, "%ld %ld", &size, &resident);
+    fclose(statm);
+    return read == 2 ? (int64_t)resident * sysconf(_SC_PAGESIZE) / 1024 : 0;
+}
+
+void trace_arena_usage(size_t used)
+{
+    if (!trace_enabled())
+        return;
+
+    uint64_t now = trace_now();
+    uint32_t thread = trace_thread_id();
+    trace_push((TraceEvent) {
+        .kind = TRACE_EVENT_COUNTER,
+        .name = "arena",
+        .arg_name = "used_bytes",
+        .arg_value = used,
+        .start = now,
+        .thread = thread,
+    });
+    trace_push((TraceEvent) {
+        .kind = TRACE_EVENT_COUNTER,
+        .name = "memory",
+        .arg_name = "rss_kb",
+        .arg_value = trace_rss_kb(),
+        .start = now,
+        .thread = thread,
+    });
+
+    pthread_mutex_lock(&trace_mutex);
+    if (used > trace_arena_high_water)
+        trace_arena_high_water = used;
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void trace_stop(void)
+{
+    if (!atomic_exchange(&trace_active, false))
+        return;
+
+    pthread_mutex_lock(&trace_mutex);
+
+    FILE* file = fopen(trace_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: could not create trace file `%s`\n", trace_path);
+    } else {
+        fprintf(file, "{\"traceEvents\": [");
+        for (size_t i = 0; i < trace_events_count; ++i) {
+            const TraceEvent* event = &trace_events[i];
+            int64_t ts = (int64_t)(event->start - trace_origin);
+
+            fprintf(file, "%s\n  {\"name\": \"%s\", \"pid\": 1, \"tid\": %" PRIu32 ", \"ts\": %" PRId64,
+                    i ? "," : "", event->name, event->thread, ts);
+            if (event->kind == TRACE_EVENT_SCOPE)
+                fprintf(file, ", \"ph\": \"X\", \"dur\": %" PRIu64, event->duration);
+            else
+                fprintf(file, ", \"ph\": \"C\"");
+            if (event->arg_name != NULL)
+                fprintf(file, ", \"args\": {\"%s\": %" PRId64 "}", event->arg_name, event->arg_value);
+            fprintf(file, "}");
+        }
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(file, "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"peak_rss_kb\": %ld, \"arena_high_water_bytes\": %zu, \"dropped_events\": %zu}}\n",
+                usage.ru_maxrss, trace_arena_high_water, trace_events_dropped);
+        fclose(file);
+        printf("Saved trace file `%s`\n", trace_path);
+        if (trace_events_dropped > 0)
+            fprintf(stderr, "WARNING: the trace is full, %zu later events were dropped\n", trace_events_dropped);
+    }
+
+    free(trace_events);
+    trace_events = NULL;
+    trace_events_count = 0;
+    trace_events_capacity = 0;
+    trace_events_dropped = 0;
+
+    pthread_mutex_unlock(&trace_mutex);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Timeline of where a conversion spends its time, written as Chrome trace
+// JSON (chrome://tracing or ui.perfetto.dev) when the process exits. While
+// tracing is off, a scope costs one relaxed load. Only the first million or
+// so events are kept, the rest are counted as dropped.
+
+extern atomic_bool trace_active;
+
+static inline bool trace_enabled(void)
+{
+    return atomic_load_explicit(&trace_active, memory_order_relaxed);
+}
+
+// Starts recording events, saved to `path` at exit
+void trace_start(const char* path);
+// Starts recording if EXPLODE_TRACE is set to a path
+void trace_start_from_env(void);
+// Saves the events recorded so far and stops recording. Called at exit.
+void trace_stop(void);
+
+typedef struct {
+    // NULL when tracing is off
+    const char* name;
+    const char* arg_name;
+    int64_t arg_value;
+    uint64_t start;
+} TraceScope;
+
+TraceScope trace_scope_begin_slow(const char* name, const char* arg_name, int64_t arg_value);
+void trace_scope_end_slow(TraceScope* scope);
+
+static inline TraceScope trace_scope_begin(const char* name, const char* arg_name, int64_t arg_value)
+{
+    if (!trace_enabled())
+        return (TraceScope) { 0 };
+    return trace_scope_begin_slow(name, arg_name, arg_value);
+}
+
+static inline void trace_scope_end(TraceScope* scope)
+{
+    if (scope->name != NULL)
+        trace_scope_end_slow(scope);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records the time until the end of the enclosing block. `name` must be a
+// string literal.
+#define TRACE_SCOPE(name) TRACE_SCOPE_ARG(name, NULL, 0)
+#define TRACE_SCOPE_ARG(name, arg_name, arg_value)                                          \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_scope_end))) \
+    = trace_scope_begin(name, arg_name, arg_value)
+
+// Records the bytes used by an arena being released, and the resident memory
+// of the process at that point. The highest values are saved with the trace.
+void trace_arena_usage(size_t used);
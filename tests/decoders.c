@@ -0,0 +1,362 @@
+// Feeds the APNG and GIF decoders truncated, corrupted and hostile files.
+// They must turn them down or stop early without reading out of bounds, which
+// is best checked with `-Db_sanitize=address`, and refuse headers announcing
+// more than DECODE_MAX_PIXELS before allocating anything.
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "apng_decoder.h"
+#include "gif_decoder.h"
+#include "gif_load.h"
+#include "test_random.h"
+#include "util/buffer.h"
+
+#define DECODERS_TEST_SIZE 6
+#define DECODERS_TEST_FRAMES 2
+#define DECODERS_TEST_CORRUPTIONS 3000
+// Decoding stops after this many frames, corrupted counts may be anything
+#define DECODERS_TEST_MAX_FRAMES 16
+// Corrupted sizes may be anything too, bigger canvases are only opened
+#define DECODERS_TEST_MAX_PIXELS ((size_t)1 << 20)
+
+static void png_chunk(Buffer* file, const char* type, const void* data, size_t size)
+{
+    buffer_append_u32_be(file, size);
+    size_t start = file->size;
+    buffer_append(file, type, 4);
+    if (size > 0)
+        buffer_append(file, data, size);
+    buffer_append_u32_be(file, crc32(0, &file->data[start], size + 4));
+}
+
+static void png_header(Buffer* file, uint32_t width, uint32_t height)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    buffer_append(file, signature, sizeof(signature));
+
+    Buffer header = { 0 };
+    buffer_append_u32_be(&header, width);
+    buffer_append_u32_be(&header, height);
+    // 8-bit RGBA, not interlaced
+    const uint8_t format[5] = { 8, 6, 0, 0, 0 };
+    buffer_append(&header, format, sizeof(format));
+    png_chunk(file, "IHDR", header.data, header.size);
+    buffer_free(&header);
+}
+
+static void png_frame_control(Buffer* file, uint32_t sequence, uint32_t width, uint32_t height, uint32_t x,
+                              uint32_t y)
+{
+    Buffer control = { 0 };
+    buffer_append_u32_be(&control, sequence);
+    buffer_append_u32_be(&control, width);
+    buffer_append_u32_be(&control, height);
+    buffer_append_u32_be(&control, x);
+    buffer_append_u32_be(&control, y);
+    // 4/100 s, no disposal, drawn over
+    const uint8_t rest[6] = { 0, 4, 0, 100, 0, 1 };
+    buffer_append(&control, rest, sizeof(rest));
+    png_chunk(file, "fcTL", control.data, control.size);
+    buffer_free(&control);
+}
+
+// Filtered rows of a `width` x `height` RGBA frame, deflated. The rows use
+// `filter`, which is 0 to 4 for valid ones.
+static void png_frame_data(Buffer* file, const char* type, uint32_t sequence, int width, int height,
+                           uint8_t filter)
+{
+    size_t raw_size = ((size_t)width * 4 + 1) * height;
+    uint8_t* raw = malloc(raw_size);
+    for (size_t i = 0; i < raw_size; ++i)
+        raw[i] = i % ((size_t)width * 4 + 1) == 0 ? filter : test_random();
+
+    uLongf compressed_size = compressBound(raw_size);
+    uint8_t* compressed = malloc(compressed_size + 4);
+    size_t skip = strcmp(type, "fdAT") == 0 ? 4 : 0;
+    compress(&compressed[skip], &compressed_size, raw, raw_size);
+    for (size_t i = 0; i < skip; ++i)
+        compressed[i] = sequence >> (24 - 8 * i);
+    png_chunk(file, type, compressed, compressed_size + skip);
+    free(compressed);
+    free(raw);
+}
+
+// An animated PNG whose second frame covers part of the canvas
+static void png_animation(Buffer* file)
+{
+    png_header(file, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE);
+    const uint8_t animation[8] = { 0, 0, 0, DECODERS_TEST_FRAMES, 0, 0, 0, 0 };
+    png_chunk(file, "acTL", animation, sizeof(animation));
+    png_frame_control(file, 0, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE, 0, 0);
+    png_frame_data(file, "IDAT", 0, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE, 4);
+    png_frame_control(file, 1, 3, 2, 2, 3);
+    png_frame_data(file, "fdAT", 2, 3, 2, 1);
+    png_chunk(file, "IEND", NULL, 0);
+}
+
+// Writes `count` 2-bit indices as LZW codes, with a clear code every two of
+// them so the codes stay 3 bits wide, in sub-blocks
+static void gif_image_data(Buffer* file, const uint8_t* indices, size_t count)
+{
+    enum { CLEAR = 4, END = 5, CODE_BITS = 3 };
+    Buffer codes = { 0 };
+    uint32_t bits = 0;
+    int bits_count = 0;
+    for (size_t i = 0; i <= count; ++i) {
+        int code = i == count ? END : indices[i];
+        if (i % 2 == 0) {
+            bits |= (uint32_t)CLEAR << bits_count;
+            bits_count += CODE_BITS;
+        }
+        bits |= (uint32_t)code << bits_count;
+        bits_count += CODE_BITS;
+        for (; bits_count >= 8; bits_count -= 8, bits >>= 8)
+            buffer_append_byte(&codes, bits & 0xFF);
+    }
+    if (bits_count > 0)
+        buffer_append_byte(&codes, bits & 0xFF);
+
+    buffer_append_byte(file, 2);
+    for (size_t i = 0; i < codes.size; i += 255) {
+        size_t block = codes.size - i < 255 ? codes.size - i : 255;
+        buffer_append_byte(file, block);
+        buffer_append(file, &codes.data[i], block);
+    }
+    buffer_append_byte(file, 0);
+    buffer_free(&codes);
+}
+
+static void gif_frame(Buffer* file, int x, int y, int width, int height)
+{
+    // Graphic control: 4/100 s, index 3 transparent
+    const uint8_t control[8] = { 0x21, 0xF9, 4, 0x01, 4, 0, 3, 0 };
+    buffer_append(file, control, sizeof(control));
+
+    buffer_append_byte(file, 0x2C);
+    buffer_append_u16_le(file, x);
+    buffer_append_u16_le(file, y);
+    buffer_append_u16_le(file, width);
+    buffer_append_u16_le(file, height);
+    buffer_append_byte(file, 0);
+
+    uint8_t indices[DECODERS_TEST_SIZE * DECODERS_TEST_SIZE];
+    for (int i = 0; i < width * height; ++i)
+        indices[i] = test_random() % 4;
+    gif_image_data(file, indices, (size_t)width * height);
+}
+
+static void gif_header(Buffer* file, uint16_t width, uint16_t height)
+{
+    buffer_append(file, "GIF89a", 6);
+    buffer_append_u16_le(file, width);
+    buffer_append_u16_le(file, height);
+    // Global table of 4 colors
+    const uint8_t screen[3] = { 0x81, 0, 0 };
+    buffer_append(file, screen, sizeof(screen));
+    const uint8_t colors[12] = { 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255 };
+    buffer_append(file, colors, sizeof(colors));
+}
+
+static void gif_animation(Buffer* file)
+{
+    gif_header(file, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE);
+    gif_frame(file, 0, 0, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE);
+    gif_frame(file, 2, 3, 3, 2);
+    buffer_append_byte(file, 0x3B);
+}
+
+typedef enum {
+    DECODE_APNG,
+    DECODE_GIF,
+} DecodeFormat;
+
+// Decodes every frame of `data`. Returns the amount decoded, or -1 if it
+// could not be opened, and sets `failed` as the decoder does.
+static int decode(DecodeFormat format, const uint8_t* data, size_t size, bool* failed)
+{
+    ApngDecoder* apng = NULL;
+    GifDecoder* gif = NULL;
+    int width, height;
+    if (format == DECODE_APNG) {
+        apng = apng_decoder_open(data, size, failed);
+        if (apng == NULL)
+            return -1;
+        width = apng_decoder_width(apng);
+        height = apng_decoder_height(apng);
+    } else {
+        gif = gif_decoder_open(data, size, failed);
+        if (gif == NULL)
+            return -1;
+        width = gif_decoder_width(gif);
+        height = gif_decoder_height(gif);
+    }
+
+    uint8_t* pixels = NULL;
+    if ((size_t)width * height <= DECODERS_TEST_MAX_PIXELS)
+        pixels = malloc((size_t)width * height * 4);
+    int frames = 0;
+    while (pixels && frames < DECODERS_TEST_MAX_FRAMES
+           && (apng ? apng_decoder_next(apng, pixels, NULL) : gif_decoder_next(gif, pixels, NULL)))
+        ++frames;
+
+    free(pixels);
+    if (apng)
+        apng_decoder_close(apng);
+    if (gif)
+        gif_decoder_close(gif);
+    return frames;
+}
+
+static bool expect_frames(const char* name, DecodeFormat format, const Buffer* file, int expected)
+{
+    bool failed;
+    int frames = decode(format, file->data, file->size, &failed);
+    if (frames != expected) {
+        fprintf(stderr, "ERROR: %s: decoded %d frames instead of %d\n", name, frames, expected);
+        return false;
+    }
+    return true;
+}
+
+// Must be turned down without allocating, and not be tried by other means
+static bool expect_failed(const char* name, DecodeFormat format, const Buffer* file)
+{
+    bool failed;
+    int frames = decode(format, file->data, file->size, &failed);
+    if (frames >= 0 || !failed) {
+        fprintf(stderr, "ERROR: %s: was not refused\n", name);
+        return false;
+    }
+    return true;
+}
+
+// Every prefix of the file, and copies with a few random bytes changed. Each
+// is copied to a block of its exact size, so reads past it are caught.
+static bool damage(const char* name, DecodeFormat format, const Buffer* file)
+{
+    bool failed;
+    for (size_t size = 1; size < file->size; ++size) {
+        uint8_t* prefix = malloc(size);
+        memcpy(prefix, file->data, size);
+        int frames = decode(format, prefix, size, &failed);
+        free(prefix);
+        if (frames > DECODERS_TEST_FRAMES) {
+            fprintf(stderr, "ERROR: %s: decoded more frames than written from %zu bytes\n", name, size);
+            return false;
+        }
+    }
+
+    uint8_t* copy = malloc(file->size);
+    for (int i = 0; i < DECODERS_TEST_CORRUPTIONS; ++i) {
+        memcpy(copy, file->data, file->size);
+        for (uint32_t j = 0, count = 1 + test_random() % 4; j < count; ++j)
+            copy[test_random() % file->size] = test_random();
+        decode(format, copy, file->size, &failed);
+    }
+    free(copy);
+    return true;
+}
+
+// Checks `gif_file_is_animated` on the file and every prefix of it, which
+// must not be animated unless the whole file is and the prefix reaches its
+// second frame
+static bool expect_animated(const char* name, const Buffer* file, bool expected)
+{
+    char path[] = "/tmp/explode-decoders-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not create a temporary file\n");
+        return false;
+    }
+
+    bool ok = true;
+    bool was_animated = false;
+    for (size_t size = 1; size <= file->size && ok; ++size) {
+        ok = ftruncate(fd, 0) == 0 && pwrite(fd, file->data, size, 0) == (ssize_t)size;
+        if (!ok) {
+            fprintf(stderr, "ERROR: could not write a temporary file\n");
+            break;
+        }
+
+        bool animated = gif_file_is_animated(path);
+        if ((animated && !expected) || (was_animated && !animated)
+            || (size == file->size && animated != expected)) {
+            fprintf(stderr, "ERROR: %s: %zu of %zu bytes are %s animated\n", name, size, file->size,
+                    animated ? "seen as" : "not seen as");
+            ok = false;
+        }
+        was_animated = animated;
+    }
+
+    close(fd);
+    remove(path);
+    return ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    Buffer apng = { 0 };
+    png_animation(&apng);
+    ok = expect_frames("APNG", DECODE_APNG, &apng, DECODERS_TEST_FRAMES) && ok;
+    ok = damage("APNG", DECODE_APNG, &apng) && ok;
+    ok = expect_animated("APNG", &apng, true) && ok;
+    buffer_free(&apng);
+
+    Buffer gif = { 0 };
+    gif_animation(&gif);
+    ok = expect_frames("GIF", DECODE_GIF, &gif, DECODERS_TEST_FRAMES) && ok;
+    ok = damage("GIF", DECODE_GIF, &gif) && ok;
+    ok = expect_animated("GIF", &gif, true) && ok;
+    buffer_free(&gif);
+
+    Buffer file = { 0 };
+    png_header(&file, 65536, 65536);
+    png_chunk(&file, "IEND", NULL, 0);
+    ok = expect_failed("PNG of 65536x65536", DECODE_APNG, &file) && ok;
+    buffer_free(&file);
+
+    // Offsets that wrap around in 32 bits
+    file = (Buffer) { 0 };
+    png_header(&file, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE);
+    png_chunk(&file, "acTL", (const uint8_t[8]) { 0, 0, 0, 1 }, 8);
+    png_frame_control(&file, 0, 32, 32, 0xFFFFFFF0, 0);
+    png_frame_data(&file, "IDAT", 0, 32, 32, 0);
+    png_chunk(&file, "IEND", NULL, 0);
+    ok = expect_frames("APNG frame outside the canvas", DECODE_APNG, &file, 0) && ok;
+    buffer_free(&file);
+
+    file = (Buffer) { 0 };
+    png_header(&file, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE);
+    png_frame_data(&file, "IDAT", 0, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE, 5);
+    png_chunk(&file, "IEND", NULL, 0);
+    ok = expect_frames("PNG with an unknown filter", DECODE_APNG, &file, 0) && ok;
+    ok = expect_animated("PNG", &file, false) && ok;
+    buffer_free(&file);
+
+    file = (Buffer) { 0 };
+    gif_header(&file, 65535, 65535);
+    buffer_append_byte(&file, 0x3B);
+    ok = expect_failed("GIF of 65535x65535", DECODE_GIF, &file) && ok;
+    buffer_free(&file);
+
+    // A frame much bigger than the canvas, which it is clipped to
+    file = (Buffer) { 0 };
+    gif_header(&file, DECODERS_TEST_SIZE, DECODERS_TEST_SIZE);
+    const uint8_t descriptor[10] = { 0x2C, 0, 0, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0 };
+    buffer_append(&file, descriptor, sizeof(descriptor));
+    gif_image_data(&file, (const uint8_t[2]) { 1, 2 }, 2);
+    buffer_append_byte(&file, 0x3B);
+    ok = expect_frames("GIF frame of 65535x65535", DECODE_GIF, &file, 0) && ok;
+    ok = expect_animated("GIF of one frame", &file, false) && ok;
+    buffer_free(&file);
+
+    return ok ? 0 : 1;
+}
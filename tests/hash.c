@@ -0,0 +1,88 @@
+// Checks `hash_xxh64` against reference XXH64 values, as the result cache
+// keys files by them and must agree with any other XXH64 implementation.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/hash.h"
+
+typedef struct {
+    const char* text;
+    uint64_t seed;
+    uint64_t expected;
+} HashTextVector;
+
+// Published with xxHash
+static const HashTextVector hash_text_vectors[] = {
+    { "", 0, 0xEF46DB3751D8E999 },
+    { "a", 0, 0xD24EC4F1A98C6E5B },
+    { "abc", 0, 0x44BC2CF5AD770999 },
+    { "Nobody inspects the spammish repetition", 0, 0xFBCEA83C8A378BF1 },
+};
+
+typedef struct {
+    size_t size;
+    uint64_t seed;
+    uint64_t expected;
+} HashVector;
+
+// Of the first `size` bytes of `hash_data`, covering every tail length and
+// inputs on both sides of the 32-byte stripes
+static const HashVector hash_vectors[] = {
+    { 0, 0x0000000000000000, 0xEF46DB3751D8E999 },
+    { 1, 0x0000000000000000, 0xA96C7F0CE858BBB7 },
+    { 3, 0x0000000000000000, 0xBED43740EE6332BB },
+    { 4, 0x0000000000000000, 0xFA212AE44B3BB23D },
+    { 7, 0x0000000000000000, 0x2744460DD675D2C0 },
+    { 8, 0x0000000000000000, 0x994B676B71CE94DD },
+    { 15, 0x0000000000000000, 0x09E6451ED2FF8B1D },
+    { 31, 0x0000000000000000, 0x6711D55E306B5D8F },
+    { 32, 0x0000000000000000, 0x07F7B8E3BC5D6E25 },
+    { 33, 0x0000000000000000, 0x09F85EEB4E1CBE9F },
+    { 63, 0x0000000000000000, 0xB7C9968C066CB6A5 },
+    { 100, 0x0000000000000000, 0x9DDADA11D3DC2D8F },
+    { 256, 0x0000000000000000, 0xA2DBE913965256FC },
+    { 0, 0x9E3779B97F4A7C15, 0xC4349FC93C010000 },
+    { 5, 0x9E3779B97F4A7C15, 0xF51EDA3A20DE9B88 },
+    { 32, 0x9E3779B97F4A7C15, 0x046E99BBDA1A814B },
+    { 256, 0x9E3779B97F4A7C15, 0x0FDD97B3E0F22D80 },
+};
+
+int main(void)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(hash_text_vectors) / sizeof(hash_text_vectors[0]); ++i) {
+        const HashTextVector* vector = &hash_text_vectors[i];
+        uint64_t hash = hash_xxh64(vector->text, strlen(vector->text), vector->seed);
+        if (hash != vector->expected) {
+            fprintf(stderr, "ERROR: XXH64 of \"%s\" is %016llx instead of %016llx\n", vector->text,
+                    (unsigned long long)hash, (unsigned long long)vector->expected);
+            ok = false;
+        }
+    }
+
+    uint8_t hash_data[256];
+    for (size_t i = 0; i < 256; ++i)
+        hash_data[i] = i * 131 + 7;
+
+    for (size_t i = 0; i < sizeof(hash_vectors) / sizeof(hash_vectors[0]); ++i) {
+        const HashVector* vector = &hash_vectors[i];
+        // Also hashed from an odd address
+        uint8_t unaligned[sizeof(hash_data) + 1];
+        memcpy(&unaligned[1], hash_data, vector->size);
+
+        uint64_t hash = hash_xxh64(hash_data, vector->size, vector->seed);
+        uint64_t unaligned_hash = hash_xxh64(&unaligned[1], vector->size, vector->seed);
+        if (hash != vector->expected || unaligned_hash != vector->expected) {
+            fprintf(stderr,
+                    "ERROR: XXH64 of %zu bytes with seed %016llx is %016llx (unaligned: %016llx) instead of %016llx\n",
+                    vector->size, (unsigned long long)vector->seed, (unsigned long long)hash,
+                    (unsigned long long)unaligned_hash, (unsigned long long)vector->expected);
+            ok = false;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
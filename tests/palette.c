@@ -0,0 +1,98 @@
+// Checks the shared GIF palette: built on the thread pool the same as from
+// one histogram, and rows mapped with the vector path the same as pixel by
+// pixel, which always takes the scalar one.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+#include "test_random.h"
+
+#define PALETTE_TEST_FRAMES 5
+#define PALETTE_TEST_WIDTH 83
+#define PALETTE_TEST_HEIGHT 31
+#define PALETTE_TEST_ROWS 2000
+
+static bool palette_build_check(const uint8_t* const* frames, size_t pixels_count, Palette* palette)
+{
+    palette_build(palette, frames, PALETTE_TEST_FRAMES, pixels_count, 128);
+
+    static PaletteHistogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    for (size_t i = 0; i < PALETTE_TEST_FRAMES; ++i)
+        palette_histogram_add(&histogram, frames[i], pixels_count, 128);
+    Palette expected;
+    palette_from_histogram(&expected, &histogram, PALETTE_MAX_COLORS - 1);
+
+    if (palette->count != expected.count || palette->transparent_index != expected.transparent_index
+        || memcmp(palette->colors, expected.colors, sizeof(expected.colors[0]) * expected.count) != 0) {
+        fprintf(stderr, "ERROR: the palette built on the thread pool differs from the one built serially\n");
+        return false;
+    }
+    return true;
+}
+
+static bool palette_map_check(const Palette* palette, const uint8_t* pixels, size_t pixels_count)
+{
+    static PaletteMap map;
+    palette_map_init(&map, palette);
+
+    for (uint32_t cell = 0; cell < PALETTE_HISTOGRAM_SIZE; ++cell) {
+        int r = (cell >> 10) << 3 | 4;
+        int g = ((cell >> 5) & 31) << 3 | 4;
+        int b = (cell & 31) << 3 | 4;
+        if (map.lookup[cell] != palette_nearest(palette, r, g, b)) {
+            fprintf(stderr, "ERROR: cell %u is not mapped to the nearest palette entry\n", cell);
+            return false;
+        }
+    }
+
+    uint8_t actual[PALETTE_TEST_WIDTH];
+    uint8_t expected[PALETTE_TEST_WIDTH];
+    for (int row = 0; row < PALETTE_TEST_ROWS; ++row) {
+        // Any length and position, so the dither pattern starts at any phase
+        int count = 1 + test_random() % PALETTE_TEST_WIDTH;
+        size_t start = test_random() % (pixels_count - count + 1);
+        int x = test_random() % 1024;
+        int y = test_random() % 1024;
+        uint8_t alpha_threshold = test_random();
+
+        palette_map_row(&map, &pixels[start * 4], count, x, y, alpha_threshold, actual);
+        for (int i = 0; i < count; ++i)
+            palette_map_row(&map, &pixels[(start + i) * 4], 1, x + i, y, alpha_threshold, &expected[i]);
+
+        for (int i = 0; i < count; ++i) {
+            if (actual[i] != expected[i]) {
+                fprintf(stderr, "ERROR: pixel %d of a row of %d at (%d, %d) is mapped to %d instead of %d\n", i,
+                        count, x, y, actual[i], expected[i]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    size_t pixels_count = (size_t)PALETTE_TEST_WIDTH * PALETTE_TEST_HEIGHT;
+    uint8_t* frames[PALETTE_TEST_FRAMES];
+    for (size_t i = 0; i < PALETTE_TEST_FRAMES; ++i) {
+        frames[i] = malloc(pixels_count * 4);
+        if (frames[i] == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            return 1;
+        }
+        for (size_t j = 0; j < pixels_count * 4; ++j)
+            frames[i][j] = test_random();
+    }
+
+    Palette palette;
+    bool ok = palette_build_check((const uint8_t* const*)frames, pixels_count, &palette)
+        && palette_map_check(&palette, frames[0], pixels_count);
+
+    for (size_t i = 0; i < PALETTE_TEST_FRAMES; ++i)
+        free(frames[i]);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+// Runs every remap kernel the CPU supports on random sources and offsets, and
+// checks that they write exactly what the scalar reference kernel does.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "explode_remap.h"
+#include "test_random.h"
+
+#define REMAP_TEST_ROUNDS 200
+#define REMAP_TEST_MAX_SIZE 67
+
+static int test_random_range(int min, int max)
+{
+    return min + (int)(test_random() % (uint32_t)(max - min + 1));
+}
+
+// Runs `kernel` over the rows the offsets cover, in a few random bands
+static void remap_run(const ExplodeRemap* remap, ExplodeRemapRows kernel, int y_begin, int y_end)
+{
+    while (y_begin < y_end) {
+        int y = test_random_range(y_begin + 1, y_end);
+        kernel(remap, y_begin, y);
+        y_begin = y;
+    }
+}
+
+static bool remap_compare(const ExplodeRemapKernel* kernels, size_t kernels_count, int width, int height)
+{
+    int cx = width / 2;
+    int cy = height / 2;
+    int quadrant_width = cx + 1;
+    // Sometimes only the rows from `offsets_row` on, as for a tiled band
+    int offsets_row = test_random() % 2 ? test_random_range(0, cy) : 0;
+    size_t offsets_count = (size_t)(cy + 1 - offsets_row) * quadrant_width;
+    size_t pixels_count = (size_t)width * height;
+
+    uint32_t* src = malloc(pixels_count * sizeof(*src));
+    uint32_t* expected = malloc(pixels_count * sizeof(*expected));
+    uint32_t* actual = malloc(pixels_count * sizeof(*actual));
+    int32_t* offsets_x = malloc(offsets_count * sizeof(*offsets_x));
+    int32_t* offsets_y = malloc(offsets_count * sizeof(*offsets_y));
+    if (!src || !expected || !actual || !offsets_x || !offsets_y) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < pixels_count; ++i)
+        src[i] = test_random();
+    // Past the edges on both sides too, which the kernels clamp
+    for (size_t i = 0; i < offsets_count; ++i) {
+        offsets_x[i] = test_random_range(-8, width + 8);
+        offsets_y[i] = test_random_range(-8, height + 8);
+    }
+
+    ExplodeRemap remap = {
+        .src = src,
+        .offsets_x = offsets_x,
+        .offsets_y = offsets_y,
+        .offsets_row = offsets_row,
+        .quadrant_width = quadrant_width,
+        .width = width,
+        .height = height,
+        .cx = cx,
+        .cy = cy,
+    };
+
+    // Rows above and below the center that are at least `offsets_row` away
+    int top_end = cy - offsets_row + 1;
+    int bottom_begin = cy + offsets_row > top_end ? cy + offsets_row : top_end;
+
+    memset(expected, 0, pixels_count * sizeof(*expected));
+    remap.dst = expected;
+    kernels[0].remap_rows(&remap, 0, top_end);
+    if (bottom_begin < height)
+        kernels[0].remap_rows(&remap, bottom_begin, height);
+
+    bool ok = true;
+    for (size_t k = 1; k < kernels_count && ok; ++k) {
+        memset(actual, 0, pixels_count * sizeof(*actual));
+        remap.dst = actual;
+        remap_run(&remap, kernels[k].remap_rows, 0, top_end);
+        remap_run(&remap, kernels[k].remap_rows, bottom_begin, height);
+
+        for (size_t i = 0; i < pixels_count && ok; ++i) {
+            if (actual[i] != expected[i]) {
+                fprintf(stderr, "ERROR: %s kernel differs from scalar at (%zu, %zu) of %dx%d, offsets from row %d\n",
+                        kernels[k].name, i % width, i / width, width, height, offsets_row);
+                ok = false;
+            }
+        }
+    }
+
+    free(src);
+    free(expected);
+    free(actual);
+    free(offsets_x);
+    free(offsets_y);
+    return ok;
+}
+
+int main(void)
+{
+    const ExplodeRemapKernel* kernels;
+    size_t kernels_count = explode_remap_kernels(&kernels);
+    for (size_t k = 0; k < kernels_count; ++k)
+        printf("Testing the %s remap kernel\n", kernels[k].name);
+
+    bool ok = true;
+    for (int round = 0; round < REMAP_TEST_ROUNDS && ok; ++round) {
+        int width = test_random_range(1, REMAP_TEST_MAX_SIZE);
+        int height = test_random_range(1, REMAP_TEST_MAX_SIZE);
+        ok = remap_compare(kernels, kernels_count, width, height);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,395 @@
+// Encodes animations with the native encoders, decodes them back with the
+// native decoders, and checks every frame and delay against the original,
+// along with the frames planned by `frame_optimize`.
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apng_decoder.h"
+#include "apng_encoder.h"
+#include "frame_optimize.h"
+#include "gif_decoder.h"
+#include "gif_encoder.h"
+#include "palette.h"
+#include "test_random.h"
+#include "util/buffer.h"
+
+#define ROUNDTRIP_MAX_FRAMES 8
+#define ROUNDTRIP_DELAY 4
+
+typedef struct {
+    const char* name;
+    int width;
+    int height;
+    size_t frames_count;
+    uint8_t* frames[ROUNDTRIP_MAX_FRAMES];
+    // Few enough colors for a GIF palette to hold them all exactly, and
+    // pixels either opaque or fully transparent
+    bool gif;
+} Animation;
+
+static uint8_t* animation_add_frame(Animation* animation)
+{
+    uint8_t* frame = calloc((size_t)animation->width * animation->height, 4);
+    if (frame == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    animation->frames[animation->frames_count++] = frame;
+    return frame;
+}
+
+static void animation_free(Animation* animation)
+{
+    for (size_t i = 0; i < animation->frames_count; ++i)
+        free(animation->frames[i]);
+}
+
+// A square moving and fading over a transparent background, so frames both
+// cover and uncover pixels
+static Animation animation_square(void)
+{
+    Animation animation = { "square", 37, 23, 0, { 0 }, false };
+    for (int i = 0; i < 6; ++i) {
+        uint8_t* frame = animation_add_frame(&animation);
+        for (int y = 4; y < 14; ++y) {
+            for (int x = 3 * i; x < 3 * i + 10; ++x) {
+                uint8_t* pixel = &frame[((size_t)y * animation.width + x) * 4];
+                pixel[0] = 200;
+                pixel[1] = 40 * i;
+                pixel[2] = 90;
+                pixel[3] = 255 - 40 * i;
+            }
+        }
+    }
+    return animation;
+}
+
+// Every pixel changes in every frame, with any alpha
+static Animation animation_noise(void)
+{
+    Animation animation = { "noise", 16, 9, 0, { 0 }, false };
+    for (int i = 0; i < 4; ++i) {
+        uint8_t* frame = animation_add_frame(&animation);
+        for (size_t j = 0; j < (size_t)animation.width * animation.height * 4; ++j)
+            frame[j] = test_random();
+    }
+    return animation;
+}
+
+// Runs of identical frames, which are merged into one longer frame
+static Animation animation_blink(void)
+{
+    Animation animation = { "blink", 12, 12, 0, { 0 }, true };
+    const int lit[] = { 0, 0, 1, 1, 1, 0, 1 };
+    for (size_t i = 0; i < sizeof(lit) / sizeof(lit[0]); ++i) {
+        uint8_t* frame = animation_add_frame(&animation);
+        for (int y = 2; y < 5; ++y) {
+            uint8_t* pixel = &frame[((size_t)y * animation.width + 7) * 4];
+            memset(pixel, lit[i] ? 255 : 0, 4);
+            pixel[3] = 255;
+        }
+    }
+    return animation;
+}
+
+// Opaque bars of a few colors scrolling over a transparent background
+static Animation animation_stripes(void)
+{
+    static const uint8_t colors[][3] = {
+        { 230, 30, 40 }, { 20, 160, 60 }, { 30, 60, 220 }, { 250, 210, 0 }, { 255, 255, 255 },
+    };
+    Animation animation = { "stripes", 29, 15, 0, { 0 }, true };
+    for (int i = 0; i < 5; ++i) {
+        uint8_t* frame = animation_add_frame(&animation);
+        for (int y = 0; y < animation.height; ++y) {
+            for (int x = 0; x < animation.width; ++x) {
+                int bar = (x + 2 * i) / 4;
+                if (bar % 6 == 5)
+                    continue;
+                uint8_t* pixel = &frame[((size_t)y * animation.width + x) * 4];
+                memcpy(pixel, colors[bar % 5], 3);
+                pixel[3] = 255;
+            }
+        }
+    }
+    return animation;
+}
+
+static bool read_file(const char* path, Buffer* buffer)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    uint8_t chunk[4096];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        buffer_append(buffer, chunk, size);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+static bool pixels_equal(const uint8_t* a, const uint8_t* b, size_t pixels_count)
+{
+    for (size_t i = 0; i < pixels_count; ++i, a += 4, b += 4) {
+        // The color of transparent pixels is not kept
+        if (a[3] == 0 && b[3] == 0)
+            continue;
+        if (memcmp(a, b, 4) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Frames that differ from the previous one, where each decoded frame starts
+static size_t animation_runs(const Animation* animation, size_t* starts)
+{
+    size_t pixels_count = (size_t)animation->width * animation->height;
+    size_t count = 0;
+    for (size_t i = 0; i < animation->frames_count; ++i) {
+        if (i == 0 || !pixels_equal(animation->frames[i], animation->frames[i - 1], pixels_count))
+            starts[count++] = i;
+    }
+    return count;
+}
+
+// Bounds of the pixels that differ between `a` and `b`
+static FrameRect pixels_changed(const uint8_t* a, const uint8_t* b, int width, int height)
+{
+    int x0 = width, y0 = height, x1 = -1, y1 = -1;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            size_t i = ((size_t)y * width + x) * 4;
+            if (pixels_equal(&a[i], &b[i], 1))
+                continue;
+            x0 = x < x0 ? x : x0;
+            y0 = y < y0 ? y : y0;
+            x1 = x > x1 ? x : x1;
+            y1 = y > y1 ? y : y1;
+        }
+    }
+    return x1 < 0 ? (FrameRect) { 0 } : (FrameRect) { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+}
+
+static bool frame_rect_empty(FrameRect rect)
+{
+    return rect.width <= 0 || rect.height <= 0;
+}
+
+static FrameRect frame_rect_union(FrameRect a, FrameRect b)
+{
+    if (frame_rect_empty(a))
+        return b;
+    if (frame_rect_empty(b))
+        return a;
+
+    int x0 = a.x < b.x ? a.x : b.x;
+    int y0 = a.y < b.y ? a.y : b.y;
+    int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (FrameRect) { x0, y0, x1 - x0, y1 - y0 };
+}
+
+static bool frame_rect_equal(FrameRect a, FrameRect b)
+{
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
+}
+
+// One frame per run of identical frames, each only covering the pixels that
+// changed and the area the previous frame cleared. Frames that are disposed
+// are grown by the area the next one needs cleared.
+static bool plan_check(const Animation* animation, const FramePlan* plan)
+{
+    size_t starts[ROUNDTRIP_MAX_FRAMES];
+    size_t runs = animation_runs(animation, starts);
+    if (plan->frames_count != runs) {
+        fprintf(stderr, "ERROR: %s: planned %zu frames instead of %zu\n", animation->name, plan->frames_count,
+                runs);
+        return false;
+    }
+
+    for (size_t i = 1; i < runs; ++i) {
+        const OptimizedFrame* frame = &plan->frames[i];
+        FrameRect expected = pixels_changed(animation->frames[starts[i]], animation->frames[starts[i - 1]],
+                                            animation->width, animation->height);
+        expected = frame_rect_union(expected, frame->redraw);
+        bool ok = frame->dispose == FRAME_DISPOSE_BACKGROUND
+            ? frame_rect_equal(frame_rect_union(frame->rect, expected), frame->rect)
+            : frame_rect_equal(frame->rect, expected);
+        if (!ok) {
+            fprintf(stderr, "ERROR: %s: frame %zu covers %dx%d at (%d, %d) instead of %dx%d at (%d, %d)\n",
+                    animation->name, i, frame->rect.width, frame->rect.height, frame->rect.x, frame->rect.y,
+                    expected.width, expected.height, expected.x, expected.y);
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef enum {
+    ROUNDTRIP_APNG,
+    // Without the frame count up front, written when closing
+    ROUNDTRIP_APNG_STREAMED,
+    ROUNDTRIP_GIF,
+} RoundtripFormat;
+
+static const char* roundtrip_format_names[] = { "APNG", "streamed APNG", "GIF" };
+
+static bool roundtrip_encode(const Animation* animation, RoundtripFormat format, const char* path)
+{
+    bool gif = format == ROUNDTRIP_GIF;
+    FrameOptimizeOptions options = gif ? (FrameOptimizeOptions) { GIF_ALPHA_THRESHOLD, true }
+                                       : (FrameOptimizeOptions) { 0 };
+    FramePlan plan = frame_optimize((const uint8_t* const*)animation->frames, animation->frames_count,
+                                    animation->width, animation->height, ROUNDTRIP_DELAY, options);
+    if (!plan_check(animation, &plan)) {
+        frame_plan_free(&plan);
+        return false;
+    }
+
+    bool ok;
+    if (gif) {
+        Palette palette;
+        palette_build(&palette, (const uint8_t* const*)animation->frames, animation->frames_count,
+                      (size_t)animation->width * animation->height, GIF_ALPHA_THRESHOLD);
+        GifEncoder* encoder = gif_encoder_open(path, animation->width, animation->height, &palette);
+        ok = encoder != NULL;
+        for (size_t i = 0; ok && i < plan.frames_count; ++i)
+            gif_encoder_add_frame(encoder, &plan.frames[i]);
+        ok = ok && gif_encoder_close(encoder);
+    } else {
+        ApngEncoder* encoder = apng_encoder_open(path, animation->width, animation->height,
+                                                 format == ROUNDTRIP_APNG ? plan.frames_count : 0);
+        ok = encoder != NULL;
+        for (size_t i = 0; ok && i < plan.frames_count; ++i)
+            apng_encoder_add_frame(encoder, &plan.frames[i]);
+        ok = ok && apng_encoder_close(encoder);
+    }
+    frame_plan_free(&plan);
+    return ok;
+}
+
+typedef struct {
+    RoundtripFormat format;
+    ApngDecoder* apng;
+    GifDecoder* gif;
+} RoundtripDecoder;
+
+static bool roundtrip_decoder_open(RoundtripDecoder* decoder, const Buffer* file, int* width, int* height,
+                                   size_t* frames_count)
+{
+    bool failed = false;
+    if (decoder->format == ROUNDTRIP_GIF) {
+        decoder->gif = gif_decoder_open(file->data, file->size, &failed);
+        if (decoder->gif == NULL)
+            return false;
+        *width = gif_decoder_width(decoder->gif);
+        *height = gif_decoder_height(decoder->gif);
+        *frames_count = gif_decoder_frames_count(decoder->gif);
+    } else {
+        decoder->apng = apng_decoder_open(file->data, file->size, &failed);
+        if (decoder->apng == NULL)
+            return false;
+        *width = apng_decoder_width(decoder->apng);
+        *height = apng_decoder_height(decoder->apng);
+        *frames_count = apng_decoder_frames_count(decoder->apng);
+    }
+    return true;
+}
+
+static bool roundtrip_decoder_next(RoundtripDecoder* decoder, void* pixels, int* delay)
+{
+    return decoder->gif ? gif_decoder_next(decoder->gif, pixels, delay)
+                        : apng_decoder_next(decoder->apng, pixels, delay);
+}
+
+static void roundtrip_decoder_close(RoundtripDecoder* decoder)
+{
+    if (decoder->gif)
+        gif_decoder_close(decoder->gif);
+    if (decoder->apng)
+        apng_decoder_close(decoder->apng);
+}
+
+static bool roundtrip(const Animation* animation, RoundtripFormat format)
+{
+    const char* format_name = roundtrip_format_names[format];
+    char path[] = "/tmp/explode-roundtrip-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not create a temporary file\n");
+        return false;
+    }
+    close(fd);
+
+    Buffer file = { 0 };
+    bool ok = roundtrip_encode(animation, format, path) && read_file(path, &file);
+    remove(path);
+    if (!ok) {
+        fprintf(stderr, "ERROR: %s: could not write the %s file\n", animation->name, format_name);
+        buffer_free(&file);
+        return false;
+    }
+
+    size_t starts[ROUNDTRIP_MAX_FRAMES];
+    size_t runs = animation_runs(animation, starts);
+    RoundtripDecoder decoder = { .format = format };
+    int width, height;
+    size_t frames_count;
+    if (!roundtrip_decoder_open(&decoder, &file, &width, &height, &frames_count)
+        || width != animation->width || height != animation->height || frames_count != runs) {
+        fprintf(stderr, "ERROR: %s: the %s header does not match the animation\n", animation->name, format_name);
+        ok = false;
+    }
+
+    size_t pixels_count = (size_t)animation->width * animation->height;
+    uint8_t* pixels = malloc(pixels_count * 4);
+    for (size_t i = 0; ok && i < runs; ++i) {
+        size_t end = i + 1 < runs ? starts[i + 1] : animation->frames_count;
+        int expected_delay = ROUNDTRIP_DELAY * (int)(end - starts[i]);
+        int delay = 0;
+        if (!roundtrip_decoder_next(&decoder, pixels, &delay)) {
+            fprintf(stderr, "ERROR: %s: %s frame %zu could not be decoded\n", animation->name, format_name, i);
+            ok = false;
+        } else if (!pixels_equal(pixels, animation->frames[starts[i]], pixels_count)) {
+            fprintf(stderr, "ERROR: %s: %s frame %zu differs from the original\n", animation->name, format_name,
+                    i);
+            ok = false;
+        } else if (delay != expected_delay) {
+            fprintf(stderr, "ERROR: %s: %s frame %zu lasts %d instead of %d\n", animation->name, format_name, i,
+                    delay, expected_delay);
+            ok = false;
+        }
+    }
+    if (ok && roundtrip_decoder_next(&decoder, pixels, NULL)) {
+        fprintf(stderr, "ERROR: %s: the %s file has more frames than the animation\n", animation->name,
+                format_name);
+        ok = false;
+    }
+
+    free(pixels);
+    roundtrip_decoder_close(&decoder);
+    buffer_free(&file);
+    return ok;
+}
+
+int main(void)
+{
+    Animation animations[] = { animation_square(), animation_noise(), animation_blink(), animation_stripes() };
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(animations) / sizeof(animations[0]); ++i) {
+        ok = roundtrip(&animations[i], ROUNDTRIP_APNG) && ok;
+        ok = roundtrip(&animations[i], ROUNDTRIP_APNG_STREAMED) && ok;
+        if (animations[i].gif)
+            ok = roundtrip(&animations[i], ROUNDTRIP_GIF) && ok;
+        animation_free(&animations[i]);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+// Random numbers for the tests, each of which has its own sequence
+static uint64_t test_random_state = 0x9E3779B97F4A7C15;
+
+static inline uint32_t test_random(void)
+{
+    // xorshift64*, fixed seed so failures can be reproduced
+    test_random_state ^= test_random_state >> 12;
+    test_random_state ^= test_random_state << 25;
+    test_random_state ^= test_random_state >> 27;
+    return (test_random_state * 0x2545F4914F6CDD1D) >> 32;
+}